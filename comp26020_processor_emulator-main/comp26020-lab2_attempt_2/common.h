@@ -69,6 +69,44 @@ typedef int data_t;
  */
 typedef uint8_t byte_t;
 
+/**
+ * Mix the bits of a 64-bit value (the splitmix64 finaliser)
+ *
+ * Every input bit affects every output bit, so it turns small or regular
+ * values (addresses, counters) into well-spread keys.
+ */
+constexpr uint64_t mix64(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+/**
+ * The Zobrist key of a memory byte holding a value
+ *
+ * The keys are computed rather than stored: a table with one key per
+ * address and value would be 512KB, which costs more in cache misses than
+ * the two multiplications of mix64().
+ */
+constexpr uint64_t zobrist_key(addr_t address, byte_t value) {
+  return mix64((((uint64_t)address << 8) | value) + 0x2545f4914f6cdd1dULL);
+}
+
+/**
+ * The Zobrist hash of a memory full of zeroes, i.e. of a new ProcessorState
+ */
+constexpr uint64_t zobrist_zero_memory() {
+  uint64_t hash = 0;
+  for (int address = 0; address < MEMORY_SIZE; ++address)
+    hash ^= zobrist_key(address, 0);
+  return hash;
+}
+
+inline constexpr uint64_t ZOBRIST_ZERO_MEMORY = zobrist_zero_memory();
+
 /**
  * A basic struct that just holds the two bytes representing the instruction in the memory
  *
@@ -106,6 +144,16 @@ struct ProcessorState {
    */
   byte_t memory[MEMORY_SIZE];
 
+  /**
+   * Zobrist hash of the memory: the XOR of zobrist_key(address, byte) over
+   * all the addresses.
+   *
+   * STR keeps it up to date by XOR'ing out the key of the old byte and in
+   * the key of the new one. Code that writes memory directly must update it
+   * the same way, or call rehash().
+   */
+  uint64_t memory_hash;
+
   /**
    * The default constructor.
    * It resets the state of the machine.
@@ -116,6 +164,23 @@ struct ProcessorState {
     pc = 0;
     for (int i = 0; i < MEMORY_SIZE; ++i)
       memory[i] = 0;
+    memory_hash = ZOBRIST_ZERO_MEMORY;
+  }
+
+  /**
+   * Recompute memory_hash from scratch, after writing memory directly
+   */
+  void rehash() {
+    memory_hash = 0;
+    for (int i = 0; i < MEMORY_SIZE; ++i)
+      memory_hash ^= zobrist_key(i, memory[i]);
+  }
+
+  /**
+   * A 64-bit fingerprint of the whole state in O(1): memory_hash with acc and pc folded in
+   */
+  uint64_t fingerprint() const {
+    return memory_hash ^ mix64(((uint64_t)(uint32_t)acc << 32) | (uint32_t)pc);
   }
 };
 
@@ -210,6 +275,18 @@ class InstructionBase {
      */
     static InstructionBase* generateInstruction(InstructionData data);
 
+    /**
+     * A non-allocating alternative to generateInstruction()
+     *
+     * Instructions are immutable once constructed, so every (opcode, address)
+     * pair only ever needs one object. This returns a pointer into a table of
+     * all of them, built on the first call and shared by everyone afterwards.
+     *
+     * @param data The two bytes of the instruction
+     * @return A **non-owning** pointer to the shared instruction object, or NULL for invalid opcodes
+     */
+    static const InstructionBase* lookupInstruction(InstructionData data);
+
   protected:
     /**
      * The default constructor
@@ -0,0 +1,169 @@
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include "condition.h"
+
+// Operand kinds, bits 0-3 of the first word of a term
+#define COND_ACC 0
+#define COND_PC 1
+#define COND_HITS 2
+#define COND_MEM 3
+
+// Comparisons, bits 4-7 of the first word of a term
+#define COND_EQ 0
+#define COND_NE 1
+#define COND_LT 2
+#define COND_LE 3
+#define COND_GT 4
+#define COND_GE 5
+
+// The memory address of mem[] terms lives in bits 8-15
+#define COND_WORD(operand, comparison, address) \
+  ((uint32_t)(operand) | ((uint32_t)(comparison) << 4) | ((uint32_t)(address) << 8))
+
+// ----------> Parsing helpers
+// All of them advance `pos` past what they consumed and return 0 on failure
+
+static void skip_spaces(const std::string& text, size_t& pos) {
+  while (pos < text.size() && isspace((unsigned char)text[pos]))
+    ++pos;
+}
+
+static int match(const std::string& text, size_t& pos, const char* token) {
+  skip_spaces(text, pos);
+  size_t len = strlen(token);
+  if (text.compare(pos, len, token) != 0)
+    return 0;
+  pos += len;
+  return 1;
+}
+
+static int parse_number(const std::string& text, size_t& pos, uint32_t& value) {
+  skip_spaces(text, pos);
+  if (pos >= text.size() || !isdigit((unsigned char)text[pos]))
+    return 0;
+
+  uint64_t result = 0;
+  while (pos < text.size() && isdigit((unsigned char)text[pos])) {
+    result = result * 10 + (text[pos] - '0');
+    if (result > UINT32_MAX)
+      return 0;
+    ++pos;
+  }
+  value = result;
+  return 1;
+}
+
+static int parse_comparison(const std::string& text, size_t& pos, int& comparison) {
+  // Two-character comparisons first, so that "<=" isn't read as "<"
+  if (match(text, pos, "=="))
+    comparison = COND_EQ;
+  else if (match(text, pos, "!="))
+    comparison = COND_NE;
+  else if (match(text, pos, "<="))
+    comparison = COND_LE;
+  else if (match(text, pos, ">="))
+    comparison = COND_GE;
+  else if (match(text, pos, "<"))
+    comparison = COND_LT;
+  else if (match(text, pos, ">"))
+    comparison = COND_GT;
+  else
+    return 0;
+  return 1;
+}
+
+// ----------> BreakpointCondition
+
+BreakpointCondition::BreakpointCondition() { }
+
+int BreakpointCondition::compile(const std::string source) {
+  std::vector<uint32_t> code;
+  size_t pos = 0;
+
+  skip_spaces(source, pos);
+  if (pos == source.size()) {
+    _code.clear();
+    _source.clear();
+    return 1;
+  }
+
+  do {
+    int operand;
+    uint32_t address = 0;
+
+    if (match(source, pos, "acc"))
+      operand = COND_ACC;
+    else if (match(source, pos, "pc"))
+      operand = COND_PC;
+    else if (match(source, pos, "hits"))
+      operand = COND_HITS;
+    else if (match(source, pos, "mem")) {
+      operand = COND_MEM;
+      if (!match(source, pos, "[") || !parse_number(source, pos, address) || !match(source, pos, "]"))
+        return 0;
+      if (address >= MEMORY_SIZE)
+        return 0;
+    } else
+      return 0;
+
+    int comparison;
+    uint32_t value;
+    if (!parse_comparison(source, pos, comparison) || !parse_number(source, pos, value))
+      return 0;
+
+    code.push_back(COND_WORD(operand, comparison, address));
+    code.push_back(value);
+  } while (match(source, pos, "&&"));
+
+  // Trailing garbage
+  skip_spaces(source, pos);
+  if (pos != source.size())
+    return 0;
+
+  // Keep the text without surrounding whitespace, since that's what gets saved
+  size_t first = source.find_first_not_of(" \t\r\n");
+  size_t last = source.find_last_not_of(" \t\r\n");
+
+  _code = code;
+  _source = source.substr(first, last - first + 1);
+  return 1;
+}
+
+int BreakpointCondition::evaluate(const ProcessorState& state, uint32_t hits) const {
+  for (size_t idx = 0; idx < _code.size(); idx += 2) {
+    uint32_t word = _code[idx];
+    uint32_t value = _code[idx + 1];
+
+    uint32_t operand;
+    switch (word & 0xf) {
+      case COND_ACC:  operand = state.acc; break;
+      case COND_PC:   operand = state.pc; break;
+      case COND_HITS: operand = hits; break;
+      default:        operand = state.memory[(word >> 8) & ARCH_BITMASK]; break;
+    }
+
+    int holds;
+    switch ((word >> 4) & 0xf) {
+      case COND_EQ: holds = operand == value; break;
+      case COND_NE: holds = operand != value; break;
+      case COND_LT: holds = operand < value; break;
+      case COND_LE: holds = operand <= value; break;
+      case COND_GT: holds = operand > value; break;
+      default:      holds = operand >= value; break;
+    }
+
+    if (!holds)
+      return 0;
+  }
+
+  return 1;
+}
+
+int BreakpointCondition::empty() const {
+  return _code.empty();
+}
+
+const std::string BreakpointCondition::get_source() const {
+  return _source;
+}
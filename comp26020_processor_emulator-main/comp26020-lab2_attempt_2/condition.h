@@ -0,0 +1,69 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: condition.h
+//
+// Conditions attached to breakpoints, e.g. `acc == 0`, `mem[63] > 100` or
+// `hits >= 10`. A condition is parsed once, when it is attached, into a small
+// predicate program, so the emulation loop never deals with text. The program
+// is only evaluated when the pc hits the address of a conditional breakpoint.
+//
+// Grammar (whitespace between tokens is optional):
+//   condition := term ( "&&" term )*
+//   term      := operand comparison number
+//   operand   := "acc" | "pc" | "hits" | "mem[" number "]"
+//   comparison:= "==" | "!=" | "<" | "<=" | ">" | ">="
+//
+// `hits` is the number of times the breakpoint address has been reached,
+// counting the current one.
+// -----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include "common.h"
+
+/**
+ * A compiled breakpoint condition
+ *
+ * Each term is compiled into two 32-bit words: the first packs the operand
+ * kind, the comparison and the memory address (for mem[] terms); the second
+ * holds the number we compare against. All terms must hold for the condition
+ * to hold. An empty condition always holds.
+ */
+class BreakpointCondition {
+  public:
+    BreakpointCondition();
+
+    /**
+     * Parse and compile a condition, replacing the current one
+     *
+     * An empty (or all-whitespace) string removes the condition.
+     *
+     * @param source The condition text
+     * @return 1 for success, 0 if the text is not a valid condition (the current condition is kept)
+     */
+    int compile(const std::string source);
+
+    /**
+     * Evaluate the condition against a processor state
+     *
+     * @param state The state to test
+     * @param hits How many times the breakpoint has been reached, including this time
+     * @return 1 if the condition holds, 0 otherwise
+     */
+    int evaluate(const ProcessorState& state, uint32_t hits) const;
+
+    /**
+     * @return 1 if there's no condition (so it always holds), 0 otherwise
+     */
+    int empty() const;
+
+    /**
+     * The condition as given to compile(), used when saving the state
+     */
+    const std::string get_source() const;
+
+  private:
+    std::vector<uint32_t> _code;
+    std::string _source;
+};
@@ -0,0 +1,172 @@
+#include <cstdio>
+#include <cstring>
+#include <cinttypes>
+#include "counters.h"
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char* const COUNTER_NAMES[NUM_PERF_COUNTERS] = {
+  "instructions", "cycles", "branch-misses", "L1-dcache-load-misses"
+};
+
+// ============= CounterReading ==============
+double CounterReading::per_instruction(PerfCounter counter) const {
+  if (!available[counter] || emulated == 0)
+    return 0;
+  return (double)value[counter] / emulated;
+}
+
+int CounterReading::print() const {
+  int any = 0;
+  for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter) {
+    if (!available[counter]) {
+      printf("%s\tnot available\n", COUNTER_NAMES[counter]);
+      continue;
+    }
+    printf("%s\t%" PRIu64 "\t%.3f per emulated instruction\n", COUNTER_NAMES[counter], value[counter],
+           per_instruction((PerfCounter)counter));
+    any = 1;
+  }
+  return any;
+}
+
+// ============= CounterSession ==============
+#if defined(__linux__)
+
+/**
+ * Open one counter for the calling thread, on whichever CPU it runs
+ *
+ * @param type The perf_event_attr type
+ * @param config The perf_event_attr config
+ * @param group_fd The group leader, or -1 to start a new group
+ * @return The file descriptor, or -1 if the counter isn't available
+ */
+static int open_counter(uint32_t type, uint64_t config, int group_fd) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = type;
+  attr.config = config;
+  // The leader starts disabled and the members follow it
+  attr.disabled = group_fd == -1;
+  // Only the emulator, not the kernel: this is also what unprivileged users may count
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+CounterSession::CounterSession() {
+  static const uint32_t TYPES[NUM_PERF_COUNTERS] = {
+    PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE
+  };
+  static const uint64_t CONFIGS[NUM_PERF_COUNTERS] = {
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+    PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+  };
+
+  for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter) {
+    fds[counter] = open_counter(TYPES[counter], CONFIGS[counter], leader);
+    if (fds[counter] < 0)
+      fds[counter] = -1;
+    else if (leader == -1)
+      leader = fds[counter];
+  }
+}
+
+CounterSession::~CounterSession() {
+  // Members first, then the leader
+  for (int counter = NUM_PERF_COUNTERS - 1; counter >= 0; --counter)
+    if (fds[counter] != -1)
+      close(fds[counter]);
+}
+
+void CounterSession::start() {
+  if (leader == -1)
+    return;
+  ioctl(leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+  ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+}
+
+void CounterSession::stop(CounterReading& reading) {
+  if (leader != -1)
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter) {
+    reading.value[counter] = 0;
+    reading.available[counter] = 0;
+    if (fds[counter] == -1)
+      continue;
+
+    // value, time enabled, time running
+    uint64_t data[3];
+    if (read(fds[counter], data, sizeof(data)) != (ssize_t)sizeof(data))
+      continue;
+
+    // If the PMU was shared with other groups, extrapolate to the whole run
+    reading.available[counter] = 1;
+    if (data[2] != 0 && data[2] < data[1])
+      reading.value[counter] = (uint64_t)((double)data[0] * data[1] / data[2]);
+    else
+      reading.value[counter] = data[0];
+  }
+}
+
+#else
+
+// No perf_event_open: every counter is unavailable, runs still work
+
+CounterSession::CounterSession() {
+  for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter)
+    fds[counter] = -1;
+}
+
+CounterSession::~CounterSession() {
+}
+
+void CounterSession::start() {
+}
+
+void CounterSession::stop(CounterReading& reading) {
+  for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter) {
+    reading.value[counter] = 0;
+    reading.available[counter] = 0;
+  }
+}
+
+#endif
+
+int CounterSession::available() const {
+  return leader != -1;
+}
+
+int CounterSession::is_available(PerfCounter counter) const {
+  return fds[counter] != -1;
+}
+
+RunResult CounterSession::run(Emulator& emulator, uint64_t steps, CounterReading& reading) {
+  start();
+  RunResult result = emulator.run_detailed(steps);
+  stop(reading);
+
+  reading.emulated = result.cycles;
+  return result;
+}
+
+void CounterSession::run_many(std::span<Emulator> emulators, uint64_t steps, RunResult* out, CounterReading& reading) {
+  start();
+  Emulator::run_many(emulators, steps, out);
+  stop(reading);
+
+  reading.emulated = 0;
+  for (size_t i = 0; i < emulators.size(); ++i)
+    reading.emulated += out[i].cycles;
+}
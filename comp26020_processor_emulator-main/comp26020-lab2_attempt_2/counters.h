@@ -0,0 +1,139 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: counters.h
+//
+// Hardware performance counters around runs of the emulator. A CounterSession
+// opens one perf_event_open group (Linux only) counting the host instructions,
+// cycles, branch misses and L1 data cache misses of the calling thread, and
+// enables it only while the emulator runs, so nothing else (test harness,
+// load_state(), ...) ends up in the counts.
+//
+// Counters are often missing: other operating systems, virtual machines
+// without a PMU, containers, or perf_event_paranoid settings. The session then
+// reports them as unavailable and still runs the emulator.
+// -----------------------------------------------------------------------------
+
+#include <span>
+#include "emulator.h"
+
+/**
+ * The hardware events a CounterSession counts
+ */
+enum PerfCounter {
+  PERF_INSTRUCTIONS = 0,  // host instructions retired
+  PERF_CYCLES,            // host cycles
+  PERF_BRANCH_MISSES,     // mispredicted host branches
+  PERF_L1D_MISSES,        // L1 data cache read misses
+  NUM_PERF_COUNTERS
+};
+
+/**
+ * What a CounterSession measured over one run or batch
+ */
+struct CounterReading {
+  /**
+   * The count of each event, indexed by PerfCounter
+   *
+   * Scaled up if the kernel had to multiplex the counters, 0 if unavailable.
+   */
+  uint64_t value[NUM_PERF_COUNTERS];
+
+  /**
+   * 1 if the event was counted, 0 if the counter couldn't be opened
+   */
+  int available[NUM_PERF_COUNTERS];
+
+  /**
+   * How many emulated instructions (cycles of the emulator) were executed
+   */
+  uint64_t emulated;
+
+  /**
+   * @param counter Which event
+   * @return the count of the event divided by the emulated instructions, or 0 if either is missing
+   */
+  double per_instruction(PerfCounter counter) const;
+
+  /**
+   * Prints on stdout one line per event with the count and the count per emulated instruction
+   *
+   * @return 1 for success, 0 if no counter was available
+   */
+  int print() const;
+};
+
+/**
+ * A group of performance counters for the calling thread
+ *
+ * Open the session on the thread that will run the emulators. The counters
+ * are opened once, in the constructor, and each run() or run_many() resets,
+ * enables and disables them together.
+ */
+class CounterSession {
+  public:
+    /**
+     * Open the counters
+     *
+     * Never fails: counters that can't be opened are left out of the group.
+     */
+    CounterSession();
+
+    /**
+     * Close the counters
+     */
+    ~CounterSession();
+
+    CounterSession(const CounterSession& other) = delete;
+    CounterSession& operator=(const CounterSession& other) = delete;
+
+    /**
+     * @return 1 if at least one counter was opened, 0 otherwise
+     */
+    int available() const;
+
+    /**
+     * @param counter Which event
+     * @return 1 if the counter was opened, 0 otherwise
+     */
+    int is_available(PerfCounter counter) const;
+
+    /**
+     * Emulator::run_detailed(), with the counters enabled only while it runs
+     *
+     * @param emulator The emulator to run
+     * @param steps The maximum number of cycles to execute
+     * @param reading Filled in with the counts; emulated is result.cycles
+     * @return What run_detailed() returned
+     */
+    RunResult run(Emulator& emulator, uint64_t steps, CounterReading& reading);
+
+    /**
+     * Emulator::run_many(), with the counters enabled only while it runs
+     *
+     * @param emulators The emulators to advance
+     * @param steps The maximum number of cycles for each emulator
+     * @param out One RunResult per emulator, like run_many()
+     * @param reading Filled in with the counts for the whole batch; emulated is the sum of the cycles
+     */
+    void run_many(std::span<Emulator> emulators, uint64_t steps, RunResult* out, CounterReading& reading);
+
+  private:
+    /**
+     * Reset and enable the group
+     */
+    void start();
+
+    /**
+     * Disable the group and read it
+     *
+     * @param reading Filled in with the values and availability, but not emulated
+     */
+    void stop(CounterReading& reading);
+
+    // File descriptors from perf_event_open, -1 for counters that couldn't be opened
+    int fds[NUM_PERF_COUNTERS];
+
+    // The first counter that opened; the others are in its group
+    int leader = -1;
+};
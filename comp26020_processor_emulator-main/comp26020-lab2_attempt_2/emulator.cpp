@@ -2,12 +2,75 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <array>
 #include <utility>
 #include <memory>
+#include <thread>
 #include "emulator.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "probes.h"
+#include "trace.h"
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define HOST_TICKS_TSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HOST_TICKS_TSC
+#endif
+
+/**
+ * Read the host clock used by instruction timing
+ *
+ * The TSC where there is one: reading it takes a few dozen cycles, so it can
+ * time parts of a single emulated instruction. Anywhere else the monotonic clock.
+ *
+ * @return TSC ticks on x86, nanoseconds otherwise
+ */
+static inline uint64_t host_ticks() {
+#if defined(HOST_TICKS_TSC)
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// ============= CancelToken ==============
+CancelToken::CancelToken() : _cancelled(false) { }
+
+void CancelToken::cancel() {
+  _cancelled.store(true, std::memory_order_relaxed);
+}
+
+void CancelToken::reset() {
+  _cancelled.store(false, std::memory_order_relaxed);
+}
+
+int CancelToken::is_cancelled() const {
+  return _cancelled.load(std::memory_order_relaxed);
+}
+
+// ============= RunResult ==============
+int RunResult::failed() const {
+  return reason == STOP_ODD_PC || reason == STOP_INVALID_OPCODE;
+}
+
+void RunResult::reset(int count) {
+  reason = STOP_STEPS;
+  cycles = 0;
+  breakpoint = -1;
+  watchpoint = -1;
+  cycle_break = 0;
+  counted = count;
+  for (int op = 0; op < NUM_OPCODES; ++op)
+    opcode_counts[op] = 0;
+}
 
 // ============= Breakpoint ==============
-Breakpoint::Breakpoint() { }
+Breakpoint::Breakpoint() {
+}
 
 Breakpoint::Breakpoint(addr_t address, const std::string name) {
   _address = address & ARCH_BITMASK;
@@ -18,12 +81,18 @@ Breakpoint::Breakpoint(addr_t address, const std::string name) {
 Breakpoint::Breakpoint(const Breakpoint& other) {
   _address = other._address;
   _name = other._name;
+  _group = other._group;
+  _condition = other._condition;
+  _hits = other._hits;
 }
 
 // Move constructor
 Breakpoint::Breakpoint(Breakpoint&& other) noexcept {
   std::swap(_address, other._address);
   std::swap(_name, other._name);
+  std::swap(_group, other._group);
+  std::swap(_condition, other._condition);
+  std::swap(_hits, other._hits);
 }
 
 // Copy assignment
@@ -32,6 +101,9 @@ Breakpoint& Breakpoint::operator=(const Breakpoint& other) {
     return *this;
   _address = other._address;
   _name = other._name;
+  _group = other._group;
+  _condition = other._condition;
+  _hits = other._hits;
   return *this;
 }
 
@@ -39,6 +111,9 @@ Breakpoint& Breakpoint::operator=(const Breakpoint& other) {
 Breakpoint& Breakpoint::operator=(Breakpoint&& other) noexcept {
   std::swap(_address, other._address);
   std::swap(_name, other._name);
+  std::swap(_group, other._group);
+  std::swap(_condition, other._condition);
+  std::swap(_hits, other._hits);
   return *this;
 }
 
@@ -58,6 +133,94 @@ int Breakpoint::has(const std::string name) const {
   return (_name == name);
 }
 
+int Breakpoint::set_condition(const std::string condition) {
+  return _condition.compile(condition);
+}
+
+const std::string Breakpoint::get_condition() const {
+  return _condition.get_source();
+}
+
+const BreakpointCondition& Breakpoint::get_compiled_condition() const {
+  return _condition;
+}
+
+int Breakpoint::has_condition() const {
+  return !_condition.empty();
+}
+
+const std::string Breakpoint::get_group() const {
+  return _group;
+}
+
+void Breakpoint::set_group(const std::string group) {
+  _group = group;
+}
+
+uint32_t Breakpoint::get_hits() const {
+  if (_hits == nullptr)
+    return 0;
+  return _hits->load(std::memory_order_relaxed);
+}
+
+void Breakpoint::set_hit_counter(std::shared_ptr<const std::atomic<uint32_t>> counter) {
+  _hits = std::move(counter);
+}
+
+// ============= ExecutionProfile ==============
+uint64_t ExecutionProfile::total() const {
+  uint64_t sum = 0;
+  for (int slot = 0; slot < MAX_INSTRUCTIONS; ++slot)
+    sum += executions[slot];
+  return sum;
+}
+
+// ============= OpcodeTiming ==============
+double OpcodeTiming::average(const uint64_t (&ticks)[NUM_OPCODES], int opcode) const {
+  if (count[opcode] == 0)
+    return 0;
+
+  // Each part is timed between two clock reads, which cost clock_overhead on their own
+  double overhead = (double)clock_overhead * count[opcode];
+  if (ticks[opcode] <= overhead)
+    return 0;
+  return (ticks[opcode] - overhead) / count[opcode];
+}
+
+// ============= BreakpointChannel ==============
+BreakpointChannel::~BreakpointChannel() {
+  delete published.load();
+  for (BreakpointTable* old : retired)
+    delete old;
+}
+
+// ============= Watchpoint ==============
+Watchpoint::Watchpoint(addr_t address, const std::string name, WatchKind kind) {
+  _address = address & ARCH_BITMASK;
+  _name = name;
+  _kind = kind;
+}
+
+addr_t Watchpoint::get_address() const {
+  return _address;
+}
+
+const std::string Watchpoint::get_name() const {
+  return _name;
+}
+
+WatchKind Watchpoint::get_kind() const {
+  return _kind;
+}
+
+int Watchpoint::has(addr_t address) const {
+  return _address == (address & ARCH_BITMASK);
+}
+
+int Watchpoint::has(const std::string name) const {
+  return _name == name;
+}
+
 // ============= Emulator ==============
 
 // ----------> Initialisation
@@ -71,7 +234,20 @@ Emulator::Emulator() {
   breakpoints = std::make_shared<Breakpoint[]>(MAX_INSTRUCTIONS); // new Breakpoint[MAX_INSTRUCTIONS];
   
   breakpoints_sz = 0;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i) {
+    breakpoint_mask[i] = 0;
+    ungrouped_mask[i] = 0;
+    conditional_mask[i] = 0;
+    watch_mask[i] = 0;
+    watch_change_mask[i] = 0;
+  }
   total_cycles = 0;
+
+  channel = std::make_shared<BreakpointChannel>();
+  publish_breakpoints();
+
+  seqlock = std::make_unique<StateSeqlock>();
+  publish_state();
 }
 
 // Copy Constructor
@@ -80,18 +256,83 @@ Emulator::Emulator(const Emulator& other) {
   breakpoints = std::make_shared<Breakpoint[]>(MAX_INSTRUCTIONS); // new Breakpoint[MAX_INSTRUCTIONS];
   // breakpoints = new Breakpoint[MAX_INSTRUCTIONS];
   breakpoints_sz = other.breakpoints_sz;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i) {
+    breakpoint_mask[i] = other.breakpoint_mask[i];
+    ungrouped_mask[i] = other.ungrouped_mask[i];
+    conditional_mask[i] = other.conditional_mask[i];
+    watch_mask[i] = other.watch_mask[i];
+    watch_change_mask[i] = other.watch_change_mask[i];
+    fetched_mask[i] = other.fetched_mask[i];
+  }
+  groups = other.groups;
+  watchpoints = other.watchpoints;
   total_cycles = other.total_cycles;
-
-  for (int i = 0; i < breakpoints_sz; ++i)
+  break_cycle = other.break_cycle;
+  break_period = other.break_period;
+  opcode_break_mask = other.opcode_break_mask;
+  for (int i = 0; i < (ARCH_MAXVAL + 1) / 64; ++i)
+    acc_break_mask[i] = other.acc_break_mask[i];
+  acc_breaks = other.acc_breaks;
+  instr_break_mask = other.instr_break_mask;
+  cancel_token = other.cancel_token;
+  last_stop = other.last_stop;
+  count_opcodes = other.count_opcodes;
+  profile = other.profile ? std::make_unique<ExecutionProfile>(*other.profile) : nullptr;
+  profiling = other.profiling;
+  timing = other.timing ? std::make_unique<OpcodeTiming>(*other.timing) : nullptr;
+  timing_enabled = other.timing_enabled;
+  trace = nullptr;
+  latencies = other.latencies;
+
+  channel = std::make_shared<BreakpointChannel>();
+  for (int i = 0; i < MEMORY_SIZE; ++i)
+    channel->hits[i].store(other.channel->hits[i].load());
+
+  // The copies read their hits from our counters, not the other emulator's
+  for (int i = 0; i < breakpoints_sz; ++i) {
     breakpoints[i] = other.breakpoints[i];
+    breakpoints[i].set_hit_counter(hit_counter(breakpoints[i].get_address()));
+  }
+  publish_breakpoints();
+
+  seqlock = std::make_unique<StateSeqlock>();
+  publish_state();
 }
 
 // Move Constructor
-Emulator::Emulator(Emulator&& other) noexcept {
+// Starts from an empty emulator, so the swaps leave the moved-from one with its
+// own channel, seqlock and breakpoint storage, ready to be assigned to or run
+Emulator::Emulator(Emulator&& other) noexcept : Emulator() {
   std::swap(state, other.state);
   std::swap(breakpoints, other.breakpoints);
   std::swap(breakpoints_sz, other.breakpoints_sz);
+  std::swap(breakpoint_mask, other.breakpoint_mask);
+  std::swap(ungrouped_mask, other.ungrouped_mask);
+  std::swap(groups, other.groups);
+  std::swap(conditional_mask, other.conditional_mask);
+  std::swap(watchpoints, other.watchpoints);
+  std::swap(watch_mask, other.watch_mask);
+  std::swap(watch_change_mask, other.watch_change_mask);
+  std::swap(fetched_mask, other.fetched_mask);
   std::swap(total_cycles, other.total_cycles);
+  std::swap(channel, other.channel);
+  std::swap(table, other.table);
+  std::swap(seqlock, other.seqlock);
+  std::swap(break_cycle, other.break_cycle);
+  std::swap(break_period, other.break_period);
+  std::swap(opcode_break_mask, other.opcode_break_mask);
+  std::swap(acc_break_mask, other.acc_break_mask);
+  std::swap(acc_breaks, other.acc_breaks);
+  std::swap(instr_break_mask, other.instr_break_mask);
+  std::swap(cancel_token, other.cancel_token);
+  std::swap(last_stop, other.last_stop);
+  std::swap(count_opcodes, other.count_opcodes);
+  std::swap(profile, other.profile);
+  std::swap(profiling, other.profiling);
+  std::swap(timing, other.timing);
+  std::swap(timing_enabled, other.timing_enabled);
+  std::swap(trace, other.trace);
+  std::swap(latencies, other.latencies);
 }
 
 // Copy Assignment Operator
@@ -103,10 +344,44 @@ Emulator& Emulator::operator=(const Emulator& other) {
   breakpoints = std::make_shared<Breakpoint[]>(MAX_INSTRUCTIONS); // new Breakpoint[MAX_INSTRUCTIONS];
   // breakpoints = new Breakpoint[MAX_INSTRUCTIONS];
   breakpoints_sz = other.breakpoints_sz;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i) {
+    breakpoint_mask[i] = other.breakpoint_mask[i];
+    ungrouped_mask[i] = other.ungrouped_mask[i];
+    conditional_mask[i] = other.conditional_mask[i];
+    watch_mask[i] = other.watch_mask[i];
+    watch_change_mask[i] = other.watch_change_mask[i];
+    fetched_mask[i] = other.fetched_mask[i];
+  }
+  groups = other.groups;
+  watchpoints = other.watchpoints;
   total_cycles = other.total_cycles;
-
-  for (int i = 0; i < breakpoints_sz; ++i)
+  break_cycle = other.break_cycle;
+  break_period = other.break_period;
+  opcode_break_mask = other.opcode_break_mask;
+  for (int i = 0; i < (ARCH_MAXVAL + 1) / 64; ++i)
+    acc_break_mask[i] = other.acc_break_mask[i];
+  acc_breaks = other.acc_breaks;
+  instr_break_mask = other.instr_break_mask;
+  cancel_token = other.cancel_token;
+  last_stop = other.last_stop;
+  count_opcodes = other.count_opcodes;
+  profile = other.profile ? std::make_unique<ExecutionProfile>(*other.profile) : nullptr;
+  profiling = other.profiling;
+  timing = other.timing ? std::make_unique<OpcodeTiming>(*other.timing) : nullptr;
+  timing_enabled = other.timing_enabled;
+  trace = nullptr;
+  latencies = other.latencies;
+
+  for (int i = 0; i < MEMORY_SIZE; ++i)
+    channel->hits[i].store(other.channel->hits[i].load());
+
+  // The copies read their hits from our counters, not the other emulator's
+  for (int i = 0; i < breakpoints_sz; ++i) {
     breakpoints[i] = other.breakpoints[i];
+    breakpoints[i].set_hit_counter(hit_counter(breakpoints[i].get_address()));
+  }
+  publish_breakpoints();
+  publish_state();
   return *this;
 }
 
@@ -115,7 +390,33 @@ Emulator& Emulator::operator=(Emulator&& other) noexcept {
   std::swap(state, other.state);
   std::swap(breakpoints, other.breakpoints);
   std::swap(breakpoints_sz, other.breakpoints_sz);
+  std::swap(breakpoint_mask, other.breakpoint_mask);
+  std::swap(ungrouped_mask, other.ungrouped_mask);
+  std::swap(groups, other.groups);
+  std::swap(conditional_mask, other.conditional_mask);
+  std::swap(watchpoints, other.watchpoints);
+  std::swap(watch_mask, other.watch_mask);
+  std::swap(watch_change_mask, other.watch_change_mask);
+  std::swap(fetched_mask, other.fetched_mask);
   std::swap(total_cycles, other.total_cycles);
+  std::swap(channel, other.channel);
+  std::swap(table, other.table);
+  std::swap(seqlock, other.seqlock);
+  std::swap(break_cycle, other.break_cycle);
+  std::swap(break_period, other.break_period);
+  std::swap(opcode_break_mask, other.opcode_break_mask);
+  std::swap(acc_break_mask, other.acc_break_mask);
+  std::swap(acc_breaks, other.acc_breaks);
+  std::swap(instr_break_mask, other.instr_break_mask);
+  std::swap(cancel_token, other.cancel_token);
+  std::swap(last_stop, other.last_stop);
+  std::swap(count_opcodes, other.count_opcodes);
+  std::swap(profile, other.profile);
+  std::swap(profiling, other.profiling);
+  std::swap(timing, other.timing);
+  std::swap(timing_enabled, other.timing_enabled);
+  std::swap(trace, other.trace);
+  std::swap(latencies, other.latencies);
   return *this;
 }
 
@@ -142,42 +443,477 @@ int Emulator::execute(InstructionBase* instr) {
 }
 
 int Emulator::run(int steps) {
-  // No steps to execute
-  if (steps == 0)
+  // Negative step counts behave like zero, as they always have
+  if (steps <= 0) {
+    last_stop = STOP_STEPS;
     return 1;
+  }
 
-  // Repeat for the given number of steps
-  // Break with return code 0, if we find an error
-  // Break with return code 1, if we find a breakpoint
-  // Keep track of the total number of cycles we've executed successfully
-  for (; steps > 0; --steps) {
-    // Instructions are supposed to be aligned on two-byte offsets:
-    // PC should be even. Terminate if PC is odd.
-    if ((state.pc % 2) == 1)
-      return 0;
+  return !run_detailed(steps).failed();
+}
 
-    // Fetch the next instruction from memory and transform it into an InstructionBase-derived object
-    InstructionBase* instr = decode(fetch());
+int Emulator::run_until(uint64_t max_cycles) {
+  // Already at (or past) the target
+  if (total_cycles >= max_cycles) {
+    last_stop = STOP_STEPS;
+    return 1;
+  }
 
-    if (instr == NULL)
-      return 0;
+  return !run_detailed(max_cycles - total_cycles).failed();
+}
 
-    // What the function name says
-    int success = execute(instr);
+int Emulator::run_for(std::chrono::nanoseconds budget) {
+  return !run_detailed(CYCLES_UNBOUNDED, budget).failed();
+}
 
-    // Terminate if we didn't execute the instruction successfully
-    if (success == 0)
-      return 0;
+RunResult Emulator::run_detailed(uint64_t steps, std::chrono::nanoseconds budget) {
+  ScopedLatency latency(latencies != nullptr ? &latencies->run : nullptr);
+  RunResult result;
+  result.reset(count_opcodes);
+
+  // Budgets that would overflow the clock, e.g. nanoseconds::max(), mean "no deadline"
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+  if (budget != std::chrono::nanoseconds::max()) {
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (budget < deadline - now)
+      deadline = now + budget;
+  }
 
-    ++total_cycles;
-    
-    if (is_breakpoint() == 1)
-      return 1;
+  uint64_t start_cycles = total_cycles;
+  EMULATOR_PROBE2(run_entry, steps, total_cycles);
+
+  run_features(steps, deadline, result, 1);
+  result.cycles = total_cycles - start_cycles;
+  finish_run(result);
+  return result;
+}
+
+void Emulator::run_features(uint64_t steps, std::chrono::steady_clock::time_point deadline, RunResult& result,
+                            int sync) {
+  // One instantiation of the loop per combination of RunFeature flags
+  using RunLoop = void (Emulator::*)(uint64_t, std::chrono::steady_clock::time_point, RunResult&, int);
+  static constexpr auto RUN_LOOPS = []<size_t... F>(std::index_sequence<F...>) {
+    return std::array<RunLoop, sizeof...(F)>{&Emulator::run_loop<F>...};
+  }(std::make_index_sequence<RUN_ALL_FEATURES + 1>{});
+
+  int features = (count_opcodes ? RUN_COUNT_OPCODES : 0) | (profiling ? RUN_PROFILE : 0) |
+                 (timing_enabled ? RUN_TIMING : 0) | (trace != nullptr ? RUN_TRACE : 0);
+  (this->*RUN_LOOPS[features])(steps, deadline, result, sync);
+}
+
+void Emulator::finish_run(RunResult& result) {
+  if (result.reason == STOP_BREAKPOINT)
+    result.breakpoint = state.pc;
+
+  // Once per call, so the loop itself stays free of shared writes
+  metrics_add(METRIC_INSTRUCTIONS, result.cycles);
+  if (result.reason == STOP_BREAKPOINT) {
+    metrics_add(METRIC_BREAKPOINT_HITS, 1);
+    EMULATOR_PROBE2(breakpoint_hit, state.pc, total_cycles);
+  }
+
+  publish_state();
+  last_stop = result.reason;
+  EMULATOR_PROBE3(run_exit, (int)result.reason, result.cycles, total_cycles);
+}
+
+// Defined before cycle() so that the compiler can inline it there
+inline StopReason Emulator::check_stops(InstructionData data, byte_t old_value) {
+  // Only STR writes memory, so only STR looks at the watchpoints.
+  // A watchpoint wins over a breakpoint on the new pc: the store happened first
+  if (data.opcode == STR && ((watch_mask[data.address / 64] >> (data.address % 64)) & 1)) {
+    int change_only = (watch_change_mask[data.address / 64] >> (data.address % 64)) & 1;
+    if (!change_only || state.memory[data.address] != old_value)
+      return STOP_WATCHPOINT;
+  }
+
+  // One bit covers both instruction-keyed kinds, and it's clear when neither is used
+  if ((instr_break_mask >> data.opcode) & 1) {
+    if ((opcode_break_mask >> data.opcode) & 1)
+      return STOP_OPCODE;
+    if ((acc_break_mask[state.acc / 64] >> (state.acc % 64)) & 1)
+      return STOP_ACC;
+  }
+
+  // Most batch jobs have no breakpoints at all, so don't even look for them
+  addr_t pc = state.pc & ARCH_BITMASK;
+  if (table->size != 0 && ((table->mask[pc / 64] >> (pc % 64)) & 1) && breakpoint_triggers() == 1)
+    return STOP_BREAKPOINT;
+
+  return STOP_STEPS;
+}
+
+// Defined before run_loop() and step() so that the compiler can inline it there
+template <int FEATURES>
+inline StopReason Emulator::cycle(InstructionData& data) {
+  [[maybe_unused]] uint64_t start = 0, decoded = 0, executed = 0;
+  if constexpr (FEATURES & RUN_TIMING)
+    start = host_ticks();
+
+  // Instructions are supposed to be aligned on two-byte offsets:
+  // PC should be even. Terminate if PC is odd.
+  if ((state.pc % 2) == 1)
+    return STOP_ODD_PC;
+
+  // Fetch the next instruction from memory and find the matching InstructionBase-derived object.
+  // Unlike decode(), this doesn't allocate (or leak) a new object every cycle.
+  data = fetch();
+#ifdef EMULATOR_USDT
+  // pc is even, so both bytes of the instruction are in the same word
+  fetched_mask[(state.pc & ARCH_BITMASK) / 64] |= (uint64_t)3 << ((state.pc & ARCH_BITMASK) % 64);
+#endif
+  const InstructionBase* instr = InstructionBase::lookupInstruction(data);
+
+  if (instr == NULL)
+    return STOP_INVALID_OPCODE;
+
+  if constexpr (FEATURES & RUN_TIMING)
+    decoded = host_ticks();
+
+  // Remember the old value for WATCH_CHANGE. It's cheaper to always load it
+  // than to look at the watchpoints here as well as after executing.
+  byte_t old_value = state.memory[data.address];
+
+  // What the function name says
+  instr->execute(state);
+
+  ++total_cycles;
+
+#ifdef EMULATOR_USDT
+  if (data.opcode == STR && state.memory[data.address] != old_value &&
+      ((fetched_mask[data.address / 64] >> (data.address % 64)) & 1))
+    EMULATOR_PROBE4(self_modifying_store, (state.pc - INSTRUCTION_SIZE) & ARCH_BITMASK, data.address, old_value,
+                    state.memory[data.address]);
+#endif
+
+  if constexpr (FEATURES & RUN_TIMING)
+    executed = host_ticks();
+
+  StopReason reason = check_stops(data, old_value);
+
+  if constexpr (FEATURES & RUN_TIMING) {
+    uint64_t end = host_ticks();
+    ++timing->count[data.opcode];
+    timing->decode[data.opcode] += decoded - start;
+    timing->execute[data.opcode] += executed - decoded;
+    timing->breakpoint_check[data.opcode] += end - executed;
+  }
+
+  return reason;
+}
+
+int Emulator::breakpoint_triggers() {
+  addr_t pc = state.pc & ARCH_BITMASK;
+
+  // Unconditional breakpoint: nothing else to check
+  if (((table->conditional[pc / 64] >> (pc % 64)) & 1) == 0)
+    return 1;
+
+  for (size_t idx = 0; idx < table->addresses.size(); ++idx) {
+    if (table->addresses[idx] != pc)
+      continue;
+
+    // Only this thread counts hits, but the editing thread may reset them
+    uint32_t hits = channel->hits[pc].load(std::memory_order_relaxed) + 1;
+    channel->hits[pc].store(hits, std::memory_order_relaxed);
+    return table->conditions[idx].evaluate(state, hits);
   }
 
   return 1;
 }
 
+template <int FEATURES>
+void Emulator::run_loop(uint64_t steps, std::chrono::steady_clock::time_point deadline, RunResult& result,
+                        int sync) {
+  const bool has_deadline = deadline != std::chrono::steady_clock::time_point::max();
+
+  // Repeat for the given number of steps, in chunks of RUN_CHECK_INTERVAL cycles
+  // Stop with an error reason, if we find an error
+  // Stop with a normal reason, if we find a breakpoint, are cancelled or run out of time
+  // Keep track of the total number of cycles we've executed successfully
+  while (steps > 0) {
+    // The slow checks happen once per chunk, never inside it
+    if (cancel_token != nullptr && cancel_token->is_cancelled()) {
+      result.reason = STOP_CANCELLED;
+      return;
+    }
+
+    if (has_deadline && std::chrono::steady_clock::now() >= deadline) {
+      result.reason = STOP_DEADLINE;
+      return;
+    }
+
+    // Pick up breakpoints changed by another thread since the last chunk,
+    // and show our progress to other threads
+    if (sync) {
+      adopt_breakpoints();
+      publish_state();
+    }
+    sync = 1;
+
+    uint64_t chunk = steps < RUN_CHECK_INTERVAL ? steps : RUN_CHECK_INTERVAL;
+
+    // Cycle breakpoints just cut the chunk short, so that it ends on them
+    const uint64_t target = next_cycle_break();
+    if (target - total_cycles < chunk)
+      chunk = target - total_cycles;
+    steps -= chunk;
+
+    for (; chunk > 0; --chunk) {
+      InstructionData data;
+      [[maybe_unused]] addr_t pc = state.pc;
+      StopReason reason = cycle<FEATURES>(data);
+
+      if (reason == STOP_ODD_PC || reason == STOP_INVALID_OPCODE) {
+        result.reason = reason;
+        return;
+      }
+
+      if constexpr (FEATURES & RUN_COUNT_OPCODES)
+        ++result.opcode_counts[data.opcode];
+
+      if constexpr (FEATURES & RUN_PROFILE)
+        record_profile(pc, data.opcode);
+
+      if constexpr (FEATURES & RUN_TRACE)
+        record_trace(pc, data);
+
+      // Any other reason means the instruction executed and hit some kind of breakpoint
+      if (reason != STOP_STEPS) {
+        result.reason = reason;
+        if (reason == STOP_WATCHPOINT)
+          result.watchpoint = data.address;
+        result.cycle_break = reached_cycle_break(target);
+        return;
+      }
+    }
+
+    if (reached_cycle_break(target)) {
+      result.reason = STOP_CYCLE;
+      result.cycle_break = 1;
+      return;
+    }
+  }
+
+  result.reason = STOP_STEPS;
+}
+
+void Emulator::run_many(std::span<Emulator> emulators, uint64_t steps, RunResult* out) {
+  const size_t num = emulators.size();
+  const auto start = std::chrono::steady_clock::now();
+
+  for (size_t i = 0; i < num; ++i) {
+    out[i].reset(emulators[i].count_opcodes);
+    EMULATOR_PROBE2(run_entry, steps, emulators[i].total_cycles);
+  }
+
+  // Emulators which stopped for a reason other than the step budget are done
+  // and keep their result. The rest get another slice in the next round.
+  size_t active = num;
+  for (uint64_t done = 0; done < steps && active > 0; ) {
+    uint64_t slice = steps - done < RUN_MANY_SLICE ? steps - done : RUN_MANY_SLICE;
+
+    // Breakpoints are picked up and the state is published every
+    // RUN_CHECK_INTERVAL cycles, like in run_detailed(), not every slice
+    const int sync = done % RUN_CHECK_INTERVAL == 0;
+    done += slice;
+
+    for (size_t i = 0; i < num; ++i) {
+      if (out[i].reason != STOP_STEPS)
+        continue;
+
+      // Pull in the next emulator's registers and the start of its memory
+      // while this one runs
+#if defined(__GNUC__)
+      if (i + 1 < num) {
+        __builtin_prefetch(&emulators[i + 1].state);
+        __builtin_prefetch(&emulators[i + 1].state.memory[64]);
+      }
+#endif
+
+      // The loop adds to the opcode counts, and only sets the rest when it stops
+      Emulator& emulator = emulators[i];
+      const uint64_t start_cycles = emulator.total_cycles;
+      emulator.run_features(slice, std::chrono::steady_clock::time_point::max(), out[i], sync);
+      out[i].cycles += emulator.total_cycles - start_cycles;
+
+      if (out[i].reason != STOP_STEPS) {
+        emulator.finish_run(out[i]);
+        --active;
+      }
+    }
+  }
+
+  // The ones that used up their budget
+  for (size_t i = 0; i < num; ++i)
+    if (out[i].reason == STOP_STEPS)
+      emulators[i].finish_run(out[i]);
+
+  // One latency sample for the whole call, in each distinct set of stats.
+  // Batches usually share one, so this finds it at the first emulator.
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  for (size_t i = 0; i < num; ++i) {
+    LatencyStats* stats = emulators[i].latencies;
+    size_t first = 0;
+    while (first < i && emulators[first].latencies != stats)
+      ++first;
+    if (stats != nullptr && first == i)
+      stats->run.record(elapsed);
+  }
+}
+
+StepEvent Emulator::step() {
+  StepEvent event;
+  InstructionData data;
+  data.opcode = 0;
+  data.address = 0;
+
+  const uint64_t target = next_cycle_break();
+  adopt_breakpoints();
+
+  event.pc = state.pc;
+  event.reason = timing_enabled ? cycle<RUN_TIMING>(data) : cycle<0>(data);
+  event.opcode = data.opcode;
+  event.operand = data.address;
+  event.acc = state.acc;
+
+  const bool executed = event.reason != STOP_ODD_PC && event.reason != STOP_INVALID_OPCODE;
+  event.store_address = (executed && data.opcode == STR) ? data.address : -1;
+
+  if (executed && profiling)
+    record_profile(event.pc, data.opcode);
+
+  if (executed && trace != nullptr)
+    record_trace(event.pc, data);
+
+  if (executed && reached_cycle_break(target) && event.reason == STOP_STEPS)
+    event.reason = STOP_CYCLE;
+
+  if (executed)
+    metrics_add(METRIC_INSTRUCTIONS, 1);
+  if (event.reason == STOP_BREAKPOINT) {
+    metrics_add(METRIC_BREAKPOINT_HITS, 1);
+    EMULATOR_PROBE2(breakpoint_hit, state.pc, total_cycles);
+  }
+
+  last_stop = event.reason;
+  return event;
+}
+
+void Emulator::set_opcode_counting(int enable) {
+  count_opcodes = enable;
+}
+
+void Emulator::set_profiling(int enable) {
+  if (enable && profile == nullptr) {
+    profile = std::make_unique<ExecutionProfile>();
+    reset_profile();
+  }
+  profiling = enable;
+}
+
+void Emulator::reset_profile() {
+  if (profile == nullptr)
+    return;
+
+  for (int slot = 0; slot < MAX_INSTRUCTIONS; ++slot) {
+    profile->executions[slot] = 0;
+    profile->taken[slot] = 0;
+    profile->not_taken[slot] = 0;
+  }
+}
+
+const ExecutionProfile* Emulator::get_profile() const {
+  return profile.get();
+}
+
+inline void Emulator::record_profile(addr_t pc, byte_t opcode) {
+  int slot = (pc & ARCH_BITMASK) / INSTRUCTION_SIZE;
+  ++profile->executions[slot];
+
+  // JNE leaves acc alone, so acc still tells us whether it jumped
+  if (opcode == JNE) {
+    if (state.acc != 0)
+      ++profile->taken[slot];
+    else
+      ++profile->not_taken[slot];
+  }
+}
+
+void Emulator::set_timing(int enable) {
+  if (enable && timing == nullptr) {
+    timing = std::make_unique<OpcodeTiming>();
+    reset_timing();
+  }
+  timing_enabled = enable;
+}
+
+void Emulator::reset_timing() {
+  if (timing == nullptr)
+    return;
+
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    timing->count[op] = 0;
+    timing->decode[op] = 0;
+    timing->execute[op] = 0;
+    timing->breakpoint_check[op] = 0;
+  }
+
+  // The best of a few tries, to leave out interrupts and cache misses
+  uint64_t overhead = UINT64_MAX;
+  for (int i = 0; i < 64; ++i) {
+    uint64_t before = host_ticks();
+    uint64_t after = host_ticks();
+    if (after - before < overhead)
+      overhead = after - before;
+  }
+  timing->clock_overhead = overhead;
+}
+
+const OpcodeTiming* Emulator::get_timing() const {
+  return timing.get();
+}
+
+void Emulator::set_trace(TraceRecorder* recorder) {
+  trace = recorder;
+}
+
+void Emulator::set_latency_stats(LatencyStats* stats) {
+  latencies = stats;
+}
+
+void Emulator::invalidate_code(addr_t address, size_t size) {
+  EMULATOR_PROBE2(code_invalidate, address, size);
+
+  // The new bytes haven't been fetched yet
+  for (size_t i = 0; i < size && i < MEMORY_SIZE; ++i) {
+    addr_t target = (address + i) & ARCH_BITMASK;
+    fetched_mask[target / 64] &= ~((uint64_t)1 << (target % 64));
+  }
+}
+
+inline void Emulator::record_trace(addr_t pc, InstructionData data) {
+  TraceRecord record;
+  record.cycle = total_cycles;
+  record.pc = pc & ARCH_BITMASK;
+  record.opcode = data.opcode;
+  record.operand = data.address;
+  record.acc = state.acc & ARCH_BITMASK;
+  record.flags = data.opcode == STR ? TRACE_STORE : 0;
+  record.store_address = data.opcode == STR ? data.address : 0;
+  record.store_value = data.opcode == STR ? state.memory[data.address] : 0;
+  record.reserved = 0;
+  trace->record(record);
+}
+
+void Emulator::set_cancel_token(const CancelToken* token) {
+  cancel_token = token;
+}
+
+StopReason Emulator::stop_reason() const {
+  return last_stop;
+}
+
 // ----------> Breakpoint management
 
 int Emulator::insert_breakpoint(addr_t address, const std::string name) {
@@ -196,6 +932,13 @@ int Emulator::insert_breakpoint(addr_t address, const std::string name) {
 
   // Insert breakpoint and increment breakpoints_sz in a single step
   breakpoints[breakpoints_sz++] = Breakpoint(address, name);
+
+  // New breakpoints are not in a group, so they are always enabled
+  address &= ARCH_BITMASK;
+  breakpoints[breakpoints_sz - 1].set_hit_counter(hit_counter(address));
+  ungrouped_mask[address / 64] |= (uint64_t)1 << (address % 64);
+  channel->hits[address].store(0);
+  update_breakpoint_mask();
   
   return 1;
   
@@ -252,8 +995,11 @@ const std::shared_ptr<Breakpoint> Emulator::find_breakpoint(addr_t address) cons
     if (breakpoints[idx].has(address)) {
       
       // If this one has the address we're looking for, return it.
-      
-      return std::make_shared<Breakpoint>(breakpoints[idx]);
+      // This shares ownership with the breakpoints array (the aliasing
+      // constructor), so no copy is allocated and both find_breakpoint()
+      // functions return the same pointer for the same breakpoint.
+
+      return std::shared_ptr<Breakpoint>(breakpoints, &breakpoints[idx]);
       
     }
     
@@ -290,66 +1036,446 @@ const std::shared_ptr<Breakpoint> Emulator::find_breakpoint(const std::string na
 }
 
 int Emulator::delete_breakpoint(addr_t address) {
+  address &= ARCH_BITMASK;
 
-  std::shared_ptr<Breakpoint> found = find_breakpoint(address);
+  int idx = 0;
+  while (idx < breakpoints_sz && !breakpoints[idx].has(address))
+    ++idx;
 
-  if (find_breakpoint(address) == nullptr)
+  if (idx == breakpoints_sz)
     return 0;
 
-  //  Move all breakpoints found above, one position to the left, to fill the gap.
+  // Forget the address in whichever mask the breakpoint was part of
+  uint64_t bit = (uint64_t)1 << (address % 64);
+  int group = find_group(breakpoints[idx].get_group());
+  if (group >= 0)
+    groups[group].mask[address / 64] &= ~bit;
+  ungrouped_mask[address / 64] &= ~bit;
+  conditional_mask[address / 64] &= ~bit;
 
-  //  Precarious iterator loop due to patching over non-vector array of objects.
+  //  Move all breakpoints after the deleted one, one position to the left, to fill the gap.
+  //  This keeps the order in which breakpoints were inserted (and are saved).
+  for (; idx + 1 < breakpoints_sz; ++idx)
+    breakpoints[idx] = std::move(breakpoints[idx + 1]);
 
-  int i = 0;
+  //  Remove one breakpoint from counter.
+  --breakpoints_sz;
 
-  int jump = 0;
+  update_breakpoint_mask();
+  return 1;
+}
 
-  while ( (i + jump) < breakpoints_sz ) {
+//  Just call above function.
 
-    if ( breakpoints[i].get_name() == found->get_name() &&
-	 breakpoints[i].get_address() == found->get_address() ) {
+int Emulator::delete_breakpoint(const std::string name) {
+  
+  const std::shared_ptr<Breakpoint> found = find_breakpoint(name);
 
-      jump++;
+  if (found == nullptr)
+    return 0;
 
-    }
+  return delete_breakpoint(found->get_address());
+  
+}
 
-    breakpoints[i] = std::move(breakpoints[i + jump]);
+int Emulator::set_breakpoint_condition(const std::string name, const std::string condition) {
+  for (int idx = 0; idx < breakpoints_sz; ++idx) {
+    if (!breakpoints[idx].has(name))
+      continue;
 
-    i++;
+    if (!breakpoints[idx].set_condition(condition))
+      return 0;
 
+    addr_t address = breakpoints[idx].get_address() & ARCH_BITMASK;
+    uint64_t bit = (uint64_t)1 << (address % 64);
+    if (breakpoints[idx].has_condition())
+      conditional_mask[address / 64] |= bit;
+    else
+      conditional_mask[address / 64] &= ~bit;
+    channel->hits[address].store(0);
+    publish_breakpoints();
+    return 1;
   }
 
-  //  Remove one breakpoint from counter.
-  
-  --breakpoints_sz;
-  
-  return 1;
+  return 0;
+}
+
+int Emulator::set_breakpoint_group(const std::string name, const std::string group) {
+  int idx = 0;
+  while (idx < breakpoints_sz && !breakpoints[idx].has(name))
+    ++idx;
+
+  if (idx == breakpoints_sz)
+    return 0;
+
+  addr_t address = breakpoints[idx].get_address();
+  uint64_t bit = (uint64_t)1 << (address % 64);
+
+  // Out of the old group (or the ungrouped breakpoints)...
+  int old_group = find_group(breakpoints[idx].get_group());
+  if (old_group >= 0)
+    groups[old_group].mask[address / 64] &= ~bit;
+  else
+    ungrouped_mask[address / 64] &= ~bit;
+
+  // ... and into the new one, which might need to be created
+  if (group.empty()) {
+    ungrouped_mask[address / 64] |= bit;
+  } else {
+    groups[create_group(group)].mask[address / 64] |= bit;
+  }
 
+  breakpoints[idx].set_group(group);
+  update_breakpoint_mask();
+  return 1;
 }
 
-//  Just call above function.
+int Emulator::enable_group(const std::string group) {
+  int idx = find_group(group);
+  if (idx < 0)
+    return 0;
 
-int Emulator::delete_breakpoint(const std::string name) {
-  
-  const std::shared_ptr<Breakpoint> found = find_breakpoint(name);
+  groups[idx].enabled = 1;
+  update_breakpoint_mask();
+  return 1;
+}
 
-  if (found == nullptr)
+int Emulator::disable_group(const std::string group) {
+  int idx = find_group(group);
+  if (idx < 0)
     return 0;
 
-  return delete_breakpoint(found->get_address());
-  
+  groups[idx].enabled = 0;
+  update_breakpoint_mask();
+  return 1;
+}
+
+int Emulator::is_group_enabled(const std::string group) const {
+  int idx = find_group(group);
+  return idx >= 0 && groups[idx].enabled;
+}
+
+void Emulator::update_breakpoint_mask() {
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i)
+    breakpoint_mask[i] = ungrouped_mask[i];
+
+  for (const BreakpointGroup& group : groups)
+    if (group.enabled)
+      for (int i = 0; i < MEMORY_SIZE / 64; ++i)
+        breakpoint_mask[i] |= group.mask[i];
+
+  publish_breakpoints();
+}
+
+void Emulator::publish_breakpoints() {
+  BreakpointTable* fresh = new BreakpointTable();
+  fresh->version = ++channel->version;
+  fresh->size = breakpoints_sz;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i) {
+    fresh->mask[i] = breakpoint_mask[i];
+    fresh->conditional[i] = conditional_mask[i];
+  }
+
+  for (int idx = 0; idx < breakpoints_sz; ++idx) {
+    if (!breakpoints[idx].has_condition())
+      continue;
+
+    // Conditions are compiled once, in set_condition(), so this only copies them
+    fresh->addresses.push_back(breakpoints[idx].get_address() & ARCH_BITMASK);
+    fresh->conditions.push_back(breakpoints[idx].get_compiled_condition());
+  }
+
+  // A single store makes the new table visible to the emulation loop
+  BreakpointTable* old = channel->published.exchange(fresh);
+  if (old != nullptr)
+    channel->retired.push_back(old);
+
+  // Free the retired tables, unless the emulation loop announced it might be using them
+  BreakpointTable* in_use = channel->hazards[0].load();
+  BreakpointTable* adopting = channel->hazards[1].load();
+  size_t kept = 0;
+  for (BreakpointTable* retired : channel->retired) {
+    if (retired == in_use || retired == adopting)
+      channel->retired[kept++] = retired;
+    else
+      delete retired;
+  }
+  channel->retired.resize(kept);
+}
+
+std::shared_ptr<const std::atomic<uint32_t>> Emulator::hit_counter(addr_t address) const {
+  return std::shared_ptr<const std::atomic<uint32_t>>(channel, &channel->hits[address & ARCH_BITMASK]);
+}
+
+void Emulator::adopt_breakpoints() {
+  if (channel->published.load() == table)
+    return;
+
+  // Announce the table before using it, and make sure it wasn't retired
+  // (and maybe freed) before the announcement
+  BreakpointTable* latest;
+  do {
+    latest = channel->published.load();
+    channel->hazards[1].store(latest);
+  } while (channel->published.load() != latest);
+
+  channel->hazards[0].store(latest);
+  channel->hazards[1].store(nullptr);
+  table = latest;
+}
+
+void Emulator::publish_state() {
+  StateSeqlock& lock = *seqlock;
+  uint32_t sequence = lock.sequence.load(std::memory_order_relaxed);
+
+  // Odd while writing, so readers know to retry
+  lock.sequence.store(sequence + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  lock.cycles.store(total_cycles, std::memory_order_relaxed);
+  lock.acc.store(state.acc, std::memory_order_relaxed);
+  lock.pc.store(state.pc, std::memory_order_relaxed);
+  for (int word = 0; word < MEMORY_SIZE / 8; ++word) {
+    uint64_t bytes;
+    memcpy(&bytes, &state.memory[word * 8], 8);
+    lock.memory[word].store(bytes, std::memory_order_relaxed);
+  }
+  lock.memory_hash.store(state.memory_hash, std::memory_order_relaxed);
+
+  lock.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+uint64_t Emulator::breakpoints_version() const {
+  return channel->version;
+}
+
+uint64_t Emulator::active_breakpoints_version() const {
+  // Only the editing thread frees tables, so the announced one stays valid here
+  const BreakpointTable* in_use = channel->hazards[0].load();
+  return in_use != nullptr ? in_use->version : 0;
+}
+
+int Emulator::find_group(const std::string group) const {
+  if (group.empty())
+    return -1;
+
+  for (size_t idx = 0; idx < groups.size(); ++idx)
+    if (groups[idx].name == group)
+      return idx;
+
+  return -1;
+}
+
+int Emulator::create_group(const std::string group) {
+  int idx = find_group(group);
+  if (idx >= 0)
+    return idx;
+
+  BreakpointGroup created;
+  created.name = group;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i)
+    created.mask[i] = 0;
+  created.enabled = 1;
+  groups.push_back(created);
+  return groups.size() - 1;
 }
 
 int Emulator::num_breakpoints() const {
   return breakpoints_sz;
 }
 
+// ----------> Watchpoint management
+
+int Emulator::insert_watchpoint(addr_t address, const std::string name, WatchKind kind) {
+  // Watchpoint already exists
+  if (find_watchpoint(address) != nullptr)
+    return 0;
+
+  // Watchpoint name already used
+  if (find_watchpoint(name) != nullptr)
+    return 0;
+
+  watchpoints.push_back(Watchpoint(address, name, kind));
+
+  address &= ARCH_BITMASK;
+  uint64_t bit = (uint64_t)1 << (address % 64);
+  watch_mask[address / 64] |= bit;
+  if (kind == WATCH_CHANGE)
+    watch_change_mask[address / 64] |= bit;
+
+  return 1;
+}
+
+const Watchpoint* Emulator::find_watchpoint(addr_t address) const {
+  for (const Watchpoint& watchpoint : watchpoints)
+    if (watchpoint.has(address))
+      return &watchpoint;
+  return nullptr;
+}
+
+const Watchpoint* Emulator::find_watchpoint(const std::string name) const {
+  for (const Watchpoint& watchpoint : watchpoints)
+    if (watchpoint.has(name))
+      return &watchpoint;
+  return nullptr;
+}
+
+int Emulator::delete_watchpoint(addr_t address) {
+  for (size_t idx = 0; idx < watchpoints.size(); ++idx) {
+    if (!watchpoints[idx].has(address))
+      continue;
+
+    watchpoints.erase(watchpoints.begin() + idx);
+
+    address &= ARCH_BITMASK;
+    uint64_t bit = (uint64_t)1 << (address % 64);
+    watch_mask[address / 64] &= ~bit;
+    watch_change_mask[address / 64] &= ~bit;
+    return 1;
+  }
+
+  return 0;
+}
+
+int Emulator::delete_watchpoint(const std::string name) {
+  const Watchpoint* found = find_watchpoint(name);
+
+  if (found == nullptr)
+    return 0;
+
+  return delete_watchpoint(found->get_address());
+}
+
+int Emulator::num_watchpoints() const {
+  return watchpoints.size();
+}
+
+// ----------> Cycle breakpoints
+
+void Emulator::break_at_cycle(uint64_t cycle) {
+  break_cycle = cycle;
+}
+
+void Emulator::break_every(uint64_t period) {
+  break_period = period;
+}
+
+uint64_t Emulator::next_cycle_break() const {
+  uint64_t target = break_cycle > total_cycles ? break_cycle : CYCLES_UNBOUNDED;
+
+  if (break_period != 0) {
+    uint64_t periodic = (total_cycles / break_period + 1) * break_period;
+    // Don't let the multiplication wrap around near the top of the counter
+    if (periodic > total_cycles && periodic < target)
+      target = periodic;
+  }
+
+  return target;
+}
+
+int Emulator::reached_cycle_break(uint64_t target) {
+  if (target == CYCLES_UNBOUNDED || total_cycles != target)
+    return 0;
+
+  if (break_cycle == target)
+    break_cycle = CYCLES_UNBOUNDED;
+  return 1;
+}
+
+// ----------> Instruction breakpoints
+
+// The instructions that write the accumulator, i.e. the ones value breakpoints look at
+static const uint32_t ACC_WRITING_OPCODES = (1 << ADD) | (1 << AND) | (1 << ORR) | (1 << XOR) | (1 << LDR);
+
+int Emulator::break_on_opcode(byte_t opcode) {
+  if (opcode >= NUM_OPCODES)
+    return 0;
+
+  opcode_break_mask |= (uint32_t)1 << opcode;
+  update_instr_break_mask();
+  return 1;
+}
+
+int Emulator::clear_opcode_break(byte_t opcode) {
+  if (!has_opcode_break(opcode))
+    return 0;
+
+  opcode_break_mask &= ~((uint32_t)1 << opcode);
+  update_instr_break_mask();
+  return 1;
+}
+
+int Emulator::has_opcode_break(byte_t opcode) const {
+  return opcode < NUM_OPCODES && ((opcode_break_mask >> opcode) & 1);
+}
+
+int Emulator::break_on_acc(data_t value) {
+  if ((value < 0) || (value > ARCH_MAXVAL))
+    return 0;
+
+  if (!has_acc_break(value)) {
+    acc_break_mask[value / 64] |= (uint64_t)1 << (value % 64);
+    ++acc_breaks;
+  }
+  update_instr_break_mask();
+  return 1;
+}
+
+int Emulator::clear_acc_break(data_t value) {
+  if (!has_acc_break(value))
+    return 0;
+
+  acc_break_mask[value / 64] &= ~((uint64_t)1 << (value % 64));
+  --acc_breaks;
+  update_instr_break_mask();
+  return 1;
+}
+
+int Emulator::has_acc_break(data_t value) const {
+  if ((value < 0) || (value > ARCH_MAXVAL))
+    return 0;
+  return (acc_break_mask[value / 64] >> (value % 64)) & 1;
+}
+
+void Emulator::update_instr_break_mask() {
+  instr_break_mask = opcode_break_mask;
+  if (acc_breaks != 0)
+    instr_break_mask |= ACC_WRITING_OPCODES;
+}
+
 // ----------> Manage state
 
-int Emulator::cycles() const {
+uint64_t Emulator::cycles() const {
   return total_cycles;
 }
 
+uint64_t Emulator::snapshot_concurrent(ProcessorState& out) const {
+  const StateSeqlock& lock = *seqlock;
+
+  while (true) {
+    uint32_t before = lock.sequence.load(std::memory_order_acquire);
+    // The writer is in the middle of a copy
+    if (before & 1) {
+      std::this_thread::yield();
+      continue;
+    }
+
+    uint64_t cycles = lock.cycles.load(std::memory_order_relaxed);
+    out.acc = lock.acc.load(std::memory_order_relaxed);
+    out.pc = lock.pc.load(std::memory_order_relaxed);
+    for (int word = 0; word < MEMORY_SIZE / 8; ++word) {
+      uint64_t bytes = lock.memory[word].load(std::memory_order_relaxed);
+      memcpy(&out.memory[word * 8], &bytes, 8);
+    }
+    out.memory_hash = lock.memory_hash.load(std::memory_order_relaxed);
+
+    // Nothing was rewritten while we copied, so the copy is consistent
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (lock.sequence.load(std::memory_order_relaxed) == before)
+      return cycles;
+  }
+}
+
 data_t Emulator::read_acc() const {
   return state.acc;
 }
@@ -364,6 +1490,91 @@ addr_t Emulator::read_mem(addr_t address) const {
   return state.memory[address];
 }
 
+const ProcessorState& Emulator::read_state() const {
+  return state;
+}
+
+bool Emulator::operator==(const Emulator& other) const {
+  return state == other.state;
+}
+
+uint64_t Emulator::hash() const {
+  return hash_state(state);
+}
+
+uint64_t Emulator::fingerprint() const {
+  return state.fingerprint();
+}
+
+StateDiff diff(const Emulator& a, const Emulator& b) {
+  return diff(a.read_state(), b.read_state());
+}
+
+int Emulator::read_mem_range(addr_t address, std::span<byte_t> out) const {
+  if (out.size() > MEMORY_SIZE)
+    return 0;
+  if (out.empty())
+    return 1;
+
+  // At most two pieces: up to the end of the memory, then from address 0
+  address &= ARCH_BITMASK;
+  size_t first = out.size() < (size_t)(MEMORY_SIZE - address) ? out.size() : MEMORY_SIZE - address;
+  memcpy(out.data(), &state.memory[address], first);
+  memcpy(out.data() + first, &state.memory[0], out.size() - first);
+  return 1;
+}
+
+int Emulator::write_mem_range(addr_t address, std::span<const byte_t> data) {
+  if (data.size() > MEMORY_SIZE)
+    return 0;
+  if (data.empty())
+    return 1;
+
+  // Byte by byte, to keep the Zobrist hash up to date like STR does
+  for (size_t i = 0; i < data.size(); ++i) {
+    addr_t target = (address + i) & ARCH_BITMASK;
+    state.memory_hash ^= zobrist_key(target, state.memory[target]) ^ zobrist_key(target, data[i]);
+    state.memory[target] = data[i];
+  }
+
+  invalidate_code(address, data.size());
+  publish_state();
+  return 1;
+}
+
+std::span<const byte_t, MEMORY_SIZE> Emulator::memory() const {
+  return std::span<const byte_t, MEMORY_SIZE>(state.memory);
+}
+
+int Emulator::load_image(std::span<const byte_t> image) {
+  if (image.size() > MEMORY_SIZE)
+    return 0;
+
+  state = ProcessorState();
+  total_cycles = 0;
+  if (!image.empty())
+    memcpy(state.memory, image.data(), image.size());
+  state.rehash();
+
+  invalidate_code(0, MEMORY_SIZE);
+  publish_state();
+  return 1;
+}
+
+int Emulator::restore(const ProcessorState& new_state, uint64_t cycles) {
+  if (new_state.acc < 0 || new_state.acc > ARCH_MAXVAL || new_state.pc < 0 || new_state.pc > ARCH_MAXVAL)
+    return 0;
+
+  state = new_state;
+  total_cycles = cycles;
+  // The hash may not have been kept up to date by whoever built the state
+  state.rehash();
+
+  invalidate_code(0, MEMORY_SIZE);
+  publish_state();
+  return 1;
+}
+
 // ----------> Utilities
 
 int Emulator::is_zero() const {
@@ -371,27 +1582,103 @@ int Emulator::is_zero() const {
 }
 
 int Emulator::is_breakpoint() const {
-  return find_breakpoint(state.pc) != nullptr;
+  addr_t pc = state.pc & ARCH_BITMASK;
+  return (breakpoint_mask[pc / 64] >> (pc % 64)) & 1;
+}
+
+// Print one instruction slot the way print_program() does, without the newline
+static void print_slot(const ProcessorState& state, int offset) {
+  InstructionData data;
+  data.opcode = state.memory[offset];
+  data.address = state.memory[offset + 1];
+  const InstructionBase* instr = InstructionBase::lookupInstruction(data);
+
+  if ((instr == NULL) || (data.opcode == 0 && data.address == 0))
+    printf("%d:\t%d\t%d", offset, data.opcode, data.address);
+  else 
+    printf("%d:\t%d\t%d\t:\t%s", offset, data.opcode, data.address, instr->to_string().c_str());
 }
 
 int Emulator::print_program() const {
   for (int offset = 0; offset < MEMORY_SIZE; offset += INSTRUCTION_SIZE) {
-    InstructionData data;
-    data.opcode = state.memory[offset];
-    data.address = state.memory[offset + 1];
-    InstructionBase* instr = decode(data);
+    print_slot(state, offset);
+    printf("\n");
+  }
+  return 1;
+}
+
+int Emulator::print_profile() const {
+  if (profile == nullptr)
+    return 0;
 
-    if ((instr == NULL) || (data.opcode == 0 && data.address == 0))
-      printf("%d:\t%d\t%d\n", offset, data.opcode, data.address);
-    else 
-      printf("%d:\t%d\t%d\t:\t%s\n", offset, data.opcode, data.address, instr->to_string().c_str());
+  uint64_t total = profile->total();
+  for (int offset = 0; offset < MEMORY_SIZE; offset += INSTRUCTION_SIZE) {
+    int slot = offset / INSTRUCTION_SIZE;
+    print_slot(state, offset);
+
+    // Lines that never ran are left exactly as print_program() prints them
+    if (profile->executions[slot] != 0) {
+      printf("\t; %" PRIu64 " (%.2f%%)", profile->executions[slot], 100.0 * profile->executions[slot] / total);
+      if (profile->taken[slot] + profile->not_taken[slot] != 0)
+        printf(" taken %" PRIu64 " not taken %" PRIu64, profile->taken[slot], profile->not_taken[slot]);
+    }
+    printf("\n");
+  }
+  return 1;
+}
+
+int Emulator::print_timing() const {
+  if (timing == nullptr)
+    return 0;
+
+#if defined(HOST_TICKS_TSC)
+  const char* unit = "TSC ticks";
+#else
+  const char* unit = "ns";
+#endif
+
+  printf("opcode\tcount\tdecode\texecute\tbreakpoint check\t(average %s, clock overhead %" PRIu64 ")\n",
+         unit, timing->clock_overhead);
+  for (int op = 0; op < NUM_OPCODES; ++op) {
+    const std::string name = InstructionBase::lookupInstruction({(byte_t)op, 0})->name();
+    printf("%s\t%" PRIu64 "\t%.1f\t%.1f\t%.1f\n", name.c_str(), timing->count[op], timing->average(timing->decode, op),
+           timing->average(timing->execute, op), timing->average(timing->breakpoint_check, op));
   }
   return 1;
 }
 
 int Emulator::load_state(const std::string filename) {
+  ScopedLatency latency(latencies != nullptr ? &latencies->load_state : nullptr);
+  EMULATOR_PROBE1(load_state_entry, filename.c_str());
+
+  int loaded = read_state_file(filename);
+  // Even a failed load may have replaced part of the memory
+  invalidate_code(0, MEMORY_SIZE);
+
+  EMULATOR_PROBE2(load_state_return, filename.c_str(), loaded);
+  return loaded;
+}
+
+int Emulator::read_state_file(const std::string filename) {
   // Delete all breakpoints
   breakpoints_sz = 0;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i) {
+    breakpoint_mask[i] = 0;
+    ungrouped_mask[i] = 0;
+    conditional_mask[i] = 0;
+    watch_mask[i] = 0;
+    watch_change_mask[i] = 0;
+  }
+  groups.clear();
+  watchpoints.clear();
+  for (int i = 0; i < MEMORY_SIZE; ++i)
+    channel->hits[i].store(0);
+  update_breakpoint_mask();
+  opcode_break_mask = 0;
+  for (int i = 0; i < (ARCH_MAXVAL + 1) / 64; ++i)
+    acc_break_mask[i] = 0;
+  acc_breaks = 0;
+  update_instr_break_mask();
 
   int read = 0;
   FILE *fp = fopen(filename.c_str(), "r");
@@ -400,9 +1687,16 @@ int Emulator::load_state(const std::string filename) {
     return 0;
 
   // Make sure that each fscanf reads the right number of items
-  read = fscanf(fp, "%d\n", &total_cycles);
-  if ((read != 1) || (total_cycles < 0))
+  // The cycle count is unsigned 64-bit, like save_state() writes it. SCNu64
+  // would accept "-1" and wrap it around, so a sign is rejected first
+  char sign[2];
+  if (fscanf(fp, " %1[-+]", sign) == 1)
     return 0;
+  uint64_t cycles = 0;
+  read = fscanf(fp, "%" SCNu64 "\n", &cycles);
+  if (read != 1)
+    return 0;
+  total_cycles = cycles;
 
   read = fscanf(fp, "%d\n", &state.acc);
   if ((read != 1) || (state.acc > ARCH_MAXVAL) || (state.acc < 0))
@@ -427,11 +1721,78 @@ int Emulator::load_state(const std::string filename) {
       return 0;
     state.memory[offset] = num;
   }
+  state.rehash();
+
+  // Breakpoints are read line by line, because of the optional condition
+  // at the end. Files without conditions read exactly as before.
+  char line[MAX_STATE_LINE];
+  while (fgets(line, MAX_STATE_LINE, fp) != NULL) {
+    char name[MAX_STATE_LINE];
+    char kind[MAX_STATE_LINE];
+    int rest = 0;
+
+    // fscanf() used to skip blank lines between the entries, so keep doing that
+    if (line[strspn(line, " \t\r\n\v\f")] == '\0')
+      continue;
+
+    // Watchpoint lines start with a keyword, so they can't be mistaken for breakpoints
+    if (strncmp(line, "watch ", 6) == 0) {
+      if (sscanf(line + 6, "%d %s %s", &num, name, kind) != 3)
+        return 0;
+      if ((num < 0) || (num >= MEMORY_SIZE))
+        return 0;
+
+      WatchKind watch_kind;
+      if (strcmp(kind, "write") == 0)
+        watch_kind = WATCH_WRITE;
+      else if (strcmp(kind, "change") == 0)
+        watch_kind = WATCH_CHANGE;
+      else
+        return 0;
+
+      if (!insert_watchpoint(num, name, watch_kind))
+        return 0;
+      continue;
+    }
+
+    // So do instruction breakpoint lines: "break opcode <NAME>" or "break acc <value>"
+    if (strncmp(line, "break ", 6) == 0) {
+      if (sscanf(line + 6, "%s %s", kind, name) != 2)
+        return 0;
+
+      if (strcmp(kind, "opcode") == 0) {
+        int opcode = 0;
+        while (opcode < NUM_OPCODES && InstructionBase::lookupInstruction({(byte_t)opcode, 0})->name() != name)
+          ++opcode;
+        if (!break_on_opcode(opcode))
+          return 0;
+      } else if (strcmp(kind, "acc") == 0) {
+        if ((sscanf(name, "%d", &num) != 1) || !break_on_acc(num))
+          return 0;
+      } else {
+        return 0;
+      }
+      continue;
+    }
+
+    // So do group lines. The group normally exists already, because its
+    // breakpoints come first, but empty groups are saved too.
+    if (strncmp(line, "group ", 6) == 0) {
+      if (sscanf(line + 6, "%s %s", name, kind) != 2)
+        return 0;
+
+      create_group(name);
+      if (strcmp(kind, "on") == 0)
+        enable_group(name);
+      else if (strcmp(kind, "off") == 0)
+        disable_group(name);
+      else
+        return 0;
+      continue;
+    }
 
-  while (1) {
-    char name[MAX_NAME];
-    int read = fscanf(fp, "%d %s\n", &num, name);
-    // End of the file
+    int read = sscanf(line, "%d %s %n", &num, name, &rest);
+    // End of the breakpoints
     if (read != 2)
       break;
 
@@ -442,19 +1803,47 @@ int Emulator::load_state(const std::string filename) {
     // Try to insert the breakpoint and return fail if unsuccessful
     if (!insert_breakpoint(num, name))
       return 0;
+
+    // Anything after the name can be a group and/or a condition
+    const char* tail = line + rest;
+    if (strncmp(tail, "in ", 3) == 0) {
+      char group[MAX_STATE_LINE];
+      int group_end = 0;
+      if (sscanf(tail + 3, "%s %n", group, &group_end) != 1)
+        return 0;
+      set_breakpoint_group(name, group);
+      tail += 3 + group_end;
+    }
+
+    // Other trailing text was always ignored, so keep ignoring it
+    if (strncmp(tail, "if ", 3) != 0)
+      continue;
+    if (!set_breakpoint_condition(name, tail + 3))
+      return 0;
   }
 
   fclose(fp);
+  publish_state();
   return 1;
 }
 
 int Emulator::save_state(const std::string filename) const {
+  ScopedLatency latency(latencies != nullptr ? &latencies->save_state : nullptr);
+  EMULATOR_PROBE1(save_state_entry, filename.c_str());
+
+  int saved = write_state_file(filename);
+
+  EMULATOR_PROBE2(save_state_return, filename.c_str(), saved);
+  return saved;
+}
+
+int Emulator::write_state_file(const std::string filename) const {
   FILE* fp = fopen(filename.c_str(), "w");
 
   if (fp == NULL)
     return 0;
 
-  fprintf(fp, "%d\n", total_cycles);
+  fprintf(fp, "%" PRIu64 "\n", total_cycles);
   fprintf(fp, "%d\n", state.acc);
   fprintf(fp, "%d\n", state.pc);
 
@@ -464,8 +1853,29 @@ int Emulator::save_state(const std::string filename) const {
     fprintf(fp, "%d\n", num);
   }
 
-  for (int idx = 0; idx < breakpoints_sz; ++idx)
-    fprintf(fp, "%d %s\n", breakpoints[idx].get_address(), breakpoints[idx].get_name());
+  for (int idx = 0; idx < breakpoints_sz; ++idx) {
+    fprintf(fp, "%d %s", breakpoints[idx].get_address(), breakpoints[idx].get_name().c_str());
+    if (!breakpoints[idx].get_group().empty())
+      fprintf(fp, " in %s", breakpoints[idx].get_group().c_str());
+    if (breakpoints[idx].has_condition())
+      fprintf(fp, " if %s", breakpoints[idx].get_condition().c_str());
+    fprintf(fp, "\n");
+  }
+
+  for (const BreakpointGroup& group : groups)
+    fprintf(fp, "group %s %s\n", group.name.c_str(), group.enabled ? "on" : "off");
+
+  for (const Watchpoint& watchpoint : watchpoints)
+    fprintf(fp, "watch %d %s %s\n", watchpoint.get_address(), watchpoint.get_name().c_str(),
+        watchpoint.get_kind() == WATCH_CHANGE ? "change" : "write");
+
+  for (int opcode = 0; opcode < NUM_OPCODES; ++opcode)
+    if (has_opcode_break(opcode))
+      fprintf(fp, "break opcode %s\n", InstructionBase::lookupInstruction({(byte_t)opcode, 0})->name().c_str());
+
+  for (data_t value = 0; value <= ARCH_MAXVAL; ++value)
+    if (has_acc_break(value))
+      fprintf(fp, "break acc %d\n", value);
 
   fclose(fp);
   
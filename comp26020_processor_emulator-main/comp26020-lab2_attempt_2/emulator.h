@@ -20,17 +20,218 @@
 // (e.g., out-of-order execution)
 // -----------------------------------------------------------------------------
 
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <span>
+#include <vector>
 #include "common.h"
+#include "condition.h"
+#include "instructions.h"
+#include "state.h"
+
+// Defined in trace.h; the emulator only keeps a pointer to one
+class TraceRecorder;
+
+// Defined in histogram.h; the emulator only keeps a pointer to one
+struct LatencyStats;
 
 //------------------------------------------------------------------------------
 //--------------------               CONSTANTS              --------------------
 //------------------------------------------------------------------------------
 #define MAX_INSTRUCTIONS ((MEMORY_SIZE) / (INSTRUCTION_SIZE))
+#define CYCLES_UNBOUNDED UINT64_MAX
+#define MAX_STATE_LINE 1024
+
+// How many cycles the emulation loop runs between checks of the cancellation
+// token and the wall-clock deadline. Checking every cycle would make the fast
+// path pay for a feature it rarely uses.
+#define RUN_CHECK_INTERVAL 4096
+
+// Optional work done by the emulation loop. Each combination is compiled
+// separately, so the loop only pays for what's enabled.
+#define RUN_COUNT_OPCODES 1
+#define RUN_PROFILE 2
+#define RUN_TIMING 4
+#define RUN_TRACE 8
+#define RUN_ALL_FEATURES (RUN_COUNT_OPCODES | RUN_PROFILE | RUN_TIMING | RUN_TRACE)
+
+// How many cycles run_many() gives each emulator before moving on to the
+// next one. Small enough that the batch makes progress evenly, large enough
+// that switching emulators is rare compared to executing instructions.
+#define RUN_MANY_SLICE 1024
+
+//------------------------------------------------------------------------------
+//--------------------             HELPER TYPES             --------------------
+//------------------------------------------------------------------------------
+
+/**
+ * Why the last call to run(), run_until() or run_for() returned
+ */
+enum StopReason {
+  STOP_STEPS = 0,       // the step/cycle budget was used up
+  STOP_BREAKPOINT,      // the pc reached a breakpoint
+  STOP_ODD_PC,          // the pc was not aligned to an instruction (run() returned 0)
+  STOP_INVALID_OPCODE,  // the instruction could not be decoded (run() returned 0)
+  STOP_CANCELLED,       // a CancelToken was set by some other thread
+  STOP_DEADLINE,        // the wall-clock budget of run_for() expired
+  STOP_WATCHPOINT,      // a STR wrote to a watched address
+  STOP_CYCLE,           // the cycle count reached a break_at_cycle()/break_every() target
+  STOP_OPCODE,          // an instruction with an opcode from break_on_opcode() was executed
+  STOP_ACC              // an instruction set the accumulator to a value from break_on_acc()
+};
+
+/**
+ * When a watchpoint stops the emulator
+ */
+enum WatchKind {
+  WATCH_WRITE = 0,  // on every STR to the address
+  WATCH_CHANGE      // only on STRs that change the value at the address
+};
+
+/**
+ * A named set of breakpoints that can be enabled or disabled together
+ *
+ * The group keeps a bitmap of its breakpoint addresses, so toggling it is a
+ * handful of bitwise operations, no matter how many breakpoints it holds.
+ */
+struct BreakpointGroup {
+  std::string name;
+  uint64_t mask[MEMORY_SIZE / 64];
+  int enabled;
+};
+
+/**
+ * Everything a caller might want to know about a single run
+ *
+ * It's a plain struct (no constructor) so that it can be returned by value
+ * cheaply and stored in arrays by schedulers.
+ */
+struct RunResult {
+  /**
+   * Why the run stopped
+   */
+  StopReason reason;
+
+  /**
+   * How many cycles this run executed (not the total, see Emulator::cycles())
+   */
+  uint64_t cycles;
+
+  /**
+   * The address of the breakpoint we stopped on, or -1 if reason != STOP_BREAKPOINT
+   */
+  addr_t breakpoint;
+
+  /**
+   * The watched address written by the last instruction, or -1 if reason != STOP_WATCHPOINT
+   */
+  addr_t watchpoint;
+
+  /**
+   * 1 if the last cycle reached a cycle breakpoint, 0 otherwise
+   *
+   * Also set when a watchpoint or an address breakpoint on the same cycle
+   * takes precedence in reason.
+   */
+  int cycle_break;
+
+  /**
+   * 1 if opcode_counts was filled in (see Emulator::set_opcode_counting()), 0 otherwise
+   */
+  int counted;
+
+  /**
+   * How many times each opcode was executed during this run, indexed by InstructionOpcode
+   */
+  uint64_t opcode_counts[NUM_OPCODES];
+
+  /**
+   * 1 if the emulator stopped because of an error, i.e. run() would return 0
+   */
+  int failed() const;
+
+  /**
+   * Reset to the result of a run that hasn't executed anything yet
+   *
+   * @param count Whether opcode_counts will be filled in
+   */
+  void reset(int count);
+};
 
 //------------------------------------------------------------------------------
 //--------------------               CLASSES                --------------------
 //------------------------------------------------------------------------------
 
+/**
+ * What a single call to Emulator::step() did
+ *
+ * A plain struct, returned by value, so that stepping never touches the heap.
+ */
+struct StepEvent {
+  /**
+   * STOP_STEPS if the instruction executed normally, STOP_BREAKPOINT or
+   * STOP_WATCHPOINT if it executed and then triggered one, or the error that
+   * prevented it from executing
+   */
+  StopReason reason;
+
+  /**
+   * The pc of the instruction (i.e. before the step)
+   */
+  addr_t pc;
+
+  /**
+   * The two bytes of the instruction
+   */
+  byte_t opcode;
+  byte_t operand;
+
+  /**
+   * The address written by STR, or -1 if the instruction didn't write memory
+   */
+  addr_t store_address;
+
+  /**
+   * The value of the accumulator after the step
+   */
+  data_t acc;
+};
+
+/**
+ * A flag that another thread can set to stop a running emulator.
+ *
+ * The emulator only holds a non-owning pointer to the token, so a single
+ * token can stop many emulators. The emulator polls it every
+ * RUN_CHECK_INTERVAL cycles, so cancellation takes effect at an instruction
+ * boundary shortly after cancel() is called.
+ */
+class CancelToken {
+  public:
+    CancelToken();
+
+    /**
+     * Ask every emulator watching this token to stop
+     */
+    void cancel();
+
+    /**
+     * Clear the flag so the token can be reused
+     */
+    void reset();
+
+    /**
+     * @return 1 if cancel() was called since the last reset(), 0 otherwise
+     */
+    int is_cancelled() const;
+
+  private:
+    // Must be lock-free: cancel() may be called from a signal handler or a
+    // thread we don't want to block
+    static_assert(std::atomic<bool>::is_always_lock_free);
+    std::atomic<bool> _cancelled;
+};
+
 /**
  * A representation of a breakpoint.
  *
@@ -83,9 +284,236 @@ class Breakpoint {
      */
     int has(const std::string name) const;
 
+    /**
+     * Attach a condition to the breakpoint (see condition.h for the syntax)
+     *
+     * An empty string makes the breakpoint unconditional again. Use
+     * Emulator::set_breakpoint_condition() on registered breakpoints, so that
+     * the emulator can reset the hit counter and pick up the change.
+     *
+     * @param condition The condition text
+     * @return 1 for success, 0 if the condition is not valid
+     */
+    int set_condition(const std::string condition);
+
+    /**
+     * Getter for the condition text ("" for unconditional breakpoints)
+     */
+    const std::string get_condition() const;
+
+    /**
+     * The condition as compiled by set_condition(), ready to evaluate
+     */
+    const BreakpointCondition& get_compiled_condition() const;
+
+    /**
+     * @return 1 if the breakpoint has a condition, 0 otherwise
+     */
+    int has_condition() const;
+
+    /**
+     * Getter for the group name ("" if the breakpoint is not in a group)
+     */
+    const std::string get_group() const;
+
+    /**
+     * Setter for the group name. Use Emulator::set_breakpoint_group() on
+     * registered breakpoints, so that the emulator can track the change.
+     */
+    void set_group(const std::string group);
+
+    /**
+     * How many times the pc reached this conditional breakpoint so far
+     * (unconditional breakpoints don't count their hits, and neither do
+     * breakpoints that aren't registered with an emulator)
+     */
+    uint32_t get_hits() const;
+
+    /**
+     * Point the breakpoint at the emulator's hit counter for its address.
+     * The emulation loop does the counting, so the breakpoint only reads it.
+     */
+    void set_hit_counter(std::shared_ptr<const std::atomic<uint32_t>> counter);
+
+  private:
+    addr_t _address;
+    std::string _name;
+    std::string _group;
+    BreakpointCondition _condition;
+    std::shared_ptr<const std::atomic<uint32_t>> _hits;
+};
+
+/**
+ * A representation of a watchpoint (a.k.a. data breakpoint)
+ *
+ * Like a breakpoint, it has an address and a symbolic name, but it triggers
+ * when a STR writes to the address rather than when the pc reaches it.
+ */
+class Watchpoint {
+  public:
+    /**
+     * Creates a watchpoint with the given address, name and kind
+     *
+     * @param address The address we watch
+     * @param name A symbolic name for the watchpoint (same rules as breakpoint names)
+     * @param kind Whether to trigger on every write or only on writes that change the value
+     */
+    Watchpoint(addr_t address, const std::string name, WatchKind kind);
+
+    /**
+     * Getter for the address
+     */
+    addr_t get_address() const;
+
+    /**
+     * Getter for the name
+     */
+    const std::string get_name() const;
+
+    /**
+     * Getter for the kind
+     */
+    WatchKind get_kind() const;
+
+    /**
+     * Testing whether the watchpoint targets this address
+     */
+    int has(addr_t address) const;
+
+    /**
+     * Testing whether the watchpoint targets this name
+     */
+    int has(const std::string name) const;
+
   private:
     addr_t _address;
     std::string _name;
+    WatchKind _kind;
+};
+
+/**
+ * Per-instruction execution counts, collected while profiling (see Emulator::set_profiling())
+ *
+ * Indexed by instruction slot, i.e. pc / INSTRUCTION_SIZE.
+ */
+struct ExecutionProfile {
+  /**
+   * How many times the instruction in each slot was executed
+   */
+  uint64_t executions[MAX_INSTRUCTIONS];
+
+  /**
+   * For JNEs: how many times the jump was taken (acc != 0) and not taken
+   */
+  uint64_t taken[MAX_INSTRUCTIONS];
+  uint64_t not_taken[MAX_INSTRUCTIONS];
+
+  /**
+   * @return the sum of executions over all slots
+   */
+  uint64_t total() const;
+};
+
+/**
+ * Host time spent on each emulated opcode, collected while timing (see Emulator::set_timing())
+ *
+ * Indexed by opcode. Times are in host ticks: TSC ticks on x86, nanoseconds
+ * elsewhere. Each part of a cycle is timed separately, so the clock is read
+ * four times per cycle and the totals include that cost; clock_overhead is
+ * there to subtract it.
+ */
+struct OpcodeTiming {
+  /**
+   * How many instructions with each opcode were timed
+   */
+  uint64_t count[NUM_OPCODES];
+
+  /**
+   * Fetching the instruction and looking up its InstructionBase
+   */
+  uint64_t decode[NUM_OPCODES];
+
+  /**
+   * The virtual execute(), and counting the cycle
+   */
+  uint64_t execute[NUM_OPCODES];
+
+  /**
+   * Checking the watchpoints, instruction breakpoints and address breakpoints after executing
+   */
+  uint64_t breakpoint_check[NUM_OPCODES];
+
+  /**
+   * The smallest difference between two consecutive clock reads, measured when timing is enabled
+   */
+  uint64_t clock_overhead;
+
+  /**
+   * The average time of one part of the instructions with an opcode, without the clock overhead
+   *
+   * @param ticks One of decode, execute or breakpoint_check
+   * @param opcode The opcode
+   * @return the average in host ticks, or 0 if no instruction with that opcode was timed
+   */
+  double average(const uint64_t (&ticks)[NUM_OPCODES], int opcode) const;
+};
+
+/**
+ * An immutable snapshot of the breakpoints, which is all the emulation loop looks at
+ *
+ * Every change to the breakpoints builds and publishes a new table, so a
+ * thread inside run() keeps using the one it has, without locks, while
+ * another thread edits the breakpoints.
+ */
+struct BreakpointTable {
+  uint64_t version;
+  int size;
+  uint64_t mask[MEMORY_SIZE / 64];
+  uint64_t conditional[MEMORY_SIZE / 64];
+
+  // The conditional breakpoints, in insertion order
+  std::vector<addr_t> addresses;
+  std::vector<BreakpointCondition> conditions;
+};
+
+/**
+ * Hands BreakpointTables from the thread editing the breakpoints to the thread running the emulator
+ *
+ * It works like RCU: the editor publishes a new table with a single atomic
+ * store, and the runner switches to it at its next check, i.e. within
+ * RUN_CHECK_INTERVAL cycles. The runner announces the tables it may be
+ * using in `hazards`, and the editor only frees retired tables that aren't
+ * announced there. Supports one editing and one running thread at a time.
+ */
+struct BreakpointChannel {
+  std::atomic<BreakpointTable*> published{nullptr};
+  std::atomic<BreakpointTable*> hazards[2] = {nullptr, nullptr};
+  std::vector<BreakpointTable*> retired;
+  uint64_t version = 0;
+
+  // Hit counters of the conditional breakpoints, by address. They live here,
+  // rather than in the tables, so that they carry over when tables change.
+  std::atomic<uint32_t> hits[MEMORY_SIZE] = {};
+
+  ~BreakpointChannel();
+};
+
+/**
+ * A copy of the processor state that other threads can read while the emulator runs
+ *
+ * The running thread republishes it at block boundaries under a sequence
+ * lock: the sequence is odd while a copy is being written, so readers retry
+ * until they see the same even sequence before and after reading. All the
+ * fields are atomics (accessed with relaxed ordering, the sequence does the
+ * ordering), so concurrent reads are well-defined and never block the writer.
+ */
+struct StateSeqlock {
+  std::atomic<uint32_t> sequence{0};
+  std::atomic<uint64_t> cycles{0};
+  std::atomic<data_t> acc{0};
+  std::atomic<addr_t> pc{0};
+  std::atomic<uint64_t> memory[MEMORY_SIZE / 8] = {};
+  std::atomic<uint64_t> memory_hash{0};
 };
 
 /**
@@ -173,6 +601,157 @@ class Emulator {
      */
     int run(int steps);
 
+    /**
+     * Run until the total number of cycles reaches max_cycles, until an error happens, or we reach a breakpoint
+     *
+     * Unlike run(), the budget is 64-bit and absolute: it is compared against cycles(), so a caller can
+     * resume a long job with the same target. Passing CYCLES_UNBOUNDED runs until an error or a breakpoint.
+     *
+     * @param max_cycles The value of cycles() at which to stop
+     * @return whether we stopped normally or abnormally (same convention as run())
+     */
+    int run_until(uint64_t max_cycles);
+
+    /**
+     * Run for (roughly) the given amount of wall-clock time, until an error happens, or we reach a breakpoint
+     *
+     * The clock is checked every RUN_CHECK_INTERVAL cycles, so the run can
+     * overshoot the budget by the time it takes to execute that many cycles.
+     *
+     * @param budget How long to run for
+     * @return whether we stopped normally or abnormally (same convention as run())
+     */
+    int run_for(std::chrono::nanoseconds budget);
+
+    /**
+     * Watch the given token while running
+     *
+     * @param token A non-owning pointer to the token, or nullptr to stop watching
+     */
+    void set_cancel_token(const CancelToken* token);
+
+    /**
+     * Record every instruction executed by later runs and steps
+     *
+     * The recorder has to be started (see TraceRecorder::start()) for the
+     * records to reach the file. Copies of the emulator don't record.
+     *
+     * @param recorder A non-owning pointer to the recorder, or nullptr to stop recording
+     */
+    void set_trace(TraceRecorder* recorder);
+
+    /**
+     * Record the latency of every later run_detailed(), load_state() and save_state() call
+     *
+     * Each public run call counts once: run(), run_until() and run_for() go
+     * through run_detailed(), and run_many() records the whole batch.
+     *
+     * Recording is thread-safe, so the same stats can be shared by many
+     * emulators, and copies of the emulator keep recording into them.
+     *
+     * @param stats A non-owning pointer to the histograms, or nullptr to stop recording
+     */
+    void set_latency_stats(LatencyStats* stats);
+
+    /**
+     * The detailed version of run(): run() and friends are thin wrappers around this
+     *
+     * @param steps The maximum number of cycles to execute (CYCLES_UNBOUNDED for no limit)
+     * @param budget How long to run for (nanoseconds::max(), or anything that would overflow the clock, for no limit)
+     * @return the stop reason, the cycles executed, and the breakpoint hit, if any
+     */
+    RunResult run_detailed(uint64_t steps, std::chrono::nanoseconds budget = std::chrono::nanoseconds::max());
+
+    /**
+     * Enable or disable per-opcode counting in the RunResult of later runs
+     *
+     * Counting is off by default; the loop without it is compiled separately,
+     * so it costs nothing when disabled.
+     *
+     * @param enable 1 to count, 0 to stop counting
+     */
+    void set_opcode_counting(int enable);
+
+    /**
+     * Enable or disable the per-instruction profile in later runs and steps
+     *
+     * Like opcode counting, the loop that profiles is compiled separately, so
+     * profiling costs nothing when disabled. The counts are kept across runs
+     * (and when profiling is disabled) until reset_profile().
+     *
+     * @param enable 1 to profile, 0 to stop profiling
+     */
+    void set_profiling(int enable);
+
+    /**
+     * Zero all the counts of the profile
+     */
+    void reset_profile();
+
+    /**
+     * The counts collected so far
+     *
+     * @return A non-owning pointer to the profile, or nullptr if profiling was never enabled
+     */
+    const ExecutionProfile* get_profile() const;
+
+    /**
+     * Enable or disable host timing of each instruction in later runs and steps
+     *
+     * Meant for finding out where the interpreter spends its time: decode,
+     * execute and the breakpoint checks are timed separately for each opcode.
+     * Works with run(), step(), run_many() and friends. Timing slows the
+     * emulator down a lot, but like the profile it is compiled into a separate
+     * loop, so it costs nothing when disabled. The times are kept until reset_timing().
+     *
+     * @param enable 1 to time, 0 to stop timing
+     */
+    void set_timing(int enable);
+
+    /**
+     * Zero all the times and counts
+     */
+    void reset_timing();
+
+    /**
+     * The times collected so far
+     *
+     * @return A non-owning pointer to the times, or nullptr if timing was never enabled
+     */
+    const OpcodeTiming* get_timing() const;
+
+    /**
+     * Advance many independent emulators by up to `steps` cycles each
+     *
+     * The emulators are interleaved in slices of RUN_MANY_SLICE cycles, and the
+     * state of the next emulator is prefetched while the current one runs.
+     * Emulators leave the batch as soon as they stop for any reason other than
+     * the step budget. The outcome for each emulator (state, cycles, and the
+     * RunResult) is identical to calling run_detailed(steps) on it alone.
+     * The call records a single run latency, in each distinct set of stats
+     * among the emulators (see set_latency_stats()).
+     *
+     * @param emulators The emulators to advance
+     * @param steps The maximum number of cycles to execute on each emulator
+     * @param out An array of at least emulators.size() results, one per emulator
+     */
+    static void run_many(std::span<Emulator> emulators, uint64_t steps, RunResult* out);
+
+    /**
+     * Execute exactly one instruction, reporting what it did
+     *
+     * Equivalent to run(1), but never allocates, so interactive frontends
+     * can call it at a high rate without jitter from the allocator.
+     *
+     * @return the event describing the step
+     */
+    StepEvent step();
+
+    /**
+     * Why the last run(), run_until() or run_for() call returned
+     */
+    StopReason stop_reason() const;
+
     // ----------> Breakpoint management
 
     /**
@@ -206,6 +785,54 @@ class Emulator {
 
     const std::shared_ptr<Breakpoint> find_breakpoint(const std::string name) const;
 
+    /**
+     * Attach a condition to the breakpoint with the given name
+     *
+     * The condition is compiled once, here, and only evaluated when the pc
+     * reaches the breakpoint address. See condition.h for the syntax.
+     *
+     * @param name The name of the breakpoint
+     * @param condition The condition text, or "" to make the breakpoint unconditional
+     * @return 1 for success, 0 if there's no such breakpoint or the condition is not valid
+     */
+    int set_breakpoint_condition(const std::string name, const std::string condition);
+
+    /**
+     * Move the breakpoint with the given name into a group
+     *
+     * The group is created (enabled) if it doesn't exist yet. Groups are
+     * never removed, so their enabled state sticks even when they are empty.
+     *
+     * @param name The name of the breakpoint
+     * @param group The name of the group, or "" to take the breakpoint out of its group
+     * @return 1 for success, 0 if there's no such breakpoint
+     */
+    int set_breakpoint_group(const std::string name, const std::string group);
+
+    /**
+     * Enable all the breakpoints in a group
+     *
+     * @param group The name of the group
+     * @return 1 for success, 0 if there's no such group
+     */
+    int enable_group(const std::string group);
+
+    /**
+     * Disable all the breakpoints in a group, without unregistering them
+     *
+     * Disabled breakpoints don't stop the emulator and is_breakpoint() ignores them.
+     *
+     * @param group The name of the group
+     * @return 1 for success, 0 if there's no such group
+     */
+    int disable_group(const std::string group);
+
+    /**
+     * @param group The name of the group
+     * @return 1 if the group exists and is enabled, 0 otherwise
+     */
+    int is_group_enabled(const std::string group) const;
+
     /**
      * Unregister the breakpoint with the given address
      *
@@ -229,14 +856,174 @@ class Emulator {
      */
     int num_breakpoints() const;
 
+    /**
+     * The version of the breakpoints, which goes up with every change to them
+     *
+     * The breakpoint functions above may be called from another thread while
+     * one thread is inside run() and friends; the running thread picks up the
+     * changes within RUN_CHECK_INTERVAL cycles. The rest of the interface,
+     * including the Breakpoint objects returned by find_breakpoint(), is not
+     * thread-safe.
+     */
+    uint64_t breakpoints_version() const;
+
+    /**
+     * The version of the breakpoints the emulation loop is currently using
+     *
+     * Catches up with breakpoints_version() at the next check of a running
+     * thread, or at the start of the next run() or step().
+     */
+    uint64_t active_breakpoints_version() const;
+
+    // ----------> Watchpoint management
+
+    /**
+     * Register a new watchpoint with the given address, name and kind
+     *
+     * Fail if the name or the address are already watched. Watchpoints are
+     * only checked by STR, and only when at least one is registered.
+     *
+     * @param address The address to watch
+     * @param name The name of the watchpoint
+     * @param kind WATCH_WRITE to stop on every write, WATCH_CHANGE to stop only when the value changes
+     * @return whether the operation was successful (1 means success, 0 failure)
+     */
+    int insert_watchpoint(addr_t address, const std::string name, WatchKind kind);
+
+    /**
+     * Find the watchpoint with the given address
+     *
+     * @param address The watched address
+     * @return A non-owning pointer to the Watchpoint (valid until watchpoints change) or nullptr if the address is not watched
+     */
+    const Watchpoint* find_watchpoint(addr_t address) const;
+
+    /**
+     * Find the watchpoint with the given name
+     *
+     * @param name The name of the watchpoint
+     * @return A non-owning pointer to the Watchpoint (valid until watchpoints change) or nullptr if the name was not found
+     */
+    const Watchpoint* find_watchpoint(const std::string name) const;
+
+    /**
+     * Unregister the watchpoint with the given address
+     *
+     * @return Whether a watchpoint was removed (1 means removed, 0 means none removed)
+     */
+    int delete_watchpoint(addr_t address);
+
+    /**
+     * Unregister the watchpoint with the given name
+     *
+     * @return Whether a watchpoint was removed (1 means removed, 0 means none removed)
+     */
+    int delete_watchpoint(const std::string name);
+
+    /**
+     * Get the number of registered watchpoints
+     */
+    int num_watchpoints() const;
+
+    // ----------> Cycle breakpoints
+
+    /**
+     * Stop once, when the total cycle count reaches the given value
+     *
+     * Cycle breakpoints are folded into the step budget of the run loop, so
+     * they cost nothing per cycle. When a watchpoint or an address breakpoint
+     * fires on the same cycle, it is reported in the stop reason (in that
+     * order of precedence) and RunResult::cycle_break is set as well.
+     * A target that was already reached never fires.
+     *
+     * @param cycle The absolute cycle count to stop at (CYCLES_UNBOUNDED to clear)
+     */
+    void break_at_cycle(uint64_t cycle);
+
+    /**
+     * Stop every time the total cycle count reaches a multiple of the period
+     *
+     * Combines with break_at_cycle(), whichever target comes first stops the emulator.
+     *
+     * @param period The number of cycles between stops (0 to clear)
+     */
+    void break_every(uint64_t period);
+
+    // ----------> Instruction breakpoints
+
+    /**
+     * Stop after every instruction with the given opcode, wherever it is in memory
+     *
+     * Instruction breakpoints are keyed on the decoded instruction, so they
+     * follow code that moves or modifies itself. When several kinds fire on the
+     * same cycle, the stop reason is the first of: watchpoint, opcode,
+     * accumulator value, address breakpoint, cycle breakpoint.
+     *
+     * @param opcode The opcode to stop on (an InstructionOpcode)
+     * @return whether the operation was successful (1 means success, 0 means invalid opcode)
+     */
+    int break_on_opcode(byte_t opcode);
+
+    /**
+     * Stop stopping on the given opcode
+     *
+     * @return Whether an opcode breakpoint was removed (1 means removed, 0 means none removed)
+     */
+    int clear_opcode_break(byte_t opcode);
+
+    /**
+     * @return 1 if break_on_opcode() is set for the opcode, 0 otherwise
+     */
+    int has_opcode_break(byte_t opcode) const;
+
+    /**
+     * Stop after every instruction that writes the given value into the accumulator
+     *
+     * Only instructions that write the accumulator (ADD, AND, ORR, XOR, LDR)
+     * trigger it, so it doesn't fire again on every STR or jump that follows.
+     *
+     * @param value The value to stop on (0 to ARCH_MAXVAL)
+     * @return whether the operation was successful (1 means success, 0 means invalid value)
+     */
+    int break_on_acc(data_t value);
+
+    /**
+     * Stop stopping on the given accumulator value
+     *
+     * @return Whether a value breakpoint was removed (1 means removed, 0 means none removed)
+     */
+    int clear_acc_break(data_t value);
+
+    /**
+     * @return 1 if break_on_acc() is set for the value, 0 otherwise
+     */
+    int has_acc_break(data_t value) const;
+
     // ----------> Manage state
 
     /**
      * Return the total number of cycles executes so far
      *
+     * The counter is 64-bit, so long runs don't overflow it
+     *
      * @return number of cycles
      */
-    int cycles() const;
+    uint64_t cycles() const;
+
+    /**
+     * Copy the processor state consistently, from any thread, even while another thread is inside run()
+     *
+     * The state is the one published at the last block boundary of run() and
+     * friends (at most RUN_CHECK_INTERVAL cycles ago), or at the end of the
+     * last run, load_state(), load_image() or write_mem_range(); single
+     * steps are not published. It never
+     * blocks the running thread; it retries instead if it raced with a
+     * publication.
+     *
+     * @param out Where to copy acc, pc and the memory
+     * @return the total number of cycles at the time of the copy
+     */
+    uint64_t snapshot_concurrent(ProcessorState& out) const;
 
     /**
      * Getter for the accumulator
@@ -256,6 +1043,83 @@ class Emulator {
      */
     addr_t read_mem(addr_t address) const;
 
+    /**
+     * Getter for the whole processor state (acc, pc and memory)
+     */
+    const ProcessorState& read_state() const;
+
+    /**
+     * Two emulators are equal if their processor states are equal
+     *
+     * The cycle count, the breakpoints and the other settings are not
+     * compared, so emulators that reached the same state by different paths
+     * are equal.
+     */
+    bool operator==(const Emulator& other) const;
+
+    /**
+     * A 64-bit hash of the processor state, see hash_state()
+     */
+    uint64_t hash() const;
+
+    /**
+     * An O(1) fingerprint of the processor state, see ProcessorState::fingerprint()
+     *
+     * Kept up to date incrementally on every store, so it's cheap enough to
+     * check after every step, e.g. to detect loops. It's a different function
+     * from hash(): use one or the other consistently.
+     */
+    uint64_t fingerprint() const;
+
+    /**
+     * Read consecutive memory bytes
+     *
+     * Like read_mem(), the start address is limited to the allowed range, and
+     * reading past the last byte wraps around to address 0.
+     *
+     * @param address The address of the first byte
+     * @param out Where to copy the bytes; its size is the number of bytes to read (at most MEMORY_SIZE)
+     * @return 1 for success, 0 if out is larger than the memory
+     */
+    int read_mem_range(addr_t address, std::span<byte_t> out) const;
+
+    /**
+     * Write consecutive memory bytes, wrapping around like read_mem_range()
+     *
+     * @param address The address of the first byte
+     * @param data The bytes to write (at most MEMORY_SIZE)
+     * @return 1 for success, 0 if data is larger than the memory
+     */
+    int write_mem_range(addr_t address, std::span<const byte_t> data);
+
+    /**
+     * A read-only view of the whole memory, valid for as long as the emulator
+     */
+    std::span<const byte_t, MEMORY_SIZE> memory() const;
+
+    /**
+     * Initialise the processor from a memory image, without going through a file
+     *
+     * The image is copied to the start of the memory and the rest is cleared.
+     * acc, pc and the cycle count are reset to 0. Unlike load_state(), the
+     * breakpoints and watchpoints are kept.
+     *
+     * @param image The memory image (at most MEMORY_SIZE bytes)
+     * @return 1 for success, 0 if the image is larger than the memory
+     */
+    int load_image(std::span<const byte_t> image);
+
+    /**
+     * Put the processor in a given state, e.g. one rebuilt from a trace, to resume from it
+     *
+     * Like load_image(), the breakpoints and watchpoints are kept.
+     *
+     * @param new_state The acc, pc and memory to use
+     * @param cycles The cycle count of that state
+     * @return 1 for success, 0 if acc or pc don't fit in the architecture
+     */
+    int restore(const ProcessorState& new_state, uint64_t cycles);
+
     // ----------> Utilities
 
     /**
@@ -280,15 +1144,38 @@ class Emulator {
      */
     int print_program() const;
 
+    /**
+     * Prints on stdout the program like print_program(), with each executed
+     * instruction annotated with its execution count and its share of all
+     * the executions, plus the taken/not taken counts of JNEs
+     *
+     * @return 1 for success, 0 if profiling was never enabled
+     */
+    int print_profile() const;
+
+    /**
+     * Prints on stdout one line per opcode with the number of timed
+     * instructions and the average host ticks of decode, execute and the
+     * breakpoint check, without the clock overhead
+     *
+     * @return 1 for success, 0 if timing was never enabled
+     */
+    int print_timing() const;
+
     /**
      * Reads the processor state from a file
      *
      * The format is:
-     * line 1 -> total number of cycles executed so far
+     * line 1 -> total number of cycles executed so far (an unsigned 64-bit number)
      * line 2 -> value of acc
      * line 3 -> value of pc
      * line 4-259 -> All 256 memory bytes in their memory order. Each byte is printed as an unsigned number in its own line.
-     * line 260-end -> One line for each active breakpoint, each line containing the address and name of the breakpoint separated by one space
+     * line 260-end -> One line for each active breakpoint, each line containing the address and name of the breakpoint separated by one space,
+     *                 optionally followed by " in " and the group name, and then optionally by " if " and the breakpoint condition
+     *                 Then one line for each breakpoint group: "group", the name, and "on" or "off", separated by spaces
+     *                 Then one line for each watchpoint: "watch", the address, the name, and "write" or "change", separated by spaces
+     *                 Then one line for each instruction breakpoint: "break opcode" and the opcode name (e.g. "break opcode STR"),
+     *                 or "break acc" and the accumulator value
      *
      * @param state_filename A string containing the name of the file to read
      * @return 1 for success, 0 otherwise
@@ -306,6 +1193,149 @@ class Emulator {
     int save_state(const std::string state_filename) const;
   
   private:
+
+    /**
+     * The actual emulation loop behind run_detailed()
+     *
+     * Instantiated for every combination of RunFeature flags, so that the
+     * common case doesn't pay for the counters.
+     *
+     * @param steps The maximum number of cycles to execute
+     * @param deadline When to give up, or time_point::max() for no deadline
+     * @param result Where to record what happened; the reason is filled in here, and the opcodes are counted
+     * @param sync 0 to skip picking up the breakpoints and publishing the state before the first chunk
+     */
+    template <int FEATURES>
+    void run_loop(uint64_t steps, std::chrono::steady_clock::time_point deadline, RunResult& result, int sync);
+
+    /**
+     * Run the instantiation of run_loop() for the enabled features
+     *
+     * The part of run_detailed() that run_many() calls once per slice, without the once-per-call work.
+     */
+    void run_features(uint64_t steps, std::chrono::steady_clock::time_point deadline, RunResult& result, int sync);
+
+    /**
+     * The once-per-call work after the loop: fill in the breakpoint, count the metrics, publish the state
+     *
+     * @param result The result of the whole call, with cycles filled in
+     */
+    void finish_run(RunResult& result);
+
+    /**
+     * Fetch, decode and execute a single instruction without allocating
+     *
+     * Only RUN_TIMING makes a difference here; the other RunFeature flags are up to the caller.
+     *
+     * @param data Filled in with the instruction bytes (when the pc was valid)
+     * @return STOP_STEPS after a normal cycle, STOP_BREAKPOINT if the cycle ended on a breakpoint, or the error
+     */
+    template <int FEATURES>
+    StopReason cycle(InstructionData& data);
+
+    /**
+     * Decide whether the instruction that just executed stops the emulator
+     *
+     * @param data The instruction
+     * @param old_value The memory byte at data.address before executing, for WATCH_CHANGE
+     * @return STOP_STEPS, or the kind of breakpoint that stops the emulator
+     */
+    StopReason check_stops(InstructionData data, byte_t old_value);
+
+    /**
+     * Count an executed instruction in the profile
+     *
+     * @param pc The pc of the instruction (before executing it)
+     * @param opcode The opcode of the instruction
+     */
+    void record_profile(addr_t pc, byte_t opcode);
+
+    /**
+     * Send an executed instruction to the trace recorder
+     *
+     * @param pc The pc of the instruction (before executing it)
+     * @param data The instruction
+     */
+    void record_trace(addr_t pc, InstructionData data);
+
+    /**
+     * Decide whether the breakpoint on the current pc stops the emulator
+     *
+     * Only called when breakpoint_mask has the pc, so it only needs to deal
+     * with conditions.
+     *
+     * @return 1 to stop, 0 to keep going
+     */
+    int breakpoint_triggers();
+
+    /**
+     * Recompute breakpoint_mask after the breakpoints or the groups changed, and publish the result
+     */
+    void update_breakpoint_mask();
+
+    /**
+     * Build a BreakpointTable from the breakpoints and hand it to the emulation loop
+     *
+     * Also frees the retired tables that the emulation loop can no longer use.
+     */
+    void publish_breakpoints();
+
+    /**
+     * The hit counter of the breakpoint at this address, shared with the channel
+     * so that it stays valid as long as some breakpoint refers to it
+     */
+    std::shared_ptr<const std::atomic<uint32_t>> hit_counter(addr_t address) const;
+
+    /**
+     * Switch the emulation loop to the latest published BreakpointTable, if it isn't using it already
+     */
+    void adopt_breakpoints();
+
+    /**
+     * Copy the processor state into the seqlock, for snapshot_concurrent()
+     */
+    void publish_state();
+
+    /**
+     * @return the index of the group in groups, or -1 if there's no such group
+     */
+    int find_group(const std::string group) const;
+
+    /**
+     * Find the group with the given (non-empty) name, creating it, enabled, if needed
+     *
+     * @return the index of the group in groups
+     */
+    int create_group(const std::string group);
+
+    /**
+     * @return the next cycle count a cycle breakpoint stops at, or CYCLES_UNBOUNDED if there's none
+     */
+    uint64_t next_cycle_break() const;
+
+    /**
+     * Check whether the last cycle reached the given cycle breakpoint target, retiring break_at_cycle() once it has
+     *
+     * @param target The result of next_cycle_break() before the cycles ran
+     * @return 1 if it was reached, 0 otherwise
+     */
+    int reached_cycle_break(uint64_t target);
+
+    /**
+     * Recompute instr_break_mask after the instruction breakpoints changed
+     */
+    void update_instr_break_mask();
+
+    /**
+     * The bodies of load_state() and save_state(), which add the probes and timing around them
+     */
+    int read_state_file(const std::string state_filename);
+    int write_state_file(const std::string state_filename) const;
+
+    /**
+     * Memory was replaced from outside the program: fire the code_invalidate probe (see probes.h)
+     */
+    void invalidate_code(addr_t address, size_t size);
   
     ProcessorState state;
   
@@ -321,6 +1351,83 @@ class Emulator {
   
     std::shared_ptr<Breakpoint[]> breakpoints;
     int breakpoints_sz;
-    int total_cycles;
+
+    // One bit per address, set if there's an enabled breakpoint on it, so
+    // the emulation loop can test for breakpoints without searching.
+    // It's always ungrouped_mask OR'ed with the masks of the enabled groups.
+    uint64_t breakpoint_mask[MEMORY_SIZE / 64];
+    uint64_t ungrouped_mask[MEMORY_SIZE / 64];
+    std::vector<BreakpointGroup> groups;
+
+    // The subset of breakpoint_mask with conditions attached. Breakpoints
+    // outside it stop the emulator without looking up the Breakpoint at all.
+    uint64_t conditional_mask[MEMORY_SIZE / 64];
+
+    // Watchpoints are rare and not part of the original interface, so
+    // they live in a plain vector that stays empty (unallocated) until used
+    std::vector<Watchpoint> watchpoints;
+
+    // One bit per address, set if the address is watched, and the subset
+    // watched with WATCH_CHANGE
+    uint64_t watch_mask[MEMORY_SIZE / 64];
+    uint64_t watch_change_mask[MEMORY_SIZE / 64];
+
+    uint64_t total_cycles;
+
+    // The breakpoints above belong to whoever edits them. The emulation loop
+    // only looks at `table`, the latest snapshot it picked up from the channel.
+    // Shared with the breakpoints, which read their hit counters from it.
+    std::shared_ptr<BreakpointChannel> channel;
+    const BreakpointTable* table = nullptr;
+
+    // The state as of the last block boundary, for other threads to read
+    std::unique_ptr<StateSeqlock> seqlock;
+
+    // Cycle breakpoints: a one-shot absolute target and a period
+    uint64_t break_cycle = CYCLES_UNBOUNDED;
+    uint64_t break_period = 0;
+
+    // Instruction breakpoints: one bit per opcode, and one bit per
+    // accumulator value. instr_break_mask holds the opcodes that need any of
+    // them checked after executing, so the loop tests a single bit per cycle,
+    // which is always clear when neither kind is used.
+    uint32_t opcode_break_mask = 0;
+    uint64_t acc_break_mask[(ARCH_MAXVAL + 1) / 64] = {};
+    int acc_breaks = 0;
+    uint32_t instr_break_mask = 0;
+
+    const CancelToken* cancel_token = nullptr;
+    StopReason last_stop = STOP_STEPS;
+    int count_opcodes = 0;
+
+    // Allocated the first time profiling is enabled
+    std::unique_ptr<ExecutionProfile> profile;
+    int profiling = 0;
+
+    // Allocated the first time timing is enabled
+    std::unique_ptr<OpcodeTiming> timing;
+    int timing_enabled = 0;
+
+    TraceRecorder* trace = nullptr;
+    LatencyStats* latencies = nullptr;
+
+    // One bit per address, set once it was fetched as part of an instruction.
+    // Only kept up to date in EMULATOR_USDT builds, for self_modifying_store.
+    uint64_t fetched_mask[MEMORY_SIZE / 64] = {};
   
 };
+
+/**
+ * Find out which parts of the processor states of two emulators differ
+ */
+StateDiff diff(const Emulator& a, const Emulator& b);
+
+/**
+ * Lets emulators key unordered containers (by their processor state)
+ */
+template <>
+struct std::hash<Emulator> {
+  size_t operator()(const Emulator& emulator) const noexcept {
+    return emulator.hash();
+  }
+};
@@ -3,8 +3,21 @@
 #include "catch.hpp"
 #include "instructions.h"
 #include "emulator.h"
-
+#include "counters.h"
+#include "trace.h"
+#include "replay.h"
+#include "histogram.h"
+#include "jobs.h"
+#include "metrics.h"
+#include "spans.h"
+
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <new>
+#include <thread>
+#include <unordered_set>
+#include <vector>
 
 #include <cstdio>
 #include <fcntl.h>
@@ -24,9 +37,31 @@
 #define S_IRUSR _S_IREAD
 #define S_IWUSR _S_IWRITE
 #else
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #endif
 
+// Count every heap allocation made by the test binary, so that tests can
+// check that some code paths don't allocate at all
+static std::atomic<long> allocation_count(0);
+
+void* operator new(std::size_t size) {
+  ++allocation_count;
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == NULL)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void* ptr) noexcept {
+  free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  free(ptr);
+}
+
 const void* get_location(std::string_view v) {
   return static_cast<const void*>(v.data());
 }
@@ -1563,6 +1598,35 @@ TEST_CASE("Emulator Constructors, Initialisers, and Getters", "[emulator][init][
     const Breakpoint* breakpoints1 = get_address<Breakpoint>(emulator1.find_breakpoint(32));
     CHECK(breakpoints1 == breakpoints);
   }
+
+  SECTION("Moved-from objects can be reused") {
+    Emulator copy{emulator};
+    Emulator emulator1{std::move(emulator)};
+    Emulator emulator2;
+    emulator2 = std::move(emulator1);
+
+    // Both moved-from objects are empty emulators
+    for (Emulator* moved : {&emulator, &emulator1}) {
+      CHECK(moved->num_breakpoints() == 0);
+      CHECK(moved->cycles() == 0);
+      ProcessorState published;
+      CHECK(moved->snapshot_concurrent(published) == 0);
+    }
+
+    // Copy-assign into one, and use the other directly
+    emulator = copy;
+    CHECK(emulator == copy);
+    CHECK(emulator.num_breakpoints() == 1);
+    CHECK_THAT(emulator.find_breakpoint(32)->get_name(), Catch::Matchers::Equals("END"));
+    CHECK(emulator.run(100) == copy.run(100));
+    CHECK(emulator == copy);
+
+    REQUIRE(emulator1.insert_breakpoint(0, "START"));
+    CHECK(emulator1.num_breakpoints() == 1);
+    CHECK(emulator1.run(10));
+    ProcessorState published;
+    CHECK(emulator1.snapshot_concurrent(published) == emulator1.cycles());
+  }
 }
 
 TEST_CASE("Emulator::fetch1", "[emulator][exec]") {
@@ -2135,6 +2199,444 @@ TEST_CASE("Emulator::run4", "[emulator][exec]") {
   CHECK(emulator.cycles() == 8);
 }
 
+TEST_CASE("Emulator::run_until and 64-bit cycles", "[emulator][exec]") {
+  REQUIRE(fopen("data/state_large_cycles.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state_large_cycles.txt"));
+  CHECK(emulator.cycles() == 5000000000ULL);
+
+  // A target in the past is a no-op
+  CHECK(emulator.run_until(100));
+  CHECK(emulator.cycles() == 5000000000ULL);
+
+  // Nothing else breaks the loop at 0, so we stop exactly on the target
+  REQUIRE(emulator.delete_breakpoint("LOOP"));
+  CHECK(emulator.run_until(5000000100ULL));
+  CHECK(emulator.cycles() == 5000000100ULL);
+  CHECK(emulator.read_pc() == 0);
+
+  // Unbounded runs still stop on breakpoints
+  REQUIRE(emulator.insert_breakpoint(0, "LOOP"));
+  CHECK(emulator.run_until(CYCLES_UNBOUNDED));
+  CHECK(emulator.cycles() == 5000000101ULL);
+
+  // The counter survives a save/load round trip
+  REQUIRE(emulator.save_state("output/state_large_cycles.txt"));
+  Emulator emulator1;
+  REQUIRE(emulator1.load_state("output/state_large_cycles.txt"));
+  CHECK(emulator1.cycles() == 5000000101ULL);
+  CHECK(emulator1.read_acc() == 7);
+  CHECK(emulator1.num_breakpoints() == 1);
+  remove("output/state_large_cycles.txt");
+
+  // So do counts from 2^63 up, which don't fit in a signed 64-bit integer
+  REQUIRE(emulator.restore(ProcessorState(), ((uint64_t)1 << 63) + 5));
+  REQUIRE(emulator.save_state("output/state_large_cycles.txt"));
+  REQUIRE(emulator1.load_state("output/state_large_cycles.txt"));
+  CHECK(emulator1.cycles() == ((uint64_t)1 << 63) + 5);
+  remove("output/state_large_cycles.txt");
+
+  // Negative counts are still rejected, rather than wrapped around
+  FILE* fp = fopen("output/state_negative_cycles.txt", "w");
+  REQUIRE(fp != NULL);
+  fprintf(fp, "-1\n0\n0\n");
+  for (int i = 0; i < MEMORY_SIZE; ++i)
+    fprintf(fp, "0\n");
+  fclose(fp);
+  CHECK(!emulator1.load_state("output/state_negative_cycles.txt"));
+  remove("output/state_negative_cycles.txt");
+}
+
+TEST_CASE("Emulator::run_for and cancellation", "[emulator][exec]") {
+  REQUIRE(fopen("data/state_large_cycles.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state_large_cycles.txt"));
+  REQUIRE(emulator.delete_breakpoint("LOOP"));
+  uint64_t start = emulator.cycles();
+
+  SECTION("run_for() stops on the deadline") {
+    CHECK(emulator.run_for(std::chrono::milliseconds(5)));
+    CHECK(emulator.stop_reason() == STOP_DEADLINE);
+    CHECK(emulator.cycles() > start);
+
+    // A zero budget doesn't execute anything
+    uint64_t before = emulator.cycles();
+    CHECK(emulator.run_for(std::chrono::nanoseconds(0)));
+    CHECK(emulator.stop_reason() == STOP_DEADLINE);
+    CHECK(emulator.cycles() == before);
+  }
+
+  SECTION("Budgets too large for the clock mean no deadline") {
+    RunResult result = emulator.run_detailed(100000, std::chrono::nanoseconds::max() - std::chrono::nanoseconds(1));
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(result.cycles == 100000);
+    result = emulator.run_detailed(100000, std::chrono::hours(24 * 365 * 290));
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(result.cycles == 100000);
+  }
+
+  SECTION("Another thread can cancel an unbounded run") {
+    CancelToken token;
+    emulator.set_cancel_token(&token);
+
+    int result = 0;
+    std::thread worker([&]() { result = emulator.run_until(CYCLES_UNBOUNDED); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    token.cancel();
+    worker.join();
+
+    CHECK(result == 1);
+    CHECK(emulator.stop_reason() == STOP_CANCELLED);
+    CHECK(emulator.cycles() > start);
+
+    // Still cancelled: nothing runs until the token is reset
+    uint64_t before = emulator.cycles();
+    CHECK(emulator.run(10));
+    CHECK(emulator.cycles() == before);
+    token.reset();
+    CHECK(emulator.run(10));
+    CHECK(emulator.stop_reason() == STOP_STEPS);
+    CHECK(emulator.cycles() == before + 10);
+  }
+
+  SECTION("Stop reasons for breakpoints and errors") {
+    REQUIRE(emulator.insert_breakpoint(0, "LOOP"));
+    CHECK(emulator.run(10));
+    CHECK(emulator.stop_reason() == STOP_BREAKPOINT);
+
+    Emulator emulator1;
+    REQUIRE(emulator1.load_state("data/state4.txt"));
+    CHECK(not emulator1.run(100));
+    CHECK(emulator1.stop_reason() == STOP_INVALID_OPCODE);
+  }
+}
+
+TEST_CASE("Emulator::run_detailed", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+  REQUIRE(fopen("data/state4.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  uint64_t start = emulator.cycles();
+
+  SECTION("Step exhaustion") {
+    RunResult result = emulator.run_detailed(5);
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(result.cycles == 5);
+    CHECK(result.breakpoint == -1);
+    CHECK(not result.counted);
+    CHECK(not result.failed());
+    CHECK(emulator.cycles() == start + 5);
+  }
+
+  SECTION("Breakpoint hit and opcode counts") {
+    REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+    emulator.set_opcode_counting(1);
+    RunResult result = emulator.run_detailed(CYCLES_UNBOUNDED);
+    CHECK(result.reason == STOP_BREAKPOINT);
+    CHECK(result.breakpoint == 18);
+    CHECK(result.cycles == emulator.cycles() - start);
+    REQUIRE(result.counted);
+
+    uint64_t total = 0;
+    for (int op = 0; op < NUM_OPCODES; ++op)
+      total += result.opcode_counts[op];
+    CHECK(total == result.cycles);
+
+    // The cycle count of each call is reported, not the total
+    RunResult result1 = emulator.run_detailed(CYCLES_UNBOUNDED);
+    CHECK(result1.reason == STOP_BREAKPOINT);
+    CHECK(result1.cycles == 10);
+  }
+
+  SECTION("Invalid opcode and odd pc are told apart") {
+    Emulator emulator1;
+    REQUIRE(emulator1.load_state("data/state4.txt"));
+    RunResult result = emulator1.run_detailed(100);
+    CHECK(result.reason == STOP_INVALID_OPCODE);
+    CHECK(result.failed());
+    CHECK(result.cycles == 8);
+
+    // state3 holds successive values, so sooner or later we jump to an odd address
+    Emulator emulator2;
+    REQUIRE(emulator2.load_state("data/state3.txt"));
+    result = emulator2.run_detailed(100);
+    CHECK(result.reason == STOP_ODD_PC);
+    CHECK(result.failed());
+  }
+}
+
+TEST_CASE("Emulator::run_many", "[emulator][exec]") {
+  const char* files[] = {"data/state1.txt", "data/state2.txt", "data/state3.txt", "data/state4.txt", "data/state_large_cycles.txt"};
+  const int num = 5;
+
+  for (uint64_t steps : {(uint64_t)1, (uint64_t)7, (uint64_t)3000, (uint64_t)RUN_MANY_SLICE * 3 + 5}) {
+    std::vector<Emulator> batch(num);
+    std::vector<Emulator> single(num);
+    for (int i = 0; i < num; ++i) {
+      REQUIRE(batch[i].load_state(files[i]));
+      REQUIRE(single[i].load_state(files[i]));
+      batch[i].set_opcode_counting(i % 2);
+      single[i].set_opcode_counting(i % 2);
+    }
+    // Without this, state_large_cycles stops on its first cycle
+    REQUIRE(batch[4].delete_breakpoint("LOOP"));
+    REQUIRE(single[4].delete_breakpoint("LOOP"));
+
+    RunResult results[num];
+    MetricsSnapshot before = metrics_snapshot();
+    Emulator::run_many(batch, steps, results);
+    MetricsSnapshot after = metrics_snapshot();
+
+    uint64_t executed = 0;
+    for (int i = 0; i < num; ++i)
+      executed += results[i].cycles;
+    CHECK(after.value[METRIC_INSTRUCTIONS] - before.value[METRIC_INSTRUCTIONS] == executed);
+
+    for (int i = 0; i < num; ++i) {
+      // The final state is published, although not every slice is
+      ProcessorState published;
+      CHECK(batch[i].snapshot_concurrent(published) == batch[i].cycles());
+      CHECK(published == batch[i].read_state());
+
+      RunResult expected = single[i].run_detailed(steps);
+      CHECK(results[i].reason == expected.reason);
+      CHECK(results[i].cycles == expected.cycles);
+      CHECK(results[i].breakpoint == expected.breakpoint);
+      CHECK(results[i].counted == expected.counted);
+      for (int op = 0; op < NUM_OPCODES; ++op)
+        CHECK(results[i].opcode_counts[op] == expected.opcode_counts[op]);
+
+      CHECK(batch[i].cycles() == single[i].cycles());
+      CHECK(batch[i].read_acc() == single[i].read_acc());
+      CHECK(batch[i].read_pc() == single[i].read_pc());
+      CHECK(batch[i].stop_reason() == single[i].stop_reason());
+      for (int addr = 0; addr < MEMORY_SIZE; ++addr)
+        CHECK(batch[i].read_mem(addr) == single[i].read_mem(addr));
+    }
+  }
+}
+
+TEST_CASE("Emulator::step", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+  REQUIRE(fopen("data/state4.txt", "r") != NULL);
+
+  SECTION("Events describe each instruction") {
+    Emulator emulator;
+    REQUIRE(emulator.load_state("data/state4.txt"));
+
+    // (0,1) -> ADD 1
+    StepEvent event = emulator.step();
+    CHECK(event.reason == STOP_STEPS);
+    CHECK(event.pc == 0);
+    CHECK(event.opcode == ADD);
+    CHECK(event.operand == 1);
+    CHECK(event.store_address == -1);
+    CHECK(event.acc == 1);
+
+    for (int i = 0; i < 4; ++i)
+      REQUIRE(emulator.step().reason == STOP_STEPS);
+
+    // (5,11) -> STR [11]
+    event = emulator.step();
+    CHECK(event.pc == 10);
+    CHECK(event.opcode == STR);
+    CHECK(event.store_address == 11);
+    CHECK(event.acc == 9);
+    CHECK(emulator.read_mem(11) == 9);
+
+    REQUIRE(emulator.step().reason == STOP_STEPS);
+    REQUIRE(emulator.step().reason == STOP_STEPS);
+
+    // (10,4) -> Invalid instruction, nothing executed
+    event = emulator.step();
+    CHECK(event.reason == STOP_INVALID_OPCODE);
+    CHECK(event.pc == 20);
+    CHECK(event.store_address == -1);
+    CHECK(emulator.cycles() == 8);
+  }
+
+  SECTION("Stepping doesn't allocate") {
+    Emulator emulator;
+    REQUIRE(emulator.load_state("data/state2.txt"));
+    REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+    Emulator reference = emulator;
+
+    // The first step builds the shared instruction table
+    emulator.step();
+    reference.run(1);
+
+    long before = allocation_count.load();
+    int breakpoints_hit = 0;
+    for (int i = 0; i < 200; ++i) {
+      StepEvent event = emulator.step();
+      breakpoints_hit += event.reason == STOP_BREAKPOINT;
+    }
+    long after = allocation_count.load();
+    CHECK(after == before);
+    CHECK(breakpoints_hit > 0);
+
+    // And stepping matches run(1)
+    for (int i = 0; i < 200; ++i)
+      reference.run(1);
+    CHECK(emulator.cycles() == reference.cycles());
+    CHECK(emulator.read_acc() == reference.read_acc());
+    CHECK(emulator.read_pc() == reference.read_pc());
+
+    // Not even the first step on a new thread, which claims its metrics slot
+    long first_step = -1;
+    std::thread stepper([&]() {
+      Emulator fresh(reference);
+      long before = allocation_count.load();
+      fresh.step();
+      first_step = allocation_count.load() - before;
+    });
+    stepper.join();
+    CHECK(first_step == 0);
+  }
+}
+
+TEST_CASE("Cycle Breakpoints", "[emulator][breakpoint][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  REQUIRE(emulator.cycles() == 5);
+
+  SECTION("break_at_cycle() fires once") {
+    emulator.break_at_cycle(100);
+    RunResult result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_CYCLE);
+    CHECK(result.cycle_break == 1);
+    CHECK(emulator.cycles() == 100);
+    CHECK(emulator.stop_reason() == STOP_CYCLE);
+
+    // Already reached, so it doesn't stop us again
+    result = emulator.run_detailed(50);
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(result.cycle_break == 0);
+    CHECK(emulator.cycles() == 150);
+
+    // Targets in the past never fire
+    emulator.break_at_cycle(10);
+    CHECK(emulator.run(50));
+    CHECK(emulator.stop_reason() == STOP_STEPS);
+  }
+
+  SECTION("break_every() fires on every multiple") {
+    emulator.break_every(7);
+    for (uint64_t expected = 7; expected <= 70; expected += 7) {
+      RunResult result = emulator.run_detailed(CYCLES_UNBOUNDED);
+      REQUIRE(result.reason == STOP_CYCLE);
+      CHECK(emulator.cycles() == expected);
+    }
+
+    emulator.break_every(0);
+    CHECK(emulator.run_detailed(100).reason == STOP_STEPS);
+  }
+
+  SECTION("The step budget ending on the target reports the target") {
+    emulator.break_at_cycle(7);
+    CHECK(emulator.run(2));
+    CHECK(emulator.stop_reason() == STOP_CYCLE);
+
+    emulator.break_at_cycle(8);
+    CHECK(emulator.step().reason == STOP_CYCLE);
+    CHECK(emulator.step().reason == STOP_STEPS);
+  }
+
+  SECTION("Address breakpoints take precedence on the same cycle") {
+    // pc reaches 18 after 9 cycles, i.e. at cycle 14
+    REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+    emulator.break_every(7);
+
+    RunResult result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_CYCLE);
+    CHECK(emulator.cycles() == 7);
+
+    result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_BREAKPOINT);
+    CHECK(result.breakpoint == 18);
+    CHECK(result.cycle_break == 1);
+    CHECK(emulator.cycles() == 14);
+
+    // The same target doesn't fire twice
+    result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_CYCLE);
+    CHECK(emulator.cycles() == 21);
+  }
+
+  SECTION("Copies keep their cycle breakpoints") {
+    emulator.break_at_cycle(40);
+    Emulator copy = emulator;
+    CHECK(copy.run_detailed(1000).reason == STOP_CYCLE);
+    CHECK(copy.cycles() == 40);
+  }
+}
+
+TEST_CASE("Emulator::snapshot_concurrent", "[emulator][exec]") {
+  // A counter kept in two places: mem[100] == mem[101], except between the two STRs
+  // 0: LDR 100, 2: ADD 102, 4: STR 100, 6: STR 101, 8: JMP 0, mem[102] = 1
+  FILE* fp = fopen("output/state_counter.txt", "w");
+  REQUIRE(fp != NULL);
+  fprintf(fp, "0\n0\n0\n");
+  for (int offset = 0; offset < MEMORY_SIZE; ++offset) {
+    const int program[10] = {LDR, 100, ADD, 102, STR, 100, STR, 101, JMP, 0};
+    int value = offset < 10 ? program[offset] : (offset == 102);
+    fprintf(fp, "%d\n", value);
+  }
+  fclose(fp);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("output/state_counter.txt"));
+  remove("output/state_counter.txt");
+  ProcessorState snapshot;
+
+  SECTION("Matches the state after a run") {
+    CHECK(emulator.snapshot_concurrent(snapshot) == 0);
+    CHECK(snapshot.memory[102] == 1);
+
+    REQUIRE(emulator.run(1003));
+    CHECK(emulator.snapshot_concurrent(snapshot) == emulator.cycles());
+    CHECK(snapshot.acc == emulator.read_acc());
+    CHECK(snapshot.pc == emulator.read_pc());
+    for (int offset = 0; offset < MEMORY_SIZE; ++offset)
+      CHECK(snapshot.memory[offset] == emulator.read_mem(offset));
+  }
+
+  SECTION("Snapshots are consistent while another thread runs") {
+    std::atomic<bool> done(false);
+    std::thread worker([&]() {
+      emulator.run_for(std::chrono::milliseconds(300));
+      done = true;
+    });
+
+    int snapshots = 0;
+    int inconsistent = 0;
+    uint64_t last_cycles = 0;
+    while (!done) {
+      uint64_t cycles = emulator.snapshot_concurrent(snapshot);
+      ++snapshots;
+
+      // The pc follows the cycle count, and the two copies of the counter agree
+      int behind = snapshot.pc == 6 ? 1 : 0;
+      if ((uint64_t)snapshot.pc != 2 * (cycles % 5) ||
+          snapshot.memory[100] != (byte_t)(snapshot.memory[101] + behind) ||
+          cycles < last_cycles)
+        ++inconsistent;
+      last_cycles = cycles;
+      std::this_thread::yield();
+    }
+    worker.join();
+
+    CHECK(snapshots > 0);
+    CHECK(inconsistent == 0);
+    CHECK(emulator.snapshot_concurrent(snapshot) == emulator.cycles());
+  }
+}
+
 // -----------------------------------------------------------------------------
 // -------------------------    BREAKPOINT MANAGEMENT  -------------------------
 // -----------------------------------------------------------------------------
@@ -2410,6 +2912,628 @@ TEST_CASE("Delete Breakpoint", "[emulator][breakpoint][exec]") {
 // This mainly tests is_zero() and is_breakpoint(), but indirectly
 // tests the whole emulator. If you get an error here, make sure
 // you don't have another error in an earlier test
+TEST_CASE("Conditional Breakpoints", "[emulator][breakpoint][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+
+  SECTION("Conditions are validated") {
+    CHECK(not emulator.set_breakpoint_condition("NOSUCH", "acc == 0"));
+    CHECK(not emulator.set_breakpoint_condition("LOOPEND", "acc = 0"));
+    CHECK(not emulator.set_breakpoint_condition("LOOPEND", "mem[256] > 1"));
+    CHECK(not emulator.set_breakpoint_condition("LOOPEND", "acc == 1 &&"));
+    CHECK(not emulator.set_breakpoint_condition("LOOPEND", "register == 1"));
+    CHECK(not emulator.set_breakpoint_condition("LOOPEND", "acc == 1 extra"));
+    CHECK(not emulator.find_breakpoint("LOOPEND")->has_condition());
+
+    CHECK(emulator.set_breakpoint_condition("LOOPEND", "  acc==1&&pc<=18 "));
+    CHECK_THAT(emulator.find_breakpoint("LOOPEND")->get_condition(), Catch::Matchers::Equals("acc==1&&pc<=18"));
+    CHECK(emulator.set_breakpoint_condition("LOOPEND", ""));
+    CHECK(not emulator.find_breakpoint("LOOPEND")->has_condition());
+  }
+
+  SECTION("Accumulator condition") {
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "acc == 10"));
+    REQUIRE(emulator.run(1000000));
+    CHECK(emulator.stop_reason() == STOP_BREAKPOINT);
+    CHECK(emulator.read_pc() == 18);
+    CHECK(emulator.read_acc() == 10);
+    CHECK(emulator.find_breakpoint(18)->get_hits() == 22);
+  }
+
+  SECTION("Conditions carry over when other breakpoints change") {
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "acc == 10"));
+    REQUIRE(emulator.insert_breakpoint(0, "START"));
+    REQUIRE(emulator.set_breakpoint_group("START", "ENTRY"));
+    REQUIRE(emulator.disable_group("ENTRY"));
+    REQUIRE(emulator.enable_group("ENTRY"));
+    REQUIRE(emulator.disable_group("ENTRY"));
+    REQUIRE(emulator.run(1000000));
+    CHECK(emulator.read_pc() == 18);
+    CHECK(emulator.read_acc() == 10);
+    CHECK(emulator.find_breakpoint(18)->get_hits() == 22);
+  }
+
+  SECTION("Hits are read from the emulator that counts them") {
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "hits == 3"));
+    REQUIRE(emulator.run(1000000));
+    const std::shared_ptr<Breakpoint> loopend = emulator.find_breakpoint("LOOPEND");
+    CHECK(loopend->get_hits() == 3);
+
+    // A copy counts on its own
+    Emulator emulator1{emulator};
+    REQUIRE(emulator1.run(1000));
+    CHECK(emulator1.find_breakpoint("LOOPEND")->get_hits() > 3);
+    CHECK(loopend->get_hits() == 3);
+
+    // Changing the condition resets the count
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "hits == 2"));
+    CHECK(loopend->get_hits() == 0);
+
+    // The counter stays readable after the emulator is gone
+    emulator = Emulator();
+    CHECK(loopend->get_hits() == 0);
+    CHECK(Breakpoint(18, "LOOPEND").get_hits() == 0);
+  }
+
+  SECTION("Hit count and memory conditions") {
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "hits >= 5"));
+    REQUIRE(emulator.run(1000000));
+    CHECK(emulator.read_acc() == 27);
+    REQUIRE(emulator.run(1000000));
+    CHECK(emulator.read_acc() == 26);
+
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "mem[63] > 30 && acc != 0"));
+    REQUIRE(emulator.run(1000000));
+    CHECK(emulator.read_pc() == 18);
+    CHECK(emulator.read_mem(63) > 30);
+  }
+
+  SECTION("A condition that never holds") {
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "acc > 200"));
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.stop_reason() == STOP_STEPS);
+    CHECK(emulator.read_pc() == 20);
+  }
+
+  SECTION("Conditions survive save_state/load_state") {
+    REQUIRE(emulator.insert_breakpoint(4, "UPDATE"));
+    REQUIRE(emulator.set_breakpoint_condition("LOOPEND", "acc == 10 && mem[63] >= 2"));
+    REQUIRE(emulator.save_state("output/state_conditions.txt"));
+
+    Emulator emulator1;
+    REQUIRE(emulator1.load_state("output/state_conditions.txt"));
+    CHECK(emulator1.num_breakpoints() == 2);
+    CHECK(not emulator1.find_breakpoint("UPDATE")->has_condition());
+    CHECK_THAT(emulator1.find_breakpoint("LOOPEND")->get_condition(), Catch::Matchers::Equals("acc == 10 && mem[63] >= 2"));
+
+    // Text after the name that isn't a group or a condition is ignored, like before conditions existed
+    FILE* fp = fopen("output/state_conditions.txt", "a");
+    REQUIRE(fp != NULL);
+    fprintf(fp, "12 OLD written by an older tool\n");
+    fclose(fp);
+    REQUIRE(emulator1.load_state("output/state_conditions.txt"));
+    REQUIRE(emulator1.find_breakpoint("OLD") != NULL);
+    CHECK(emulator1.find_breakpoint("OLD")->get_address() == 12);
+    CHECK(not emulator1.find_breakpoint("OLD")->has_condition());
+
+    // But an invalid condition fails the load
+    fp = fopen("output/state_conditions.txt", "a");
+    REQUIRE(fp != NULL);
+    fprintf(fp, "20 END if acc ==\n");
+    fclose(fp);
+    CHECK(not emulator1.load_state("output/state_conditions.txt"));
+    remove("output/state_conditions.txt");
+  }
+}
+
+TEST_CASE("Breakpoint Groups", "[emulator][breakpoint][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  const addr_t addresses[] = {0, 4, 10, 18};
+  const char* names[] = {"START", "UPDATE", "PTR", "LOOPEND"};
+  for (int i = 0; i < 4; ++i)
+    REQUIRE(emulator.insert_breakpoint(addresses[i], names[i]));
+
+  CHECK(not emulator.set_breakpoint_group("NOSUCH", "LOOP"));
+  CHECK(not emulator.enable_group("LOOP"));
+  CHECK(not emulator.is_group_enabled("LOOP"));
+
+  REQUIRE(emulator.set_breakpoint_group("START", "LOOP"));
+  REQUIRE(emulator.set_breakpoint_group("UPDATE", "LOOP"));
+  REQUIRE(emulator.set_breakpoint_group("PTR", "LOOP"));
+  CHECK(emulator.is_group_enabled("LOOP"));
+  CHECK_THAT(emulator.find_breakpoint(4)->get_group(), Catch::Matchers::Equals("LOOP"));
+
+  SECTION("Disabled groups don't stop the emulator") {
+    REQUIRE(emulator.disable_group("LOOP"));
+    CHECK(not emulator.is_group_enabled("LOOP"));
+    CHECK(emulator.num_breakpoints() == 4);
+    CHECK(not emulator.is_breakpoint());
+
+    // Only LOOPEND is left
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 18);
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 18);
+
+    // Back on
+    REQUIRE(emulator.enable_group("LOOP"));
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 0);
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 4);
+  }
+
+  SECTION("Moving and deleting grouped breakpoints") {
+    REQUIRE(emulator.set_breakpoint_group("PTR", ""));
+    REQUIRE(emulator.disable_group("LOOP"));
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 10);
+
+    REQUIRE(emulator.delete_breakpoint("UPDATE"));
+    REQUIRE(emulator.enable_group("LOOP"));
+    CHECK(emulator.num_breakpoints() == 3);
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 18);
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 0);
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.read_pc() == 10);
+
+    // Deleting keeps the insertion order of the rest
+    REQUIRE(emulator.delete_breakpoint(0));
+    REQUIRE(emulator.insert_breakpoint(0, "START"));
+    REQUIRE(emulator.save_state("output/state_groups.txt"));
+    FILE* fp = fopen("output/state_groups.txt", "r");
+    REQUIRE(fp != NULL);
+    char line[MAX_STATE_LINE];
+    for (int i = 0; i < 3 + MEMORY_SIZE; ++i)
+      REQUIRE(fgets(line, MAX_STATE_LINE, fp) != NULL);
+    REQUIRE(fgets(line, MAX_STATE_LINE, fp) != NULL);
+    CHECK_THAT(line, Catch::Matchers::Equals("10 PTR\n"));
+    REQUIRE(fgets(line, MAX_STATE_LINE, fp) != NULL);
+    CHECK_THAT(line, Catch::Matchers::Equals("18 LOOPEND\n"));
+    REQUIRE(fgets(line, MAX_STATE_LINE, fp) != NULL);
+    CHECK_THAT(line, Catch::Matchers::Equals("0 START\n"));
+    fclose(fp);
+    remove("output/state_groups.txt");
+  }
+
+  SECTION("Groups survive save_state/load_state") {
+    REQUIRE(emulator.set_breakpoint_condition("PTR", "acc > 1"));
+    REQUIRE(emulator.set_breakpoint_group("LOOPEND", "END"));
+    REQUIRE(emulator.disable_group("LOOP"));
+    REQUIRE(emulator.save_state("output/state_groups.txt"));
+
+    Emulator emulator1;
+    REQUIRE(emulator1.load_state("output/state_groups.txt"));
+    CHECK(emulator1.num_breakpoints() == 4);
+    CHECK(not emulator1.is_group_enabled("LOOP"));
+    CHECK(emulator1.is_group_enabled("END"));
+    CHECK_THAT(emulator1.find_breakpoint("PTR")->get_group(), Catch::Matchers::Equals("LOOP"));
+    CHECK_THAT(emulator1.find_breakpoint("PTR")->get_condition(), Catch::Matchers::Equals("acc > 1"));
+    CHECK_THAT(emulator1.find_breakpoint("LOOPEND")->get_group(), Catch::Matchers::Equals("END"));
+
+    REQUIRE(emulator1.run(1000));
+    CHECK(emulator1.read_pc() == 18);
+    remove("output/state_groups.txt");
+  }
+}
+
+TEST_CASE("Watchpoints", "[emulator][watchpoint][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("Insert, find and delete") {
+    CHECK(emulator.num_watchpoints() == 0);
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_WRITE));
+    REQUIRE(emulator.insert_watchpoint(3, "PTR", WATCH_CHANGE));
+    CHECK(not emulator.insert_watchpoint(63, "OTHER", WATCH_WRITE));
+    CHECK(not emulator.insert_watchpoint(10, "SUM", WATCH_WRITE));
+    CHECK(emulator.num_watchpoints() == 2);
+
+    REQUIRE(emulator.find_watchpoint("PTR") != nullptr);
+    CHECK(emulator.find_watchpoint("PTR")->get_address() == 3);
+    CHECK(emulator.find_watchpoint("PTR")->get_kind() == WATCH_CHANGE);
+    CHECK(emulator.find_watchpoint(63) == emulator.find_watchpoint("SUM"));
+    CHECK(emulator.find_watchpoint(64) == nullptr);
+
+    CHECK(emulator.delete_watchpoint("SUM"));
+    CHECK(not emulator.delete_watchpoint(63));
+    CHECK(emulator.delete_watchpoint(3));
+    CHECK(emulator.num_watchpoints() == 0);
+
+    // Nothing is watched anymore
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.stop_reason() == STOP_STEPS);
+  }
+
+  SECTION("Stop on every write") {
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_WRITE));
+    RunResult result = emulator.run_detailed(CYCLES_UNBOUNDED);
+    CHECK(result.reason == STOP_WATCHPOINT);
+    CHECK(result.watchpoint == 63);
+    CHECK(result.breakpoint == -1);
+    // The store has executed: we stop right after STR [63]
+    CHECK(emulator.read_pc() == 6);
+    CHECK(emulator.read_mem(63) == 1);
+
+    // The loop runs 32 times, with one STR [63] each time
+    int stops = 1;
+    while (emulator.run_detailed(1000).reason == STOP_WATCHPOINT)
+      ++stops;
+    CHECK(stops == 32);
+  }
+
+  SECTION("Stop only on writes that change the value") {
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_CHANGE));
+    int stops = 0;
+    int previous = emulator.read_mem(63);
+    while (emulator.run(1000) && emulator.stop_reason() == STOP_WATCHPOINT) {
+      CHECK(emulator.read_mem(63) != previous);
+      previous = emulator.read_mem(63);
+      ++stops;
+    }
+    // The last 8 numbers added are zeroes
+    CHECK(stops == 24);
+    CHECK(emulator.read_mem(63) == 48);
+  }
+
+  SECTION("step() reports watchpoints") {
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_WRITE));
+    StepEvent event = emulator.step();
+    event = emulator.step();
+    CHECK(event.reason == STOP_STEPS);
+    event = emulator.step();
+    CHECK(event.reason == STOP_WATCHPOINT);
+    CHECK(event.store_address == 63);
+  }
+
+  SECTION("Watchpoints survive save_state/load_state") {
+    REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_WRITE));
+    REQUIRE(emulator.insert_watchpoint(3, "PTR", WATCH_CHANGE));
+    REQUIRE(emulator.save_state("output/state_watchpoints.txt"));
+
+    Emulator emulator1;
+    REQUIRE(emulator1.load_state("output/state_watchpoints.txt"));
+    CHECK(emulator1.num_breakpoints() == 1);
+    CHECK(emulator1.num_watchpoints() == 2);
+    REQUIRE(emulator1.find_watchpoint("PTR") != nullptr);
+    CHECK(emulator1.find_watchpoint("PTR")->get_kind() == WATCH_CHANGE);
+    CHECK(emulator1.find_watchpoint(63)->get_kind() == WATCH_WRITE);
+
+    // Loading a state replaces the watchpoints
+    REQUIRE(emulator1.load_state("data/state2.txt"));
+    CHECK(emulator1.num_watchpoints() == 0);
+    remove("output/state_watchpoints.txt");
+  }
+}
+
+TEST_CASE("Instruction Breakpoints", "[emulator][breakpoint][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("Opcode breakpoints stop after every matching instruction") {
+    REQUIRE(emulator.break_on_opcode(STR));
+    CHECK(emulator.has_opcode_break(STR));
+    CHECK(!emulator.has_opcode_break(JNE));
+
+    // STRs at 4, 10 and 16
+    RunResult result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_OPCODE);
+    CHECK(emulator.read_pc() == 6);
+    CHECK(emulator.run(1000));
+    CHECK(emulator.stop_reason() == STOP_OPCODE);
+    CHECK(emulator.read_pc() == 12);
+    CHECK(emulator.step().reason == STOP_STEPS);
+
+    REQUIRE(emulator.clear_opcode_break(STR));
+    CHECK(!emulator.clear_opcode_break(STR));
+    CHECK(emulator.run_detailed(1000).reason == STOP_STEPS);
+  }
+
+  SECTION("Value breakpoints stop when an instruction writes the value") {
+    // Find the first value written to acc by stepping a copy
+    Emulator reference = emulator;
+    StepEvent event;
+    do {
+      event = reference.step();
+    } while (event.opcode == STR || event.opcode == JMP || event.opcode == JNE);
+
+    REQUIRE(emulator.break_on_acc(event.acc));
+    CHECK(emulator.has_acc_break(event.acc));
+    RunResult result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_ACC);
+    CHECK(emulator.read_acc() == event.acc);
+    CHECK(emulator.cycles() == reference.cycles());
+
+    REQUIRE(emulator.clear_acc_break(event.acc));
+    CHECK(!emulator.has_acc_break(event.acc));
+  }
+
+  SECTION("Invalid opcodes and values are rejected") {
+    CHECK(!emulator.break_on_opcode(NUM_OPCODES));
+    CHECK(!emulator.break_on_acc(-1));
+    CHECK(!emulator.break_on_acc(ARCH_MAXVAL + 1));
+    CHECK(!emulator.clear_acc_break(7));
+    CHECK(emulator.run_detailed(1000).reason == STOP_STEPS);
+  }
+
+  SECTION("Watchpoints take precedence over opcode breakpoints") {
+    REQUIRE(emulator.insert_watchpoint(63, "SUM", WATCH_WRITE));
+    REQUIRE(emulator.break_on_opcode(STR));
+    RunResult result = emulator.run_detailed(1000);
+    CHECK(result.reason == STOP_WATCHPOINT);
+    CHECK(result.watchpoint == 63);
+  }
+
+  SECTION("Instruction breakpoints survive save_state/load_state") {
+    REQUIRE(emulator.break_on_opcode(JNE));
+    REQUIRE(emulator.break_on_opcode(LDR));
+    REQUIRE(emulator.break_on_acc(42));
+    REQUIRE(emulator.save_state("output/state_instr_breaks.txt"));
+
+    Emulator loaded;
+    REQUIRE(loaded.load_state("output/state_instr_breaks.txt"));
+    CHECK(loaded.has_opcode_break(JNE));
+    CHECK(loaded.has_opcode_break(LDR));
+    CHECK(!loaded.has_opcode_break(STR));
+    CHECK(loaded.has_acc_break(42));
+    CHECK(!loaded.has_acc_break(41));
+
+    // Loading another state clears them
+    REQUIRE(loaded.load_state("data/state2.txt"));
+    CHECK(!loaded.has_opcode_break(JNE));
+    CHECK(!loaded.has_acc_break(42));
+    remove("output/state_instr_breaks.txt");
+  }
+}
+
+TEST_CASE("Breakpoints updated while running", "[emulator][breakpoint][exec]") {
+  REQUIRE(fopen("data/state_large_cycles.txt", "r") != NULL);
+
+  // JMP 0 forever
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state_large_cycles.txt"));
+  REQUIRE(emulator.delete_breakpoint("LOOP"));
+
+  SECTION("A running thread picks up a new breakpoint") {
+    RunResult result;
+    std::thread worker([&]() {
+      result = emulator.run_detailed(CYCLES_UNBOUNDED, std::chrono::seconds(10));
+    });
+
+    // Wait until the worker is in the loop, then attach
+    while (emulator.active_breakpoints_version() != emulator.breakpoints_version())
+      std::this_thread::yield();
+    REQUIRE(emulator.insert_breakpoint(0, "LOOP"));
+    worker.join();
+
+    CHECK(result.reason == STOP_BREAKPOINT);
+    CHECK(result.breakpoint == 0);
+    CHECK(emulator.active_breakpoints_version() == emulator.breakpoints_version());
+  }
+
+  SECTION("Updates don't disturb a running thread") {
+    RunResult result;
+    std::thread worker([&]() {
+      result = emulator.run_detailed(CYCLES_UNBOUNDED, std::chrono::milliseconds(200));
+    });
+
+    // Address 2 is never reached, so none of these stop the worker
+    uint64_t before = emulator.breakpoints_version();
+    for (int i = 0; i < 1000; ++i) {
+      REQUIRE(emulator.insert_breakpoint(2, "NEVER"));
+      REQUIRE(emulator.set_breakpoint_condition("NEVER", "acc == 7"));
+      REQUIRE(emulator.set_breakpoint_group("NEVER", "G"));
+      REQUIRE(emulator.disable_group("G"));
+      REQUIRE(emulator.delete_breakpoint("NEVER"));
+    }
+    worker.join();
+
+    CHECK(result.reason == STOP_DEADLINE);
+    CHECK(emulator.breakpoints_version() > before);
+    CHECK(emulator.read_pc() == 0);
+  }
+}
+
+TEST_CASE("Bulk memory access", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("Ranges match read_mem()") {
+    byte_t bytes[32];
+    REQUIRE(emulator.read_mem_range(64, bytes));
+    for (int i = 0; i < 32; ++i)
+      CHECK(bytes[i] == emulator.read_mem(64 + i));
+
+    std::span<const byte_t, MEMORY_SIZE> view = emulator.memory();
+    for (int i = 0; i < MEMORY_SIZE; ++i)
+      CHECK(view[i] == emulator.read_mem(i));
+  }
+
+  SECTION("Ranges wrap around") {
+    const byte_t written[4] = {1, 2, 3, 4};
+    REQUIRE(emulator.write_mem_range(254, written));
+    CHECK(emulator.read_mem(254) == 1);
+    CHECK(emulator.read_mem(255) == 2);
+    CHECK(emulator.read_mem(0) == 3);
+    CHECK(emulator.read_mem(1) == 4);
+
+    // Addresses are limited to 8 bits, like read_mem()
+    byte_t bytes[4];
+    REQUIRE(emulator.read_mem_range(254 + MEMORY_SIZE, bytes));
+    for (int i = 0; i < 4; ++i)
+      CHECK(bytes[i] == written[i]);
+  }
+
+  SECTION("Ranges can't be larger than the memory") {
+    byte_t bytes[MEMORY_SIZE + 1] = {};
+    CHECK(!emulator.read_mem_range(0, bytes));
+    CHECK(!emulator.write_mem_range(0, bytes));
+    CHECK(!emulator.load_image(bytes));
+    CHECK(emulator.read_mem_range(0, std::span<byte_t>(bytes, MEMORY_SIZE)));
+  }
+
+  SECTION("load_image() matches load_state()") {
+    byte_t image[MEMORY_SIZE];
+    REQUIRE(emulator.read_mem_range(0, image));
+    REQUIRE(emulator.insert_breakpoint(18, "LOOPEND"));
+
+    Emulator loaded;
+    REQUIRE(loaded.insert_breakpoint(18, "LOOPEND"));
+    REQUIRE(loaded.load_image(image));
+    CHECK(loaded.cycles() == 0);
+    CHECK(loaded.num_breakpoints() == 1);
+
+    // Same program, same breakpoints, so the same run
+    REQUIRE(loaded.run(1000));
+    REQUIRE(emulator.run(1000));
+    CHECK(loaded.read_pc() == emulator.read_pc());
+    CHECK(loaded.read_acc() == emulator.read_acc());
+    CHECK(loaded.cycles() == emulator.cycles() - 5);
+
+    // A short image clears the rest of the memory
+    const byte_t program[2] = {JMP, 0};
+    REQUIRE(loaded.load_image(program));
+    CHECK(loaded.read_mem(0) == JMP);
+    CHECK(loaded.read_mem(63) == 0);
+    CHECK(loaded.read_pc() == 0);
+  }
+}
+
+TEST_CASE("State comparison and hashing", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  Emulator copy = emulator;
+
+  SECTION("Copies are equal") {
+    CHECK(emulator == copy);
+    CHECK(emulator.read_state() == copy.read_state());
+    CHECK(emulator.hash() == copy.hash());
+    CHECK(diff(emulator, copy).empty());
+
+    // The cycle count and the breakpoints don't matter
+    REQUIRE(copy.insert_breakpoint(18, "LOOPEND"));
+    REQUIRE(copy.run(0));
+    CHECK(emulator == copy);
+  }
+
+  SECTION("diff() finds the bytes that changed") {
+    const byte_t changed[1] = {99};
+    REQUIRE(copy.write_mem_range(3, changed));
+    REQUIRE(copy.write_mem_range(200, changed));
+
+    CHECK(emulator != copy);
+    StateDiff changes = diff(emulator, copy);
+    CHECK(changes.num_changed() == 2);
+    CHECK(changes.memory[0] == (uint64_t)1 << 3);
+    CHECK(changes.memory[3] == (uint64_t)1 << (200 % 64));
+    CHECK(!changes.acc);
+    CHECK(!changes.pc);
+    CHECK(!changes.empty());
+
+    // Up to the JNE, where acc holds the loop counter
+    REQUIRE(copy.run(9));
+    REQUIRE(copy.read_acc() != emulator.read_acc());
+    changes = diff(emulator, copy);
+    CHECK(changes.acc);
+    CHECK(changes.pc);
+  }
+
+  SECTION("Every byte and register affects the hash") {
+    std::unordered_set<uint64_t> hashes;
+    ProcessorState state = emulator.read_state();
+    hashes.insert(hash_state(state));
+
+    for (int offset = 0; offset < MEMORY_SIZE; ++offset) {
+      ProcessorState changed = state;
+      changed.memory[offset] ^= 1;
+      hashes.insert(hash_state(changed));
+    }
+    state.acc ^= 1;
+    hashes.insert(hash_state(state));
+    state.pc ^= 2;
+    hashes.insert(hash_state(state));
+
+    CHECK(hashes.size() == MEMORY_SIZE + 3);
+  }
+
+  SECTION("Emulators key unordered containers") {
+    std::unordered_set<Emulator> seen;
+    seen.insert(emulator);
+    seen.insert(copy);
+    CHECK(seen.size() == 1);
+
+    // The loop ends in JMP 20 forever, so the end states repeat
+    REQUIRE(copy.run(1000));
+    seen.insert(copy);
+    REQUIRE(copy.run(1));
+    seen.insert(copy);
+    CHECK(seen.size() == 2);
+    CHECK(std::hash<ProcessorState>()(copy.read_state()) == copy.hash());
+  }
+}
+
+TEST_CASE("Incremental state fingerprint", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("STR keeps the hash up to date") {
+    // Every cycle, the incremental hash matches one computed from scratch
+    int mismatches = 0;
+    for (int i = 0; i < 400; ++i) {
+      REQUIRE(emulator.step().reason == STOP_STEPS);
+      ProcessorState rehashed = emulator.read_state();
+      rehashed.rehash();
+      mismatches += rehashed.memory_hash != emulator.read_state().memory_hash;
+    }
+    CHECK(mismatches == 0);
+  }
+
+  SECTION("Equal states have equal fingerprints") {
+    ProcessorState fresh;
+    CHECK(fresh.memory_hash == ProcessorState().memory_hash);
+    fresh.rehash();
+    CHECK(fresh.memory_hash == ProcessorState().memory_hash);
+
+    // Writing a byte and then restoring it restores the fingerprint
+    uint64_t before = emulator.fingerprint();
+    const byte_t changed[2] = {1, 2};
+    const byte_t original[2] = {(byte_t)emulator.read_mem(255), (byte_t)emulator.read_mem(0)};
+    REQUIRE(emulator.write_mem_range(255, changed));
+    CHECK(emulator.fingerprint() != before);
+    REQUIRE(emulator.write_mem_range(255, original));
+    CHECK(emulator.fingerprint() == before);
+  }
+
+  SECTION("The fingerprint finds the final loop") {
+    // The program ends with JMP 20 forever: the first repeated fingerprint
+    std::unordered_set<uint64_t> seen;
+    while (seen.insert(emulator.fingerprint()).second)
+      REQUIRE(emulator.step().reason == STOP_STEPS);
+    CHECK(emulator.read_pc() == 20);
+    CHECK(emulator.read_mem(63) == 48);
+  }
+}
+
 TEST_CASE("Emulator state helpers", "[emulator][exec]") {
   REQUIRE(fopen("data/state2.txt", "r") != NULL);
 
@@ -2488,7 +3612,7 @@ TEST_CASE("Emulator state helpers", "[emulator][exec]") {
     REQUIRE(emulator.run(1000));
     REQUIRE(emulator.read_pc() == 18);
     REQUIRE(emulator.read_acc() == 30 - i);
-    REQUIRE(emulator.cycles() == 24 + 10 * i);
+    REQUIRE(emulator.cycles() == (uint64_t)(24 + 10 * i));
     CHECK(not emulator.is_zero());
     CHECK(emulator.is_breakpoint());
   }
@@ -2646,6 +3770,799 @@ TEST_CASE("Program Print", "[emulator][exec]") {
   }
 }
 
+TEST_CASE("Execution Profile", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("Profiling is off by default") {
+    CHECK(emulator.get_profile() == nullptr);
+    CHECK(!emulator.print_profile());
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.get_profile() == nullptr);
+  }
+
+  SECTION("Counts per instruction and per JNE direction") {
+    emulator.set_profiling(1);
+    REQUIRE(emulator.run(1000));
+
+    // 32 iterations of the 10 instructions of the loop, then JMP 20 forever
+    const ExecutionProfile* profile = emulator.get_profile();
+    REQUIRE(profile != nullptr);
+    for (int slot = 0; slot < 10; ++slot)
+      CHECK(profile->executions[slot] == 32);
+    CHECK(profile->taken[9] == 31);
+    CHECK(profile->not_taken[9] == 1);
+    CHECK(profile->executions[10] == 1000 - 320);
+    CHECK(profile->total() == 1000);
+
+    // Steps count too, and the counts survive disabling
+    emulator.step();
+    emulator.set_profiling(0);
+    REQUIRE(emulator.run(10));
+    CHECK(profile->executions[10] == 1000 - 320 + 1);
+
+    emulator.reset_profile();
+    CHECK(profile->total() == 0);
+  }
+
+  SECTION("The report annotates print_program()") {
+    emulator.set_profiling(1);
+    REQUIRE(emulator.run(1000));
+
+    int original_stdout = capture_stdout("output/print_profile2.txt");
+    REQUIRE(original_stdout >= 0);
+    lseek(STDOUT_FILENO, 0, SEEK_SET);
+    int printed = emulator.print_profile();
+    fflush(stdout);
+    close(STDOUT_FILENO);
+    dup2(original_stdout, STDOUT_FILENO);
+    CHECK(printed);
+
+    FILE* fp = fopen("output/print_profile2.txt", "r");
+    REQUIRE(fp != NULL);
+    char line[MAX_LINE];
+    std::vector<std::string> lines;
+    while (fgets(line, MAX_LINE, fp) != NULL)
+      lines.push_back(line);
+    fclose(fp);
+    remove("output/print_profile2.txt");
+
+    REQUIRE(lines.size() == MAX_INSTRUCTIONS);
+    CHECK(lines[9] == "18:\t7\t0\t:\tJNE: PC  <- 0 if ACC != 0\t; 32 (3.20%) taken 31 not taken 1\n");
+    CHECK(lines[10] == "20:\t6\t20\t:\tJMP: PC  <- 20\t; 680 (68.00%)\n");
+    CHECK(lines[11] == "22:\t0\t0\n");
+  }
+}
+
+TEST_CASE("Instruction Timing", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+
+  SECTION("Timing is off by default") {
+    CHECK(emulator.get_timing() == nullptr);
+    CHECK(!emulator.print_timing());
+    REQUIRE(emulator.run(1000));
+    CHECK(emulator.get_timing() == nullptr);
+  }
+
+  SECTION("Times per opcode, from every way of running") {
+    emulator.set_timing(1);
+    REQUIRE(emulator.run(1000));
+
+    // 32 iterations of LDR, ADD, STR three times and JNE, then JMP 20 forever
+    const OpcodeTiming* timing = emulator.get_timing();
+    REQUIRE(timing != nullptr);
+    CHECK(timing->count[LDR] == 96);
+    CHECK(timing->count[ADD] == 96);
+    CHECK(timing->count[STR] == 96);
+    CHECK(timing->count[JNE] == 32);
+    CHECK(timing->count[JMP] == 1000 - 320);
+    CHECK(timing->count[AND] == 0);
+    CHECK(timing->average(timing->decode, AND) == 0);
+
+    // The clock only goes forwards
+    CHECK(timing->decode[JMP] + timing->execute[JMP] + timing->breakpoint_check[JMP] > 0);
+    CHECK(timing->average(timing->execute, JMP) >= 0);
+
+    emulator.step();
+    CHECK(timing->count[JMP] == 1000 - 320 + 1);
+
+    RunResult result;
+    emulator.run_many(std::span<Emulator>(&emulator, 1), 10, &result);
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(timing->count[JMP] == 1000 - 320 + 11);
+
+    // The times survive disabling, until they're reset
+    emulator.set_timing(0);
+    REQUIRE(emulator.run(10));
+    CHECK(timing->count[JMP] == 1000 - 320 + 11);
+
+    emulator.reset_timing();
+    CHECK(timing->count[JMP] == 0);
+    CHECK(timing->execute[JMP] == 0);
+  }
+
+  SECTION("Copies keep their own times") {
+    emulator.set_timing(1);
+    REQUIRE(emulator.run(1000));
+    Emulator copy(emulator);
+    REQUIRE(copy.run(100));
+    CHECK(emulator.get_timing()->count[JMP] + 100 == copy.get_timing()->count[JMP]);
+  }
+}
+
+TEST_CASE("Hardware Counters", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  // Counters are often unavailable (containers, VMs, other OSes), so only
+  // check what was counted, and that the runs themselves are unaffected
+  CounterSession session;
+  CounterReading reading;
+
+  SECTION("run()") {
+    Emulator emulator;
+    REQUIRE(emulator.load_state("data/state2.txt"));
+    RunResult result = session.run(emulator, 1000, reading);
+    CHECK(result.reason == STOP_STEPS);
+    CHECK(result.cycles == 1000);
+    CHECK(reading.emulated == 1000);
+    CHECK(emulator.read_mem(63) == 48);
+
+    for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter) {
+      CHECK(reading.available[counter] == session.is_available((PerfCounter)counter));
+      if (!reading.available[counter])
+        CHECK(reading.per_instruction((PerfCounter)counter) == 0);
+    }
+
+    // Emulating an instruction takes more than one host instruction
+    if (reading.available[PERF_INSTRUCTIONS])
+      CHECK(reading.per_instruction(PERF_INSTRUCTIONS) > 1);
+  }
+
+  SECTION("run_many()") {
+    std::vector<Emulator> emulators(3);
+    for (Emulator& emulator : emulators)
+      REQUIRE(emulator.load_state("data/state2.txt"));
+
+    std::vector<RunResult> results(emulators.size());
+    session.run_many(emulators, 500, results.data(), reading);
+    CHECK(reading.emulated == 1500);
+    for (const RunResult& result : results)
+      CHECK(result.cycles == 500);
+
+    for (int counter = 0; counter < NUM_PERF_COUNTERS; ++counter)
+      CHECK(reading.available[counter] == session.is_available((PerfCounter)counter));
+  }
+}
+
+TEST_CASE("Execution Traces", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  Emulator reference(emulator);
+
+  SECTION("One record per executed instruction") {
+    TraceRecorder recorder;
+    REQUIRE(recorder.start("output/trace2.bin"));
+    CHECK(recorder.is_recording());
+    CHECK(!recorder.start("output/trace2.bin"));
+
+    emulator.set_trace(&recorder);
+    REQUIRE(emulator.run(1000));
+    emulator.step();
+    REQUIRE(recorder.stop());
+    CHECK(!recorder.is_recording());
+    CHECK(!recorder.stop());
+
+    // The default ring is much larger than the run, so nothing is dropped
+    CHECK(recorder.recorded() == 1001);
+    CHECK(recorder.dropped() == 0);
+
+    std::vector<TraceRecord> records;
+    REQUIRE(read_trace("output/trace2.bin", records));
+    remove("output/trace2.bin");
+    REQUIRE(records.size() == 1001);
+
+    // Step through the same program and compare
+    for (const TraceRecord& record : records) {
+      StepEvent event = reference.step();
+      CHECK(record.cycle == reference.cycles());
+      CHECK(record.pc == event.pc);
+      CHECK(record.opcode == event.opcode);
+      CHECK(record.operand == event.operand);
+      CHECK(record.acc == event.acc);
+      if (event.store_address != -1) {
+        CHECK(record.flags == TRACE_STORE);
+        CHECK(record.store_address == event.store_address);
+        CHECK(record.store_value == reference.read_mem(event.store_address));
+      } else {
+        CHECK(record.flags == 0);
+      }
+    }
+    CHECK(records[0].cycle == 6);
+    CHECK(records[1000].opcode == JMP);
+  }
+
+  SECTION("A full ring drops records instead of blocking") {
+    TraceRecorder recorder(16);
+    REQUIRE(recorder.start("output/trace2.bin"));
+    emulator.set_trace(&recorder);
+    REQUIRE(emulator.run(100000));
+    REQUIRE(recorder.stop());
+    CHECK(recorder.recorded() + recorder.dropped() == 100000);
+
+    std::vector<TraceRecord> records;
+    REQUIRE(read_trace("output/trace2.bin", records));
+    remove("output/trace2.bin");
+    CHECK(records.size() == recorder.recorded());
+
+    // Cycles only go forwards, with gaps where records were dropped
+    for (size_t i = 1; i < records.size(); ++i)
+      CHECK(records[i].cycle > records[i - 1].cycle);
+  }
+
+  SECTION("Nothing is recorded while the recorder is stopped") {
+    TraceRecorder recorder;
+    emulator.set_trace(&recorder);
+    REQUIRE(emulator.run(50));
+    REQUIRE(recorder.start("output/trace2.bin"));
+    REQUIRE(emulator.run(10));
+    REQUIRE(recorder.stop());
+    REQUIRE(emulator.run(20));
+    CHECK(recorder.recorded() == 10);
+
+    // A second trace only has its own records, not the ones made in between
+    REQUIRE(recorder.start("output/trace2.bin"));
+    REQUIRE(emulator.run(5));
+    REQUIRE(recorder.stop());
+    CHECK(recorder.recorded() == 5);
+    CHECK(recorder.dropped() == 0);
+
+    std::vector<TraceRecord> records;
+    REQUIRE(read_trace("output/trace2.bin", records));
+    remove("output/trace2.bin");
+    REQUIRE(records.size() == 5);
+    CHECK(records[0].cycle == 5 + 50 + 10 + 20 + 1);
+    CHECK(records[4].cycle == emulator.cycles());
+  }
+
+  SECTION("Copies and detached emulators don't record") {
+    TraceRecorder recorder;
+    REQUIRE(recorder.start("output/trace2.bin"));
+    emulator.set_trace(&recorder);
+    Emulator copy(emulator);
+    REQUIRE(copy.run(100));
+    emulator.set_trace(nullptr);
+    REQUIRE(emulator.run(100));
+    REQUIRE(recorder.stop());
+    CHECK(recorder.recorded() == 0);
+    remove("output/trace2.bin");
+  }
+
+  SECTION("Reading something that isn't a trace fails") {
+    std::vector<TraceRecord> records;
+    CHECK(!read_trace("data/state2.txt", records));
+    CHECK(!read_trace("data/does_not_exist.bin", records));
+  }
+}
+
+TEST_CASE("Compressed Traces", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  Emulator initial(emulator);
+
+  SECTION("Compression is lossless and replay matches emulation") {
+    // Big enough for the whole run, so that nothing is dropped
+    TraceRecorder recorder(1 << 18);
+    REQUIRE(recorder.start("output/trace2.bin"));
+    emulator.set_trace(&recorder);
+    REQUIRE(emulator.run(200000));
+    REQUIRE(recorder.stop());
+    REQUIRE(recorder.dropped() == 0);
+
+    REQUIRE(compress_trace("output/trace2.bin", initial.read_state(), initial.cycles(), "output/trace2.z"));
+
+    std::vector<TraceRecord> raw, decoded;
+    REQUIRE(read_trace("output/trace2.bin", raw));
+    REQUIRE(decompress_trace("output/trace2.z", decoded));
+    REQUIRE(decoded.size() == raw.size());
+    CHECK(memcmp(decoded.data(), raw.data(), raw.size() * sizeof(TraceRecord)) == 0);
+
+    // Without dropped records everything is predicted
+    auto file_size = [](const char* filename) {
+      FILE* fp = fopen(filename, "rb");
+      REQUIRE(fp != NULL);
+      fseek(fp, 0, SEEK_END);
+      long size = ftell(fp);
+      fclose(fp);
+      return size;
+    };
+    CHECK(file_size("output/trace2.z") * 100 < file_size("output/trace2.bin"));
+
+    TraceReplay replay;
+    REQUIRE(replay.open("output/trace2.z"));
+    CHECK(replay.num_records() == 200000);
+    CHECK(replay.first_cycle() == 5);
+    CHECK(replay.last_cycle() == 200005);
+    CHECK(replay.keyframes().size() == 4);
+    CHECK(replay.first_gap() == UINT64_MAX);
+
+    ProcessorState state;
+    uint64_t state_cycles;
+    CHECK(!replay.state_at(4, state, state_cycles));
+
+    Emulator reference(initial);
+    for (uint64_t cycle : {5, 6, 14, 15, 325, 65541, 65542, 131077, 200005, 300000}) {
+      while (reference.cycles() < cycle && reference.cycles() < 200005)
+        reference.step();
+      REQUIRE(replay.state_at(cycle, state, state_cycles));
+      CHECK(state_cycles == reference.cycles());
+      CHECK(state == reference.read_state());
+      CHECK(state.fingerprint() == reference.fingerprint());
+    }
+
+    std::vector<TraceRecord> some;
+    REQUIRE(replay.read_records(65530, 20, some));
+    CHECK(memcmp(some.data(), &raw[65530], 20 * sizeof(TraceRecord)) == 0);
+    CHECK(!replay.read_records(199990, 20, some));
+
+    remove("output/trace2.bin");
+    remove("output/trace2.z");
+  }
+
+  SECTION("Dropped records are kept as they are") {
+    TraceRecorder recorder(16);
+    REQUIRE(recorder.start("output/trace2.bin"));
+    emulator.set_trace(&recorder);
+    REQUIRE(emulator.run(100000));
+    // Let the writer empty the ring, so that the next run's records come after a gap
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    REQUIRE(emulator.run(1000));
+    REQUIRE(recorder.stop());
+    REQUIRE(recorder.dropped() > 0);
+
+    REQUIRE(compress_trace("output/trace2.bin", initial.read_state(), initial.cycles(), "output/trace2.z"));
+    std::vector<TraceRecord> raw, decoded;
+    REQUIRE(read_trace("output/trace2.bin", raw));
+    REQUIRE(decompress_trace("output/trace2.z", decoded));
+    REQUIRE(decoded.size() == raw.size());
+    CHECK(memcmp(decoded.data(), raw.data(), raw.size() * sizeof(TraceRecord)) == 0);
+
+    // The first record whose cycle doesn't follow on from the one before
+    uint64_t gap = UINT64_MAX, before_gap = initial.cycles();
+    for (size_t i = 0; i < raw.size() && gap == UINT64_MAX; ++i) {
+      if (raw[i].cycle != before_gap + 1)
+        gap = raw[i].cycle;
+      else
+        before_gap = raw[i].cycle;
+    }
+    REQUIRE(gap != UINT64_MAX);
+
+    TraceReplay replay;
+    REQUIRE(replay.open("output/trace2.z"));
+    CHECK(replay.first_gap() == gap);
+
+    TraceIndex index;
+    REQUIRE(index.build(raw, initial.read_state(), initial.cycles()));
+    CHECK(index.first_gap() == gap);
+
+    // States up to the gap are exact, later ones are refused
+    Emulator reference(initial);
+    while (reference.cycles() < before_gap)
+      reference.step();
+    ProcessorState state;
+    uint64_t state_cycles;
+    REQUIRE(replay.state_at(before_gap, state, state_cycles));
+    CHECK(state_cycles == before_gap);
+    CHECK(state == reference.read_state());
+    REQUIRE(index.state_at(before_gap, state, state_cycles));
+    CHECK(state == reference.read_state());
+    CHECK(!replay.state_at(gap, state, state_cycles));
+    CHECK(!replay.state_at(replay.last_cycle(), state, state_cycles));
+    CHECK(!index.state_at(gap, state, state_cycles));
+    CHECK(index.value_at(63, gap) == -1);
+    TraceWrite write;
+    CHECK(index.last_writer(63, gap, write) == -1);
+
+    remove("output/trace2.bin");
+    remove("output/trace2.z");
+  }
+
+  SECTION("Files that aren't compressed traces are rejected") {
+    TraceReplay replay;
+    std::vector<TraceRecord> records;
+    CHECK(!replay.open("data/state2.txt"));
+    CHECK(!replay.open("data/does_not_exist.z"));
+    CHECK(!decompress_trace("data/state2.txt", records));
+    CHECK(!compress_trace("data/state2.txt", initial.read_state(), 0, "output/trace2.z"));
+  }
+}
+
+TEST_CASE("Trace Index", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  Emulator emulator;
+  REQUIRE(emulator.load_state("data/state2.txt"));
+  Emulator initial(emulator);
+
+  TraceRecorder recorder(1 << 16);
+  REQUIRE(recorder.start("output/trace2.bin"));
+  emulator.set_trace(&recorder);
+  REQUIRE(emulator.run(20000));
+  REQUIRE(recorder.stop());
+  REQUIRE(recorder.dropped() == 0);
+
+  std::vector<TraceRecord> records;
+  REQUIRE(read_trace("output/trace2.bin", records));
+  REQUIRE(compress_trace("output/trace2.bin", initial.read_state(), initial.cycles(), "output/trace2.z"));
+  remove("output/trace2.bin");
+
+  TraceIndex index;
+  SECTION("From raw records") {
+    REQUIRE(index.build(records, initial.read_state(), initial.cycles()));
+  }
+  SECTION("From a compressed trace") {
+    TraceReplay replay;
+    REQUIRE(replay.open("output/trace2.z"));
+    REQUIRE(index.build(replay));
+  }
+  remove("output/trace2.z");
+  REQUIRE(index.num_records() == 20000);
+  CHECK(index.first_gap() == UINT64_MAX);
+
+  // The loop stores to 63, 3 and 62, 32 times each
+  CHECK(index.writes(63).size() == 32);
+  CHECK(index.writes(3).size() == 32);
+  CHECK(index.writes(62).size() == 32);
+  CHECK(index.writes(64).empty());
+
+  TraceWrite write;
+  CHECK(index.last_writer(63, 7, write) == 0);
+  REQUIRE(index.last_writer(63, 8, write) == 1);
+  CHECK(write.cycle == 8);
+  CHECK(write.pc == 4);
+  CHECK(write.value == 1);
+  REQUIRE(index.last_writer(63, 20005, write) == 1);
+  CHECK(write.value == 48);
+  CHECK(index.value_at(63, 4) == -1);
+  CHECK(index.value_at(64, 20005) == initial.read_mem(64));
+
+  // Every query agrees with stepping through the program
+  Emulator reference(initial);
+  ProcessorState state;
+  uint64_t state_cycles;
+  CHECK(!index.state_at(4, state, state_cycles));
+  for (uint64_t cycle : {5, 9, 15, 100, 4101, 4102, 8197, 12000, 20005}) {
+    while (reference.cycles() < cycle)
+      reference.step();
+    REQUIRE(index.state_at(cycle, state, state_cycles));
+    CHECK(state_cycles == cycle);
+    CHECK(state == reference.read_state());
+    for (addr_t address : {3, 62, 63})
+      CHECK(index.value_at(address, cycle) == reference.read_mem(address));
+  }
+
+  // A rebuilt state can be resumed
+  REQUIRE(index.state_at(150, state, state_cycles));
+  Emulator resumed;
+  REQUIRE(resumed.restore(state, state_cycles));
+  CHECK(resumed.cycles() == 150);
+  CHECK(resumed.fingerprint() == state.fingerprint());
+  REQUIRE(resumed.run(1000));
+
+  Emulator straight(initial);
+  REQUIRE(straight.run(145 + 1000));
+  CHECK(resumed == straight);
+  CHECK(resumed.cycles() == straight.cycles());
+
+  state.acc = ARCH_MAXVAL + 1;
+  CHECK(!resumed.restore(state, 0));
+}
+
+TEST_CASE("Batch Jobs and Timeline Export", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+  REQUIRE(fopen("data/state_breakpoints.txt", "r") != NULL);
+
+  std::vector<EmulatorJob> jobs(4);
+  jobs[0].input = "data/state2.txt";
+  jobs[0].output = "output/job0.txt";
+  jobs[0].steps = 2 * JOB_RUN_CHUNK + 10;
+  jobs[1].input = "data/state_breakpoints.txt";
+  jobs[2].input = "data/does_not_exist.txt";
+  jobs[3].input = "data/state2.txt";
+  jobs[3].steps = 100;
+
+  // Run alone first, to know what each job does
+  Emulator expected;
+  REQUIRE(expected.load_state("data/state_breakpoints.txt"));
+  RunResult breakpoint_run = expected.run_detailed(CYCLES_UNBOUNDED);
+
+  SpanTrace spans;
+  JobOptions options;
+  options.threads = 2;
+  options.spans = &spans;
+  std::vector<JobResult> results(jobs.size());
+  CHECK(run_jobs(jobs, results, options) == 3);
+
+  CHECK(results[0].loaded);
+  CHECK(results[0].saved);
+  CHECK(results[0].reason == STOP_STEPS);
+  CHECK(results[0].cycles == 2 * JOB_RUN_CHUNK + 10);
+  Emulator saved;
+  REQUIRE(saved.load_state("output/job0.txt"));
+  CHECK(saved.cycles() == 5 + 2 * JOB_RUN_CHUNK + 10);
+  remove("output/job0.txt");
+
+  CHECK(results[1].reason == breakpoint_run.reason);
+  CHECK(results[1].cycles == breakpoint_run.cycles);
+  CHECK(results[1].breakpoint == breakpoint_run.breakpoint);
+  CHECK(!results[2].loaded);
+  CHECK(results[3].cycles == 100);
+
+  // Every phase of every job is on the timeline
+  std::map<std::string, int> counts;
+  for (const SpanEvent& event : spans.events())
+    ++counts[event.name];
+  CHECK(counts["queued"] == 4);
+  CHECK(counts["job"] == 4);
+  CHECK(counts["load_state"] == 4);
+  CHECK(counts["run"] == 3 + 1 + 1);
+  CHECK(counts["save_state"] == 1);
+  CHECK(counts["breakpoint"] == (breakpoint_run.reason == STOP_BREAKPOINT ? 1 : 0));
+
+  REQUIRE(spans.write("output/spans.json"));
+  FILE* fp = fopen("output/spans.json", "r");
+  REQUIRE(fp != NULL);
+  char line[MAX_LINE];
+  REQUIRE(fgets(line, MAX_LINE, fp) != NULL);
+  CHECK(std::string(line) == "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  int events = 0;
+  while (fgets(line, MAX_LINE, fp) != NULL)
+    if (strstr(line, "\"ph\":\"X\"") != NULL || strstr(line, "\"ph\":\"i\"") != NULL)
+      ++events;
+  fclose(fp);
+  CHECK(events == (int)spans.size());
+  remove("output/spans.json");
+}
+
+TEST_CASE("Latency Histograms", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+
+  SECTION("Buckets") {
+    // Small values are exact, larger ones are within 1/32 of their bucket's limit
+    for (uint64_t value = 0; value < HISTOGRAM_SUB_BUCKETS; ++value)
+      CHECK(LatencyHistogram::bucket_limit(LatencyHistogram::bucket(value)) == value);
+    for (uint64_t value : {(uint64_t)64, (uint64_t)100, (uint64_t)1000, (uint64_t)123456789, (uint64_t)1 << 40, UINT64_MAX}) {
+      int bucket = LatencyHistogram::bucket(value);
+      CHECK(bucket < HISTOGRAM_BUCKETS);
+      CHECK(LatencyHistogram::bucket_limit(bucket) >= value);
+      CHECK(LatencyHistogram::bucket_limit(bucket) - value <= value / 32);
+      CHECK(LatencyHistogram::bucket_limit(bucket - 1) < value);
+    }
+    CHECK(LatencyHistogram::bucket(UINT64_MAX) == HISTOGRAM_BUCKETS - 1);
+  }
+
+  SECTION("Percentiles") {
+    LatencyHistogram histogram;
+    CHECK(histogram.count() == 0);
+    CHECK(histogram.percentile(50) == 0);
+
+    for (uint64_t value = 1; value <= 1000; ++value)
+      histogram.record(value * 1000);
+    CHECK(histogram.count() == 1000);
+    CHECK(histogram.min() == 1000);
+    CHECK(histogram.max() == 1000000);
+    CHECK(histogram.mean() == 500500);
+    CHECK(histogram.percentile(50) >= 500000);
+    CHECK(histogram.percentile(50) <= 500000 + 500000 / 32);
+    CHECK(histogram.percentile(99) >= 990000);
+    CHECK(histogram.percentile(99) <= 990000 + 990000 / 32);
+    CHECK(histogram.percentile(99.9) >= 999000);
+    CHECK(histogram.percentile(100) == 1000000);
+
+    LatencyHistogram other;
+    other.record(std::chrono::milliseconds(5));
+    histogram.merge(other);
+    CHECK(histogram.count() == 1001);
+    CHECK(histogram.max() == 5000000);
+
+    histogram.reset();
+    CHECK(histogram.count() == 0);
+    CHECK(histogram.max() == 0);
+  }
+
+  SECTION("Emulator and jobs") {
+    LatencyStats stats;
+    Emulator emulator;
+    emulator.set_latency_stats(&stats);
+    REQUIRE(emulator.load_state("data/state2.txt"));
+    emulator.run(100);
+    emulator.run(100);
+    REQUIRE(emulator.save_state("output/latency.txt"));
+    remove("output/latency.txt");
+    CHECK(stats.load_state.count() == 1);
+    CHECK(stats.run.count() == 2);
+    CHECK(stats.save_state.count() == 1);
+    CHECK(stats.job.count() == 0);
+
+    // Copies share the stats
+    Emulator copy(emulator);
+    copy.run(10);
+    CHECK(stats.run.count() == 3);
+
+    // A batch is one call, however many slices and emulators it has
+    LatencyStats other;
+    std::vector<Emulator> batch(3, emulator);
+    batch[2].set_latency_stats(&other);
+    std::vector<RunResult> out(batch.size());
+    Emulator::run_many(batch, 10 * RUN_MANY_SLICE, out.data());
+    CHECK(stats.run.count() == 4);
+    CHECK(other.run.count() == 1);
+
+    stats.run.reset();
+    stats.load_state.reset();
+    stats.save_state.reset();
+    std::vector<EmulatorJob> jobs(3);
+    for (EmulatorJob& job : jobs) {
+      job.input = "data/state2.txt";
+      job.steps = JOB_RUN_CHUNK + 1;
+    }
+    std::vector<JobResult> results(jobs.size());
+    JobOptions options;
+    options.threads = 2;
+    options.latencies = &stats;
+    CHECK(run_jobs(jobs, results, options) == 3);
+    CHECK(stats.load_state.count() == 3);
+    CHECK(stats.run.count() == 6);
+    CHECK(stats.job.count() == 3);
+    CHECK(stats.job.min() >= stats.run.min());
+    CHECK(stats.print());
+  }
+}
+
+TEST_CASE("Metrics Exposition", "[emulator][exec]") {
+  REQUIRE(fopen("data/state2.txt", "r") != NULL);
+  REQUIRE(fopen("data/state_breakpoints.txt", "r") != NULL);
+
+  SECTION("Counters") {
+    MetricsSnapshot before = metrics_snapshot();
+    {
+      Emulator emulator;
+      REQUIRE(emulator.load_state("data/state2.txt"));
+      emulator.run(100);
+      emulator.step();
+      Emulator copy(emulator);
+      copy.run(10);
+    }
+    MetricsSnapshot after = metrics_snapshot();
+    CHECK(after.value[METRIC_INSTRUCTIONS] - before.value[METRIC_INSTRUCTIONS] == 111);
+    CHECK(metrics_rate(before, after) > 0);
+
+    // Threads that exit keep their counts
+    std::thread worker([]() {
+      Emulator emulator;
+      REQUIRE(emulator.load_state("data/state_breakpoints.txt"));
+      emulator.run_detailed(CYCLES_UNBOUNDED);
+    });
+    worker.join();
+    Emulator expected;
+    REQUIRE(expected.load_state("data/state_breakpoints.txt"));
+    RunResult run = expected.run_detailed(CYCLES_UNBOUNDED);
+    MetricsSnapshot joined = metrics_snapshot();
+    CHECK(joined.value[METRIC_INSTRUCTIONS] - after.value[METRIC_INSTRUCTIONS] == 2 * run.cycles);
+    CHECK(joined.value[METRIC_BREAKPOINT_HITS] - after.value[METRIC_BREAKPOINT_HITS] ==
+          (run.reason == STOP_BREAKPOINT ? 2u : 0u));
+
+    std::vector<EmulatorJob> jobs(3);
+    for (EmulatorJob& job : jobs) {
+      job.input = "data/state2.txt";
+      job.steps = 50;
+    }
+    jobs[2].input = "data/does_not_exist.txt";
+    std::vector<JobResult> results(jobs.size());
+    JobOptions options;
+    options.threads = 2;
+    run_jobs(jobs, results, options);
+    MetricsSnapshot done = metrics_snapshot();
+    CHECK(done.value[METRIC_JOBS_STARTED] - joined.value[METRIC_JOBS_STARTED] == 3);
+    CHECK(done.value[METRIC_JOBS_FINISHED] - joined.value[METRIC_JOBS_FINISHED] == 3);
+    CHECK(done.value[METRIC_INSTRUCTIONS] - joined.value[METRIC_INSTRUCTIONS] == 100);
+
+    std::string text = metrics_text(done, 1234.5);
+    CHECK(text.find("# TYPE emulator_instructions_total counter\n") != std::string::npos);
+    CHECK(text.find("emulator_cycles_per_second 1234.5\n") != std::string::npos);
+    CHECK(text.find("emulator_jobs_in_flight 0\n") != std::string::npos);
+  }
+
+  SECTION("File") {
+    MetricsExporter exporter;
+    REQUIRE(exporter.start("", "output/metrics.prom", std::chrono::milliseconds(10)));
+    CHECK(exporter.is_running());
+    CHECK(!exporter.start("", "output/metrics.prom"));
+    exporter.stop();
+    CHECK(!exporter.is_running());
+
+    FILE* fp = fopen("output/metrics.prom", "r");
+    REQUIRE(fp != NULL);
+    char line[MAX_LINE];
+    REQUIRE(fgets(line, MAX_LINE, fp) != NULL);
+    CHECK(std::string(line) == "# HELP emulator_instructions_total Instructions executed.\n");
+    fclose(fp);
+    remove("output/metrics.prom");
+    CHECK(fopen("output/metrics.prom.tmp", "r") == NULL);
+  }
+
+  SECTION("Scrapes don't reset the file's cycles/sec") {
+    MetricsExporter exporter;
+    REQUIRE(exporter.start("", "output/metrics.prom", std::chrono::hours(1)));
+
+    // The first write happens straight away, and measures from then on
+    FILE* fp;
+    while ((fp = fopen("output/metrics.prom", "r")) == NULL)
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    fclose(fp);
+
+    Emulator emulator;
+    REQUIRE(emulator.load_state("data/state2.txt"));
+    emulator.run(1000);
+    CHECK(exporter.scrape().find("emulator_cycles_per_second 0.0\n") == std::string::npos);
+    exporter.stop();
+
+    fp = fopen("output/metrics.prom", "r");
+    REQUIRE(fp != NULL);
+    char line[MAX_LINE];
+    double rate = 0;
+    while (fgets(line, MAX_LINE, fp) != NULL)
+      sscanf(line, "emulator_cycles_per_second %lf", &rate);
+    fclose(fp);
+    CHECK(rate > 0);
+    remove("output/metrics.prom");
+  }
+
+#ifndef _WIN32
+  SECTION("Socket") {
+    MetricsExporter exporter;
+    REQUIRE(exporter.start("output/metrics.sock", ""));
+
+    // Connect, optionally send a request, and read until the exporter closes the connection
+    auto fetch = [](const char* request) {
+      sockaddr_un address;
+      memset(&address, 0, sizeof(address));
+      address.sun_family = AF_UNIX;
+      strcpy(address.sun_path, "output/metrics.sock");
+      int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+      REQUIRE(fd >= 0);
+      REQUIRE(connect(fd, (sockaddr*)&address, sizeof(address)) == 0);
+      if (request != nullptr)
+        REQUIRE(write(fd, request, strlen(request)) == (ssize_t)strlen(request));
+      std::string response;
+      char buffer[4096];
+      ssize_t n;
+      while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        response.append(buffer, n);
+      close(fd);
+      return response;
+    };
+
+    std::string plain = fetch(nullptr);
+    CHECK(plain.rfind("# HELP emulator_instructions_total", 0) == 0);
+    std::string http = fetch("GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    CHECK(http.rfind("HTTP/1.0 200 OK\r\n", 0) == 0);
+    CHECK(http.find("\r\n\r\n# HELP emulator_instructions_total") != std::string::npos);
+
+    exporter.stop();
+    CHECK(fopen("output/metrics.sock", "r") == NULL);
+  }
+#endif
+}
+
 // We have indirectly tested load_state() multiple times,
 // so here we'll keep this short
 TEST_CASE("Load State: Correct cases", "[emulator][exec]") {
@@ -2712,6 +4629,28 @@ TEST_CASE("Load State: Correct cases", "[emulator][exec]") {
       CHECK_THAT(emulator.find_breakpoint(i*2 + 2)->get_name(), Catch::Matchers::Equals(names[i]));
     }
   }
+
+  SECTION("Blank lines between breakpoints are skipped") {
+    // state_breakpoints.txt with an empty or whitespace-only line after every breakpoint
+    FILE* in = fopen("data/state_breakpoints.txt", "r");
+    FILE* out = fopen("output/state_blank_lines.txt", "w");
+    REQUIRE(in != NULL);
+    REQUIRE(out != NULL);
+    char line[MAX_LINE];
+    for (int number = 1; fgets(line, MAX_LINE, in) != NULL; ++number) {
+      fputs(line, out);
+      if (number > 259)
+        fputs(number % 2 ? "\n" : " \t\n", out);
+    }
+    fclose(in);
+    fclose(out);
+
+    REQUIRE(emulator.load_state("output/state_blank_lines.txt"));
+    CHECK(emulator.num_breakpoints() == 19);
+    REQUIRE(emulator.find_breakpoint(30) != NULL);
+    CHECK_THAT(emulator.find_breakpoint(30)->get_name(), Catch::Matchers::Equals("O"));
+    remove("output/state_blank_lines.txt");
+  }
 }
 
 // Let's see wheter load_state() can handle errors in the input correctly
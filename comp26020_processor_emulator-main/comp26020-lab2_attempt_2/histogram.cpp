@@ -0,0 +1,140 @@
+#include <bit>
+#include <cinttypes>
+#include <cstdio>
+#include "histogram.h"
+
+// ============= LatencyHistogram ==============
+LatencyHistogram::LatencyHistogram() {
+  reset();
+}
+
+int LatencyHistogram::bucket(uint64_t value) {
+  if (value < HISTOGRAM_SUB_BUCKETS)
+    return (int)value;
+
+  // The top HISTOGRAM_SUB_BITS bits of the value pick the bucket within its power of two
+  const int exponent = std::bit_width(value) - 1;
+  const int shift = exponent - (HISTOGRAM_SUB_BITS - 1);
+  const int sub = (int)(value >> shift) - HISTOGRAM_SUB_BUCKETS / 2;
+  return HISTOGRAM_SUB_BUCKETS + (exponent - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_BUCKETS / 2) + sub;
+}
+
+uint64_t LatencyHistogram::bucket_limit(int bucket) {
+  if (bucket < HISTOGRAM_SUB_BUCKETS)
+    return bucket;
+
+  const int offset = bucket - HISTOGRAM_SUB_BUCKETS;
+  const int exponent = HISTOGRAM_SUB_BITS + offset / (HISTOGRAM_SUB_BUCKETS / 2);
+  const int shift = exponent - (HISTOGRAM_SUB_BITS - 1);
+  const uint64_t sub = HISTOGRAM_SUB_BUCKETS / 2 + offset % (HISTOGRAM_SUB_BUCKETS / 2);
+  // The last bucket ends at UINT64_MAX, where (sub + 1) << shift overflows to 0
+  return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value) {
+  _counts[bucket(value)].fetch_add(1, std::memory_order_relaxed);
+  _count.fetch_add(1, std::memory_order_relaxed);
+  _sum.fetch_add(value, std::memory_order_relaxed);
+
+  uint64_t low = _min.load(std::memory_order_relaxed);
+  while (value < low && !_min.compare_exchange_weak(low, value, std::memory_order_relaxed))
+    ;
+  uint64_t high = _max.load(std::memory_order_relaxed);
+  while (value > high && !_max.compare_exchange_weak(high, value, std::memory_order_relaxed))
+    ;
+}
+
+void LatencyHistogram::record(std::chrono::nanoseconds duration) {
+  record(duration.count() < 0 ? 0 : (uint64_t)duration.count());
+}
+
+uint64_t LatencyHistogram::count() const {
+  return _count.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::min() const {
+  return count() == 0 ? 0 : _min.load(std::memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const {
+  return _max.load(std::memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const {
+  uint64_t n = count();
+  return n == 0 ? 0 : (double)_sum.load(std::memory_order_relaxed) / n;
+}
+
+uint64_t LatencyHistogram::percentile(double percent) const {
+  uint64_t n = count();
+  if (n == 0)
+    return 0;
+
+  // The rank of the value we're after, from 1 to n
+  uint64_t rank = (uint64_t)(percent / 100.0 * n + 0.5);
+  if (rank < 1)
+    rank = 1;
+  if (rank > n)
+    rank = n;
+
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+    seen += _counts[b].load(std::memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t limit = bucket_limit(b);
+      return limit < max() ? limit : max();
+    }
+  }
+  return max();
+}
+
+void LatencyHistogram::reset() {
+  for (int b = 0; b < HISTOGRAM_BUCKETS; ++b)
+    _counts[b].store(0, std::memory_order_relaxed);
+  _count.store(0, std::memory_order_relaxed);
+  _sum.store(0, std::memory_order_relaxed);
+  _min.store(UINT64_MAX, std::memory_order_relaxed);
+  _max.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+  for (int b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+    uint64_t n = other._counts[b].load(std::memory_order_relaxed);
+    if (n != 0)
+      _counts[b].fetch_add(n, std::memory_order_relaxed);
+  }
+  _count.fetch_add(other.count(), std::memory_order_relaxed);
+  _sum.fetch_add(other._sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+  if (other.count() != 0) {
+    uint64_t low = _min.load(std::memory_order_relaxed);
+    while (other.min() < low && !_min.compare_exchange_weak(low, other.min(), std::memory_order_relaxed))
+      ;
+    uint64_t high = _max.load(std::memory_order_relaxed);
+    while (other.max() > high && !_max.compare_exchange_weak(high, other.max(), std::memory_order_relaxed))
+      ;
+  }
+}
+
+int LatencyHistogram::print(const char* name) const {
+  printf("%s\tcount %" PRIu64 "\tmin %" PRIu64 "\tmean %.0f\tp50 %" PRIu64 "\tp99 %" PRIu64 "\tp999 %" PRIu64
+         "\tmax %" PRIu64 "\n",
+         name, count(), min(), mean(), percentile(50), percentile(99), percentile(99.9), max());
+  return 1;
+}
+
+// ============= LatencyStats ==============
+LatencyStats::~LatencyStats() {
+  if (print_at_exit) {
+    print();
+    fflush(stdout);
+  }
+}
+
+int LatencyStats::print() const {
+  run.print("run");
+  load_state.print("load_state");
+  save_state.print("save_state");
+  job.print("job");
+  return 1;
+}
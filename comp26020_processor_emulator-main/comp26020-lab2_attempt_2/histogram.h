@@ -0,0 +1,163 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: histogram.h
+//
+// Latency histograms in the style of HdrHistogram: log-linear buckets, i.e.
+// every power of two is split into HISTOGRAM_SUB_BUCKETS / 2 equal buckets,
+// so every value is kept to within 1/32 of itself (about 3%), from
+// nanoseconds to centuries, in a fixed array. Recording is a couple of
+// relaxed atomic increments: no allocation, no locks, and any number of
+// threads can record into the same histogram.
+// -----------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Values below this are counted exactly; above it, each power of two has half this many buckets
+#define HISTOGRAM_SUB_BITS 6
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS + (64 - HISTOGRAM_SUB_BITS) * (HISTOGRAM_SUB_BUCKETS / 2))
+
+/**
+ * A log-linear histogram of 64-bit values, usually nanoseconds
+ */
+class LatencyHistogram {
+  public:
+    LatencyHistogram();
+
+    LatencyHistogram(const LatencyHistogram& other) = delete;
+    LatencyHistogram& operator=(const LatencyHistogram& other) = delete;
+
+    /**
+     * Count one value. Thread-safe and allocation-free.
+     */
+    void record(uint64_t value);
+
+    /**
+     * Count one duration, in nanoseconds
+     */
+    void record(std::chrono::nanoseconds duration);
+
+    /**
+     * @return How many values were recorded
+     */
+    uint64_t count() const;
+
+    /**
+     * @return The smallest and largest values recorded (exactly), or 0 if there are none
+     */
+    uint64_t min() const;
+    uint64_t max() const;
+
+    /**
+     * @return The average of the values recorded (exactly), or 0 if there are none
+     */
+    double mean() const;
+
+    /**
+     * The value below which the given percentage of the values fall
+     *
+     * @param percent From 0 to 100, e.g. 99.9 for p999
+     * @return The largest value the bucket of that value stands for (at most max()), or 0 if there are none
+     */
+    uint64_t percentile(double percent) const;
+
+    /**
+     * Forget everything recorded so far
+     *
+     * Values recorded by other threads at the same time may or may not be forgotten.
+     */
+    void reset();
+
+    /**
+     * Add the counts of another histogram to this one
+     */
+    void merge(const LatencyHistogram& other);
+
+    /**
+     * Prints on stdout one line with the count, min, mean, p50, p99, p999 and max
+     *
+     * @param name What the values are, at the start of the line
+     * @return 1 for success
+     */
+    int print(const char* name) const;
+
+    /**
+     * @return The bucket of a value
+     */
+    static int bucket(uint64_t value);
+
+    /**
+     * @return The largest value in a bucket
+     */
+    static uint64_t bucket_limit(int bucket);
+
+  private:
+    std::atomic<uint64_t> _counts[HISTOGRAM_BUCKETS];
+    std::atomic<uint64_t> _count;
+    std::atomic<uint64_t> _sum;
+    std::atomic<uint64_t> _min;
+    std::atomic<uint64_t> _max;
+};
+
+/**
+ * The latencies of the emulator's slow operations, and of whole jobs
+ *
+ * See Emulator::set_latency_stats() and JobOptions::latencies.
+ */
+struct LatencyStats {
+  /**
+   * run() and friends, per call (each run chunk of a job, each run_many() batch)
+   */
+  LatencyHistogram run;
+
+  /**
+   * load_state() and save_state(), per call
+   */
+  LatencyHistogram load_state;
+  LatencyHistogram save_state;
+
+  /**
+   * Jobs, from the start of the batch to the end of the job, queueing included
+   */
+  LatencyHistogram job;
+
+  /**
+   * Print the percentiles when the stats are destroyed, e.g. at exit for a static object
+   */
+  int print_at_exit = 0;
+
+  ~LatencyStats();
+
+  /**
+   * Prints on stdout one line per histogram (see LatencyHistogram::print()), in nanoseconds
+   *
+   * @return 1 for success
+   */
+  int print() const;
+};
+
+/**
+ * Records the time until the end of the scope into a histogram, if there is one
+ */
+class ScopedLatency {
+  public:
+    explicit ScopedLatency(LatencyHistogram* histogram)
+        : _histogram(histogram), _start(histogram != nullptr ? std::chrono::steady_clock::now()
+                                                             : std::chrono::steady_clock::time_point()) {
+    }
+
+    ~ScopedLatency() {
+      if (_histogram != nullptr)
+        _histogram->record(std::chrono::steady_clock::now() - _start);
+    }
+
+    ScopedLatency(const ScopedLatency& other) = delete;
+    ScopedLatency& operator=(const ScopedLatency& other) = delete;
+
+  private:
+    LatencyHistogram* _histogram;
+    std::chrono::steady_clock::time_point _start;
+};
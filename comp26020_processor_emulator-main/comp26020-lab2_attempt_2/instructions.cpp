@@ -87,6 +87,27 @@ InstructionBase* InstructionBase::generateInstruction(InstructionData data) {
   return NULL;
 }
 
+const InstructionBase* InstructionBase::lookupInstruction(InstructionData data) {
+  // One object per (opcode, address) pair, created once and never freed
+  // (static initialisation of a local is thread-safe)
+  static const InstructionBase* const* table = []() {
+    const InstructionBase** entries = new const InstructionBase*[NUM_OPCODES * MEMORY_SIZE];
+    for (int opcode = 0; opcode < NUM_OPCODES; ++opcode)
+      for (int address = 0; address < MEMORY_SIZE; ++address) {
+        InstructionData entry;
+        entry.opcode = opcode;
+        entry.address = address;
+        entries[opcode * MEMORY_SIZE + address] = generateInstruction(entry);
+      }
+    return entries;
+  }();
+
+  if (data.opcode >= NUM_OPCODES)
+    return NULL;
+
+  return table[data.opcode * MEMORY_SIZE + data.address];
+}
+
 // ========== ADD Instruction ==========
 Iadd::Iadd(addr_t address) {
   _set_address(address);
@@ -159,7 +180,10 @@ Istr::Istr(addr_t address) {
 }
 
 void Istr::_execute(ProcessorState& state) const {
+  // Swap the key of the old byte for the key of the new one in the hash
+  byte_t old_value = state.memory[get_address()];
   state.memory[get_address()] = state.acc;
+  state.memory_hash ^= zobrist_key(get_address(), old_value) ^ zobrist_key(get_address(), state.memory[get_address()]);
 }
 
 const std::string Istr::name() const {
@@ -0,0 +1,145 @@
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+#include "jobs.h"
+#include "metrics.h"
+
+const char* stop_reason_name(StopReason reason) {
+  switch (reason) {
+    case STOP_STEPS:
+      return "steps";
+    case STOP_BREAKPOINT:
+      return "breakpoint";
+    case STOP_ODD_PC:
+      return "odd pc";
+    case STOP_INVALID_OPCODE:
+      return "invalid opcode";
+    case STOP_CANCELLED:
+      return "cancelled";
+    case STOP_DEADLINE:
+      return "deadline";
+    case STOP_WATCHPOINT:
+      return "watchpoint";
+    case STOP_CYCLE:
+      return "cycle";
+    case STOP_OPCODE:
+      return "opcode";
+    case STOP_ACC:
+      return "acc";
+  }
+  return "unknown";
+}
+
+JobResult run_job(const EmulatorJob& job, int64_t index, const JobOptions& options) {
+  SpanTrace* spans = options.spans;
+  JobResult result;
+  result.loaded = 0;
+  result.saved = 0;
+  result.reason = STOP_STEPS;
+  result.cycles = 0;
+  result.breakpoint = -1;
+
+  SpanTrace::Clock::time_point job_start;
+  if (spans)
+    job_start = spans->now();
+  metrics_add(METRIC_JOBS_STARTED, 1);
+
+  Emulator emulator;
+  emulator.set_latency_stats(options.latencies);
+  SpanTrace::Clock::time_point start;
+  if (spans)
+    start = spans->now();
+  result.loaded = emulator.load_state(job.input);
+  if (spans)
+    spans->span("load_state", start, index, "loaded", result.loaded);
+
+  if (!result.loaded) {
+    if (spans)
+      spans->span("job", job_start, index, nullptr, 0, "load failed");
+    metrics_add(METRIC_JOBS_FINISHED, 1);
+    return result;
+  }
+
+  // Run in chunks, so that long jobs show their progress on the timeline
+  uint64_t remaining = job.steps;
+  while (remaining > 0) {
+    uint64_t chunk = remaining < JOB_RUN_CHUNK ? remaining : JOB_RUN_CHUNK;
+    if (spans)
+      start = spans->now();
+    RunResult run = emulator.run_detailed(chunk);
+    if (spans)
+      spans->span("run", start, index, "cycles", run.cycles, stop_reason_name(run.reason));
+
+    result.cycles += run.cycles;
+    result.reason = run.reason;
+    if (job.steps != CYCLES_UNBOUNDED)
+      remaining -= run.cycles;
+
+    if (run.reason != STOP_STEPS) {
+      if (run.reason == STOP_BREAKPOINT) {
+        result.breakpoint = run.breakpoint;
+        if (spans)
+          spans->instant("breakpoint", index, "address", run.breakpoint);
+      }
+      break;
+    }
+  }
+
+  result.saved = 1;
+  if (!job.output.empty()) {
+    if (spans)
+      start = spans->now();
+    result.saved = emulator.save_state(job.output);
+    if (spans)
+      spans->span("save_state", start, index, "saved", result.saved);
+  }
+
+  if (spans)
+    spans->span("job", job_start, index, "cycles", result.cycles, stop_reason_name(result.reason));
+  metrics_add(METRIC_JOBS_FINISHED, 1);
+  return result;
+}
+
+/**
+ * The body of a worker thread: take jobs until there are none left
+ */
+static void job_worker(std::span<const EmulatorJob> jobs, std::span<JobResult> results, const JobOptions& options,
+                       std::atomic<size_t>& next, SpanTrace::Clock::time_point queued, int worker) {
+  // Worker threads come and go with every batch, so give their counters back when they exit
+  metrics_register_thread();
+  if (options.spans)
+    options.spans->name_thread("worker " + std::to_string(worker));
+
+  for (size_t index = next.fetch_add(1); index < jobs.size(); index = next.fetch_add(1)) {
+    // Every job was queued when the batch started
+    if (options.spans)
+      options.spans->span("queued", queued, index);
+    results[index] = run_job(jobs[index], index, options);
+    if (options.latencies)
+      options.latencies->job.record(SpanTrace::Clock::now() - queued);
+  }
+}
+
+size_t run_jobs(std::span<const EmulatorJob> jobs, std::span<JobResult> results, const JobOptions& options) {
+  const SpanTrace::Clock::time_point queued = SpanTrace::Clock::now();
+  std::atomic<size_t> next(0);
+
+  if (options.threads <= 1) {
+    job_worker(jobs, results, options, next, queued, 0);
+  } else {
+    std::vector<std::thread> workers;
+    for (int worker = 0; worker < options.threads; ++worker)
+      workers.emplace_back(job_worker, jobs, results, std::cref(options), std::ref(next), queued, worker);
+    for (std::thread& worker : workers)
+      worker.join();
+  }
+
+  size_t succeeded = 0;
+  for (size_t index = 0; index < jobs.size(); ++index) {
+    const JobResult& result = results[index];
+    if (result.loaded && result.saved && result.reason != STOP_ODD_PC && result.reason != STOP_INVALID_OPCODE)
+      ++succeeded;
+  }
+  return succeeded;
+}
@@ -0,0 +1,117 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: jobs.h
+//
+// Batch execution: many independent jobs, each loading a state file, running
+// it, and saving the final state, spread over a number of worker threads.
+//
+// Jobs run in chunks of JOB_RUN_CHUNK cycles, and every phase (waiting in
+// the queue, load_state, each run chunk, save_state) can be recorded as a
+// span for the timeline exporter in spans.h, and timed into the latency
+// histograms in histogram.h.
+// -----------------------------------------------------------------------------
+
+#include <span>
+#include <string>
+#include "emulator.h"
+#include "histogram.h"
+#include "spans.h"
+
+// How many cycles a job runs between two spans
+#define JOB_RUN_CHUNK (1 << 20)
+
+/**
+ * What a job does
+ */
+struct EmulatorJob {
+  /**
+   * The state file to load
+   */
+  std::string input;
+
+  /**
+   * The state file to save the final state to, or empty to not save it
+   */
+  std::string output;
+
+  /**
+   * The maximum number of cycles to run
+   */
+  uint64_t steps = CYCLES_UNBOUNDED;
+};
+
+/**
+ * How a job went
+ */
+struct JobResult {
+  /**
+   * 1 if the input was loaded (otherwise nothing else happened)
+   */
+  int loaded;
+
+  /**
+   * 1 if there was no output, or it was saved
+   */
+  int saved;
+
+  /**
+   * Why the run stopped, and the cycles it ran
+   */
+  StopReason reason;
+  uint64_t cycles;
+
+  /**
+   * The address of the breakpoint the run stopped on, or -1
+   */
+  addr_t breakpoint;
+};
+
+/**
+ * Optional instrumentation of run_jobs()
+ */
+struct JobOptions {
+  /**
+   * How many worker threads to use; 1 or less runs the jobs on the calling thread
+   */
+  int threads = 1;
+
+  /**
+   * Where to record spans, or nullptr
+   */
+  SpanTrace* spans = nullptr;
+
+  /**
+   * Where to record the latencies of load_state, run chunks, save_state and
+   * (in run_jobs() only) whole jobs, or nullptr
+   */
+  LatencyStats* latencies = nullptr;
+};
+
+/**
+ * Run one job on the calling thread
+ *
+ * @param job What to do
+ * @param index The job's number in spans
+ * @param options Where to record spans and latencies
+ * @return How it went
+ */
+JobResult run_job(const EmulatorJob& job, int64_t index, const JobOptions& options);
+
+/**
+ * Run a batch of jobs
+ *
+ * The workers take the jobs in order, one at a time, as they finish the
+ * previous one. Returns when all the jobs are done.
+ *
+ * @param jobs What to do
+ * @param results One result per job, in the same order
+ * @param options How many threads to use and where to record spans
+ * @return How many jobs loaded, ran without errors and saved their output
+ */
+size_t run_jobs(std::span<const EmulatorJob> jobs, std::span<JobResult> results, const JobOptions& options);
+
+/**
+ * @return The name of a stop reason, e.g. "breakpoint"
+ */
+const char* stop_reason_name(StopReason reason);
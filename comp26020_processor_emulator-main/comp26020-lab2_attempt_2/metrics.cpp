@@ -0,0 +1,334 @@
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include "metrics.h"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define METRICS_UNIX_SOCKETS
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+// How long the exporter waits at most before checking whether it was stopped
+#define METRICS_POLL_MS 100
+
+// How long the exporter waits for a client to send its request, if it sends one
+#define METRICS_REQUEST_MS 50
+
+// ============= Per-thread counters ==============
+/**
+ * The pool of slots, which of them are taken, and the totals of the threads that gave theirs back
+ */
+struct MetricsRegistry {
+  std::mutex mutex;
+  MetricsSlot slots[METRICS_MAX_THREADS];
+  bool live[METRICS_MAX_THREADS] = {};
+  MetricsSlot overflow;
+  uint64_t retired[NUM_METRICS] = {};
+
+  MetricsRegistry() {
+    overflow.shared = true;
+  }
+};
+
+/**
+ * Built in static storage on first use, and never destroyed, so threads can
+ * still give their slots back during static destruction
+ */
+static MetricsRegistry& registry() {
+  alignas(MetricsRegistry) static unsigned char storage[sizeof(MetricsRegistry)];
+  static MetricsRegistry* instance = new (storage) MetricsRegistry();
+  return *instance;
+}
+
+MetricsSlot* metrics_claim() {
+  MetricsRegistry& metrics = registry();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  metrics_current = &metrics.overflow;
+  for (int i = 0; i < METRICS_MAX_THREADS; ++i) {
+    if (!metrics.live[i]) {
+      metrics.live[i] = true;
+      metrics_current = &metrics.slots[i];
+      break;
+    }
+  }
+  return metrics_current;
+}
+
+/**
+ * Gives a registered thread's slot back to the pool when the thread exits
+ */
+struct MetricsThread {
+  ~MetricsThread() {
+    MetricsSlot* slot = metrics_current;
+    metrics_current = nullptr;
+    if (slot == nullptr || slot->shared)
+      return;
+
+    MetricsRegistry& metrics = registry();
+    std::lock_guard<std::mutex> lock(metrics.mutex);
+    for (int metric = 0; metric < NUM_METRICS; ++metric) {
+      metrics.retired[metric] += slot->value[metric].load(std::memory_order_relaxed);
+      slot->value[metric].store(0, std::memory_order_relaxed);
+    }
+    metrics.live[slot - metrics.slots] = false;
+  }
+};
+
+void metrics_register_thread() {
+  thread_local MetricsThread thread;
+  (void)thread;
+  metrics_slot();
+}
+
+MetricsSnapshot metrics_snapshot() {
+  MetricsSnapshot snapshot;
+  MetricsRegistry& metrics = registry();
+  std::lock_guard<std::mutex> lock(metrics.mutex);
+  for (int metric = 0; metric < NUM_METRICS; ++metric)
+    snapshot.value[metric] = metrics.retired[metric] + metrics.overflow.value[metric].load(std::memory_order_relaxed);
+  for (int i = 0; i < METRICS_MAX_THREADS; ++i)
+    if (metrics.live[i])
+      for (int metric = 0; metric < NUM_METRICS; ++metric)
+        snapshot.value[metric] += metrics.slots[i].value[metric].load(std::memory_order_relaxed);
+  snapshot.time = std::chrono::steady_clock::now();
+  return snapshot;
+}
+
+double metrics_rate(const MetricsSnapshot& before, const MetricsSnapshot& after) {
+  double seconds = std::chrono::duration<double>(after.time - before.time).count();
+  if (seconds <= 0)
+    return 0;
+  return (after.value[METRIC_INSTRUCTIONS] - before.value[METRIC_INSTRUCTIONS]) / seconds;
+}
+
+// ============= Text format ==============
+/**
+ * Append one metric: its HELP and TYPE lines, and its sample
+ */
+static void append_metric(std::string& text, const char* name, const char* type, const char* help,
+                          const char* value) {
+  text += "# HELP ";
+  text += name;
+  text += " ";
+  text += help;
+  text += "\n# TYPE ";
+  text += name;
+  text += " ";
+  text += type;
+  text += "\n";
+  text += name;
+  text += " ";
+  text += value;
+  text += "\n";
+}
+
+std::string metrics_text(const MetricsSnapshot& snapshot, double cycles_per_second) {
+  std::string text;
+  char value[32];
+
+  snprintf(value, sizeof(value), "%" PRIu64, snapshot.value[METRIC_INSTRUCTIONS]);
+  append_metric(text, "emulator_instructions_total", "counter", "Instructions executed.", value);
+
+  snprintf(value, sizeof(value), "%.1f", cycles_per_second);
+  append_metric(text, "emulator_cycles_per_second", "gauge",
+                "Instructions executed per second since the previous scrape.", value);
+
+  snprintf(value, sizeof(value), "%" PRIu64, snapshot.value[METRIC_BREAKPOINT_HITS]);
+  append_metric(text, "emulator_breakpoint_hits_total", "counter", "Runs and steps that stopped on a breakpoint.",
+                value);
+
+  snprintf(value, sizeof(value), "%" PRIu64, snapshot.value[METRIC_JOBS_FINISHED]);
+  append_metric(text, "emulator_jobs_total", "counter", "Jobs finished.", value);
+
+  // A job can start on one thread's counters and finish on another's, but the sums agree
+  int64_t in_flight = (int64_t)(snapshot.value[METRIC_JOBS_STARTED] - snapshot.value[METRIC_JOBS_FINISHED]);
+  snprintf(value, sizeof(value), "%" PRId64, in_flight);
+  append_metric(text, "emulator_jobs_in_flight", "gauge", "Jobs started and not finished yet.", value);
+
+  return text;
+}
+
+// ============= MetricsExporter ==============
+MetricsExporter::MetricsExporter()
+    : _interval(std::chrono::milliseconds(5000)), _listener(-1), _running(false),
+      _previous_scrape(metrics_snapshot()), _previous_file(_previous_scrape) {
+}
+
+MetricsExporter::~MetricsExporter() {
+  stop();
+}
+
+int MetricsExporter::is_running() const {
+  return _running.load();
+}
+
+std::string MetricsExporter::text(MetricsSnapshot& previous) {
+  MetricsSnapshot snapshot = metrics_snapshot();
+  std::lock_guard<std::mutex> lock(_mutex);
+  double rate = metrics_rate(previous, snapshot);
+  previous = snapshot;
+  return metrics_text(snapshot, rate);
+}
+
+std::string MetricsExporter::scrape() {
+  return text(_previous_scrape);
+}
+
+int MetricsExporter::write_file() {
+  std::string contents = text(_previous_file);
+  std::string temporary = _file_path + ".tmp";
+  FILE* fp = fopen(temporary.c_str(), "w");
+  if (fp == NULL)
+    return 0;
+  size_t written = fwrite(contents.data(), 1, contents.size(), fp);
+  if (fclose(fp) != 0 || written != contents.size()) {
+    remove(temporary.c_str());
+    return 0;
+  }
+
+#ifdef _WIN32
+  // rename() doesn't replace existing files on Windows
+  remove(_file_path.c_str());
+#endif
+  return rename(temporary.c_str(), _file_path.c_str()) == 0;
+}
+
+int MetricsExporter::start(const std::string socket_path, const std::string file_path,
+                           std::chrono::milliseconds interval) {
+  if (_running.load())
+    return 0;
+
+  _socket_path = socket_path;
+  _file_path = file_path;
+  _interval = interval < std::chrono::milliseconds(1) ? std::chrono::milliseconds(1) : interval;
+  _listener = -1;
+
+  if (!socket_path.empty()) {
+#ifdef METRICS_UNIX_SOCKETS
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+      return 0;
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size() + 1);
+
+    _listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (_listener < 0)
+      return 0;
+
+    // A socket left behind by a previous process would make bind() fail
+    unlink(socket_path.c_str());
+    if (bind(_listener, (sockaddr*)&address, sizeof(address)) != 0 || listen(_listener, 16) != 0) {
+      close(_listener);
+      _listener = -1;
+      return 0;
+    }
+#else
+    return 0;
+#endif
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _previous_scrape = metrics_snapshot();
+    _previous_file = _previous_scrape;
+  }
+  _running.store(true);
+  _thread = std::thread(&MetricsExporter::serve, this);
+  return 1;
+}
+
+void MetricsExporter::stop() {
+  if (!_running.exchange(false))
+    return;
+  _thread.join();
+
+#ifdef METRICS_UNIX_SOCKETS
+  if (_listener >= 0) {
+    close(_listener);
+    unlink(_socket_path.c_str());
+  }
+#endif
+  _listener = -1;
+
+  if (!_file_path.empty())
+    write_file();
+}
+
+void MetricsExporter::serve() {
+  using Clock = std::chrono::steady_clock;
+  Clock::time_point next_write = Clock::now();
+
+  while (_running.load()) {
+    std::chrono::milliseconds wait(METRICS_POLL_MS);
+    if (!_file_path.empty()) {
+      Clock::time_point now = Clock::now();
+      if (now >= next_write) {
+        write_file();
+        next_write = now + _interval;
+      }
+      auto until_write = std::chrono::duration_cast<std::chrono::milliseconds>(next_write - now);
+      if (until_write < wait)
+        wait = until_write;
+    }
+
+#ifdef METRICS_UNIX_SOCKETS
+    if (_listener >= 0) {
+      pollfd listener = {_listener, POLLIN, 0};
+      if (poll(&listener, 1, (int)wait.count()) > 0 && (listener.revents & POLLIN)) {
+        int client = accept(_listener, NULL, NULL);
+        if (client >= 0) {
+          answer(client);
+          close(client);
+        }
+      }
+      continue;
+    }
+#endif
+    std::this_thread::sleep_for(wait);
+  }
+}
+
+void MetricsExporter::answer(int client) {
+#ifdef METRICS_UNIX_SOCKETS
+  // Wait briefly for a request: HTTP clients send one, plain readers don't
+  char request[1024];
+  ssize_t received = 0;
+  pollfd readable = {client, POLLIN, 0};
+  if (poll(&readable, 1, METRICS_REQUEST_MS) > 0 && (readable.revents & POLLIN))
+    received = recv(client, request, sizeof(request), 0);
+  const bool http = received >= 4 && (memcmp(request, "GET ", 4) == 0 || memcmp(request, "HEAD", 4) == 0);
+
+  std::string body = scrape();
+  std::string response;
+  if (http) {
+    char header[160];
+    snprintf(header, sizeof(header),
+             "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n"
+             "Connection: close\r\n\r\n",
+             body.size());
+    response = header;
+  }
+  response += body;
+
+#ifdef MSG_NOSIGNAL
+  const int flags = MSG_NOSIGNAL;
+#else
+  const int flags = 0;
+#endif
+  size_t sent = 0;
+  while (sent < response.size()) {
+    ssize_t n = send(client, response.data() + sent, response.size() - sent, flags);
+    if (n <= 0)
+      break;
+    sent += n;
+  }
+  shutdown(client, SHUT_WR);
+#else
+  (void)client;
+#endif
+}
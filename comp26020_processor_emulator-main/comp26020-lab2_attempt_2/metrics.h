@@ -0,0 +1,190 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: metrics.h
+//
+// Process-wide emulator metrics in the Prometheus text format, for node-local
+// scraping: served on a Unix domain socket and/or rewritten into a file every
+// few seconds by a MetricsExporter.
+//
+// Every thread counts into its own cache line (one relaxed load and store,
+// no read-modify-write, no sharing), and readers add up all the threads'
+// counters when they take a snapshot. The slots come from a fixed pool, so
+// a thread's first count takes a lock but never allocates. Threads that call
+// metrics_register_thread() give their slot back when they exit, folding
+// their counts into a total kept by the registry, so nothing is lost.
+// -----------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+/**
+ * What is counted
+ */
+enum Metric {
+  METRIC_INSTRUCTIONS,    // Instructions executed by run() and friends, and step()
+  METRIC_BREAKPOINT_HITS, // Runs and steps that stopped on a breakpoint
+  METRIC_JOBS_STARTED,    // Jobs started by run_job()
+  METRIC_JOBS_FINISHED,   // Jobs finished by run_job(); started - finished are in flight
+  NUM_METRICS
+};
+
+// How many threads can have a slot of their own at once; the rest share one
+#define METRICS_MAX_THREADS 256
+
+/**
+ * One thread's counters, alone on their cache line(s)
+ */
+struct alignas(64) MetricsSlot {
+  std::atomic<uint64_t> value[NUM_METRICS];
+
+  // Set on the slot shared by the threads that didn't get one of their own
+  bool shared = false;
+};
+
+/**
+ * The calling thread's slot, or nullptr until it counts something
+ *
+ * A plain pointer, so that the first use doesn't register a destructor
+ * (which allocates) either.
+ */
+inline thread_local MetricsSlot* metrics_current = nullptr;
+
+/**
+ * Give the calling thread a slot from the pool, without allocating
+ *
+ * @return The slot, or the shared one if the pool is used up
+ */
+MetricsSlot* metrics_claim();
+
+/**
+ * Claim the calling thread's slot now, and give it back to the pool when the thread exits
+ *
+ * Without this a thread claims its slot on its first count and keeps it
+ * for good, so threads that are started over and over (like job workers)
+ * should call this when they start.
+ */
+void metrics_register_thread();
+
+/**
+ * @return The calling thread's slot
+ */
+inline MetricsSlot& metrics_slot() {
+  MetricsSlot* slot = metrics_current;
+  return slot != nullptr ? *slot : *metrics_claim();
+}
+
+/**
+ * Add to one of the calling thread's counters
+ *
+ * Only this thread writes its own slot, so a plain load and store is
+ * enough; the atomics only make the concurrent reads well-defined.
+ */
+inline void metrics_add(Metric metric, uint64_t amount) {
+  MetricsSlot& slot = metrics_slot();
+  std::atomic<uint64_t>& value = slot.value[metric];
+  if (slot.shared)
+    value.fetch_add(amount, std::memory_order_relaxed);
+  else
+    value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+}
+
+/**
+ * The sum of all the threads' counters at one point in time
+ */
+struct MetricsSnapshot {
+  uint64_t value[NUM_METRICS];
+  std::chrono::steady_clock::time_point time;
+};
+
+/**
+ * @return The counters of all the threads, live and exited, added up
+ */
+MetricsSnapshot metrics_snapshot();
+
+/**
+ * Format a snapshot in the Prometheus text exposition format (version 0.0.4)
+ *
+ * @param snapshot The counters
+ * @param cycles_per_second The emulation speed to report, e.g. from rate()
+ * @return One HELP, TYPE and sample line per metric
+ */
+std::string metrics_text(const MetricsSnapshot& snapshot, double cycles_per_second);
+
+/**
+ * @return The instructions (i.e. cycles) per second between two snapshots, or 0 if no time passed
+ */
+double metrics_rate(const MetricsSnapshot& before, const MetricsSnapshot& after);
+
+/**
+ * Serves the metrics on a Unix domain socket and rewrites them into a file, from a background thread
+ *
+ * The socket answers every connection with the current metrics and closes
+ * it. Clients that send an HTTP request (e.g. curl --unix-socket) get an
+ * HTTP response; others (e.g. socat) get the bare text. The file is written
+ * under a temporary name and renamed over the old one, so readers never see
+ * half of it. cycles/sec is measured since the previous scrape for the
+ * socket and scrape(), and since the previous write for the file, so that
+ * neither resets the other's window.
+ */
+class MetricsExporter {
+  public:
+    MetricsExporter();
+    ~MetricsExporter();
+
+    MetricsExporter(const MetricsExporter& other) = delete;
+    MetricsExporter& operator=(const MetricsExporter& other) = delete;
+
+    /**
+     * Start serving
+     *
+     * @param socket_path Where to create the socket (replacing any stale one), or empty for no socket
+     * @param file_path The file to rewrite, or empty for no file
+     * @param interval How often to rewrite the file
+     * @return 1 for success, 0 if already started, or the socket couldn't be created (or on platforms without Unix sockets)
+     */
+    int start(const std::string socket_path, const std::string file_path,
+              std::chrono::milliseconds interval = std::chrono::milliseconds(5000));
+
+    /**
+     * Stop serving, remove the socket and write the file one last time
+     */
+    void stop();
+
+    /**
+     * @return 1 between start() and stop()
+     */
+    int is_running() const;
+
+    /**
+     * @return The current metrics, as served on the socket; also restarts its cycles/sec measurement
+     */
+    std::string scrape();
+
+  private:
+    /**
+     * @param previous The snapshot cycles/sec is measured from, replaced with the current one
+     * @return The current metrics
+     */
+    std::string text(MetricsSnapshot& previous);
+
+    void serve();
+    void answer(int client);
+    int write_file();
+
+    std::string _socket_path;
+    std::string _file_path;
+    std::chrono::milliseconds _interval;
+    int _listener;
+    std::atomic<bool> _running;
+    std::thread _thread;
+
+    // Guards the previous snapshots: one for the socket, one for the file
+    std::mutex _mutex;
+    MetricsSnapshot _previous_scrape;
+    MetricsSnapshot _previous_file;
+};
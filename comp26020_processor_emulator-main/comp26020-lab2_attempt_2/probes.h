@@ -0,0 +1,45 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: probes.h
+//
+// SystemTap/USDT static probes, for bpftrace and friends, under the provider
+// name "emulator". They are only compiled in when the build is configured
+// with -DEMULATOR_USDT=ON (which needs sys/sdt.h, e.g. from
+// systemtap-sdt-dev); otherwise the macros expand to nothing and don't even
+// evaluate their arguments.
+//
+// A compiled-in probe is a single nop until a tracer attaches to it, e.g.
+//   bpftrace -e 'usdt:./trace-replay:emulator:run_exit { @[arg0] = count(); }'
+//
+// Probes:
+//   run_entry(steps, cycles)                        run_detailed() starts, or run_many() for each emulator
+//   run_exit(reason, cycles run, cycles)            run_detailed() returns, or an emulator leaves run_many()
+//   breakpoint_hit(pc, cycles)                      a run or step stops on a breakpoint
+//   load_state_entry(filename)                      load_state() starts
+//   load_state_return(filename, success)            load_state() returns
+//   save_state_entry(filename)                      save_state() starts
+//   save_state_return(filename, success)            save_state() returns
+//   code_invalidate(address, size)                  memory was replaced from outside the
+//                                                   program: anything decoded from it is stale
+//   self_modifying_store(pc, address, old, new)     an STR changed a byte that was already
+//                                                   fetched as part of an instruction
+// -----------------------------------------------------------------------------
+
+#ifdef EMULATOR_USDT
+
+#include <sys/sdt.h>
+
+#define EMULATOR_PROBE1(name, a) DTRACE_PROBE1(emulator, name, a)
+#define EMULATOR_PROBE2(name, a, b) DTRACE_PROBE2(emulator, name, a, b)
+#define EMULATOR_PROBE3(name, a, b, c) DTRACE_PROBE3(emulator, name, a, b, c)
+#define EMULATOR_PROBE4(name, a, b, c, d) DTRACE_PROBE4(emulator, name, a, b, c, d)
+
+#else
+
+#define EMULATOR_PROBE1(name, a) do {} while (0)
+#define EMULATOR_PROBE2(name, a, b) do {} while (0)
+#define EMULATOR_PROBE3(name, a, b, c) do {} while (0)
+#define EMULATOR_PROBE4(name, a, b, c, d) do {} while (0)
+
+#endif
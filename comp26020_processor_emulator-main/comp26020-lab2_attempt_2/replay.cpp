@@ -0,0 +1,685 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include "instructions.h"
+#include "replay.h"
+
+// The first byte of each item in the stream. Literal records have a non-zero
+// combination of the TAG_* field bits, saying which fields follow.
+#define TAG_CYCLE 0x01      // varint: cycle - cycle of the previous record
+#define TAG_PC 0x02         // byte
+#define TAG_INSTR 0x04      // bytes: opcode, operand
+#define TAG_ACC 0x08        // byte
+#define TAG_STORE 0x10      // bytes: flags, store_address, store_value
+#define TAG_RESERVED 0x20   // byte
+#define TAG_FIELDS 0x3f
+#define TAG_RUN 0x40        // varint: how many records were predicted correctly
+#define TAG_KEYFRAME 0x80   // varint record, varint cycle, bytes: acc, pc, memory
+
+// How many bytes the compressor buffers before writing them
+#define COMPRESS_BUFFER (1 << 20)
+
+// The end of the file: number of keyframes, number of records, last cycle, first gap
+#define TRACE_FOOTER_SIZE (4 * sizeof(uint64_t))
+
+// ============= Varints ==============
+
+static void put_varint(std::vector<byte_t>& out, uint64_t value) {
+  while (value >= 0x80) {
+    out.push_back((byte_t)(value | 0x80));
+    value >>= 7;
+  }
+  out.push_back((byte_t)value);
+}
+
+/**
+ * @return 1 for success, 0 if the varint runs past the end or is too long
+ */
+static int get_varint(const byte_t* data, uint64_t end, uint64_t& pos, uint64_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (pos >= end)
+      return 0;
+    byte_t byte = data[pos++];
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+// ============= The model ==============
+
+/**
+ * The processor as far as the trace knows it, used to predict the next record
+ *
+ * Both the compressor and the decompressor keep one, and change it in the
+ * same way, so they always make the same predictions.
+ */
+struct TraceModel {
+  ProcessorState state;
+  uint64_t cycle = 0;
+
+  // What the last step() or apply() changed, for undo()
+  addr_t undo_pc;
+  data_t undo_acc;
+  uint64_t undo_cycle;
+  int undo_size;
+  addr_t undo_address[4];
+  byte_t undo_value[4];
+
+  /**
+   * Predict the next record by executing the next instruction
+   */
+  TraceRecord step();
+
+  /**
+   * Make the model agree with a record that wasn't predicted
+   */
+  void apply(const TraceRecord& record);
+
+  /**
+   * Take back the last step() or apply()
+   */
+  void undo();
+
+  void begin() {
+    undo_pc = state.pc;
+    undo_acc = state.acc;
+    undo_cycle = cycle;
+    undo_size = 0;
+  }
+
+  void save(addr_t address) {
+    undo_address[undo_size] = address & ARCH_BITMASK;
+    undo_value[undo_size] = state.memory[address & ARCH_BITMASK];
+    ++undo_size;
+  }
+
+  void execute(InstructionData data) {
+    const InstructionBase* instr = InstructionBase::lookupInstruction(data);
+    if (instr == NULL) {
+      state.pc = (state.pc + INSTRUCTION_SIZE) & ARCH_BITMASK;
+      return;
+    }
+    // Only STR writes memory, and only there
+    save(data.address);
+    instr->execute(state);
+  }
+};
+
+TraceRecord TraceModel::step() {
+  begin();
+
+  TraceRecord record;
+  record.cycle = cycle + 1;
+  record.pc = state.pc & ARCH_BITMASK;
+  record.opcode = state.memory[record.pc];
+  record.operand = state.memory[(record.pc + 1) & ARCH_BITMASK];
+
+  execute({record.opcode, record.operand});
+
+  record.acc = state.acc & ARCH_BITMASK;
+  record.flags = record.opcode == STR ? TRACE_STORE : 0;
+  record.store_address = record.opcode == STR ? record.operand : 0;
+  record.store_value = record.opcode == STR ? state.memory[record.operand] : 0;
+  record.reserved = 0;
+  cycle = record.cycle;
+  return record;
+}
+
+void TraceModel::apply(const TraceRecord& record) {
+  begin();
+
+  // The record says what the instruction was, and what acc ended up as
+  state.pc = record.pc;
+  save(record.pc);
+  state.memory[record.pc] = record.opcode;
+  save(record.pc + 1);
+  state.memory[(record.pc + 1) & ARCH_BITMASK] = record.operand;
+
+  // JNE looks at acc, and doesn't change it, so acc before is acc after
+  state.acc = record.acc;
+  execute({record.opcode, record.operand});
+  state.acc = record.acc;
+
+  if (record.flags & TRACE_STORE) {
+    save(record.store_address);
+    state.memory[record.store_address] = record.store_value;
+  }
+  cycle = record.cycle;
+}
+
+void TraceModel::undo() {
+  for (int i = undo_size - 1; i >= 0; --i)
+    state.memory[undo_address[i]] = undo_value[i];
+  state.pc = undo_pc;
+  state.acc = undo_acc;
+  cycle = undo_cycle;
+  undo_size = 0;
+}
+
+// ============= Compression ==============
+
+static void put_keyframe(std::vector<byte_t>& out, const TraceModel& model, uint64_t record) {
+  out.push_back(TAG_KEYFRAME);
+  put_varint(out, record);
+  put_varint(out, model.cycle);
+  out.push_back((byte_t)model.state.acc);
+  out.push_back((byte_t)model.state.pc);
+  out.insert(out.end(), model.state.memory, model.state.memory + MEMORY_SIZE);
+}
+
+static void put_run(std::vector<byte_t>& out, uint64_t& run) {
+  if (run == 0)
+    return;
+  out.push_back(TAG_RUN);
+  put_varint(out, run);
+  run = 0;
+}
+
+static void put_literal(std::vector<byte_t>& out, const TraceRecord& predicted, const TraceRecord& record,
+                        uint64_t last_cycle) {
+  byte_t tag = 0;
+  if (record.cycle != predicted.cycle)
+    tag |= TAG_CYCLE;
+  if (record.pc != predicted.pc)
+    tag |= TAG_PC;
+  if (record.opcode != predicted.opcode || record.operand != predicted.operand)
+    tag |= TAG_INSTR;
+  if (record.acc != predicted.acc)
+    tag |= TAG_ACC;
+  if (record.flags != predicted.flags || record.store_address != predicted.store_address ||
+      record.store_value != predicted.store_value)
+    tag |= TAG_STORE;
+  if (record.reserved != predicted.reserved)
+    tag |= TAG_RESERVED;
+
+  out.push_back(tag);
+  if (tag & TAG_CYCLE)
+    put_varint(out, record.cycle - last_cycle);
+  if (tag & TAG_PC)
+    out.push_back(record.pc);
+  if (tag & TAG_INSTR) {
+    out.push_back(record.opcode);
+    out.push_back(record.operand);
+  }
+  if (tag & TAG_ACC)
+    out.push_back(record.acc);
+  if (tag & TAG_STORE) {
+    out.push_back(record.flags);
+    out.push_back(record.store_address);
+    out.push_back(record.store_value);
+  }
+  if (tag & TAG_RESERVED)
+    out.push_back(record.reserved);
+}
+
+int compress_trace(const std::string trace_filename, const ProcessorState& initial, uint64_t initial_cycles,
+                   const std::string output_filename) {
+  FILE* in = open_trace(trace_filename);
+  if (in == nullptr)
+    return 0;
+
+  FILE* out = fopen(output_filename.c_str(), "wb");
+  if (out == nullptr) {
+    fclose(in);
+    return 0;
+  }
+
+  CompressedTraceHeader header;
+  memcpy(header.magic, TRACE_COMPRESSED_MAGIC, sizeof(header.magic));
+  header.version = TRACE_COMPRESSED_VERSION;
+  header.keyframe_interval = TRACE_KEYFRAME_INTERVAL;
+  int success = fwrite(&header, sizeof(header), 1, out) == 1;
+  uint64_t written = sizeof(header);
+
+  TraceModel model;
+  model.state = initial;
+  model.cycle = initial_cycles;
+
+  std::vector<TraceKeyframe> keyframes;
+  std::vector<byte_t> buffer;
+  buffer.reserve(COMPRESS_BUFFER + 2 * MEMORY_SIZE);
+
+  uint64_t num_records = 0;
+  uint64_t run = 0;
+  uint64_t first_gap = UINT64_MAX;
+  std::vector<TraceRecord> batch(TRACE_WRITE_BATCH);
+  size_t count;
+  do {
+    count = fread(batch.data(), sizeof(TraceRecord), batch.size(), in);
+    for (size_t i = 0; i < count; ++i) {
+      const TraceRecord& record = batch[i];
+
+      if (num_records % TRACE_KEYFRAME_INTERVAL == 0) {
+        put_run(buffer, run);
+        keyframes.push_back({num_records, model.cycle, written + buffer.size()});
+        put_keyframe(buffer, model, num_records);
+      }
+
+      const uint64_t last_cycle = model.cycle;
+      TraceRecord predicted = model.step();
+      if (memcmp(&predicted, &record, sizeof(TraceRecord)) == 0) {
+        ++run;
+      } else {
+        model.undo();
+        put_run(buffer, run);
+        put_literal(buffer, predicted, record, last_cycle);
+        model.apply(record);
+        if (first_gap == UINT64_MAX)
+          first_gap = record.cycle;
+      }
+      ++num_records;
+
+      if (buffer.size() >= COMPRESS_BUFFER) {
+        success &= fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+        written += buffer.size();
+        buffer.clear();
+      }
+    }
+  } while (count == batch.size());
+  fclose(in);
+
+  // An empty trace still gets the keyframe with the initial state
+  put_run(buffer, run);
+  if (keyframes.empty()) {
+    keyframes.push_back({0, model.cycle, written + buffer.size()});
+    put_keyframe(buffer, model, 0);
+  }
+  success &= fwrite(buffer.data(), 1, buffer.size(), out) == buffer.size();
+
+  uint64_t footer[4] = {keyframes.size(), num_records, model.cycle, first_gap};
+  success &= fwrite(keyframes.data(), sizeof(TraceKeyframe), keyframes.size(), out) == keyframes.size();
+  success &= fwrite(footer, sizeof(footer), 1, out) == 1;
+
+  if (fclose(out) != 0)
+    success = 0;
+  return success;
+}
+
+// ============= Decompression ==============
+
+/**
+ * Reads records out of the stream of a compressed trace, from a keyframe on
+ */
+struct TraceDecoder {
+  const byte_t* data;
+  uint64_t end;
+  uint64_t pos;
+  TraceModel model;
+  uint64_t run = 0;
+
+  /**
+   * @param data The whole file
+   * @param end Where the stream ends
+   * @param pos Where to start decoding, normally at a keyframe
+   */
+  TraceDecoder(const byte_t* data, uint64_t end, uint64_t pos) : data(data), end(end), pos(pos) {
+  }
+
+  /**
+   * Decode the next record
+   *
+   * @return 1 for success, 0 at the end of the stream or if it's corrupt
+   */
+  int next(TraceRecord& record);
+
+  int keyframe();
+};
+
+int TraceDecoder::keyframe() {
+  uint64_t record, cycle;
+  if (!get_varint(data, end, pos, record) || !get_varint(data, end, pos, cycle) || end - pos < 2 + MEMORY_SIZE)
+    return 0;
+
+  model.cycle = cycle;
+  model.state.acc = data[pos++];
+  model.state.pc = data[pos++];
+  memcpy(model.state.memory, &data[pos], MEMORY_SIZE);
+  pos += MEMORY_SIZE;
+  return 1;
+}
+
+int TraceDecoder::next(TraceRecord& record) {
+  while (run == 0) {
+    if (pos >= end)
+      return 0;
+
+    byte_t tag = data[pos++];
+    if (tag == TAG_KEYFRAME) {
+      if (!keyframe())
+        return 0;
+      continue;
+    }
+
+    if (tag == TAG_RUN) {
+      if (!get_varint(data, end, pos, run) || run == 0)
+        return 0;
+      continue;
+    }
+
+    if (tag == 0 || (tag & ~TAG_FIELDS) != 0)
+      return 0;
+
+    // A literal: the prediction with some fields replaced
+    const uint64_t last_cycle = model.cycle;
+    record = model.step();
+    model.undo();
+
+    uint64_t delta;
+    if ((tag & TAG_CYCLE) && !get_varint(data, end, pos, delta))
+      return 0;
+    int bytes = ((tag & TAG_PC) ? 1 : 0) + ((tag & TAG_INSTR) ? 2 : 0) + ((tag & TAG_ACC) ? 1 : 0) +
+                ((tag & TAG_STORE) ? 3 : 0) + ((tag & TAG_RESERVED) ? 1 : 0);
+    if (end - pos < (uint64_t)bytes)
+      return 0;
+
+    if (tag & TAG_CYCLE)
+      record.cycle = last_cycle + delta;
+    if (tag & TAG_PC)
+      record.pc = data[pos++];
+    if (tag & TAG_INSTR) {
+      record.opcode = data[pos++];
+      record.operand = data[pos++];
+    }
+    if (tag & TAG_ACC)
+      record.acc = data[pos++];
+    if (tag & TAG_STORE) {
+      record.flags = data[pos++];
+      record.store_address = data[pos++];
+      record.store_value = data[pos++];
+    }
+    if (tag & TAG_RESERVED)
+      record.reserved = data[pos++];
+
+    model.apply(record);
+    return 1;
+  }
+
+  --run;
+  record = model.step();
+  return 1;
+}
+
+int decompress_trace(const std::string filename, std::vector<TraceRecord>& records) {
+  TraceReplay replay;
+  if (!replay.open(filename))
+    return 0;
+  return replay.read_records(0, replay.num_records(), records);
+}
+
+// ============= TraceReplay ==============
+int TraceReplay::open(const std::string filename) {
+  _data.clear();
+  _keyframes.clear();
+  _num_records = 0;
+  _last_cycle = 0;
+  _first_gap = UINT64_MAX;
+  _stream_end = 0;
+
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (fp == nullptr)
+    return 0;
+
+  byte_t chunk[1 << 16];
+  size_t count;
+  while ((count = fread(chunk, 1, sizeof(chunk), fp)) > 0)
+    _data.insert(_data.end(), chunk, chunk + count);
+  fclose(fp);
+
+  CompressedTraceHeader header;
+  if (_data.size() < sizeof(header) + TRACE_FOOTER_SIZE)
+    return 0;
+  memcpy(&header, _data.data(), sizeof(header));
+  if (memcmp(header.magic, TRACE_COMPRESSED_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_COMPRESSED_VERSION || header.keyframe_interval != TRACE_KEYFRAME_INTERVAL)
+    return 0;
+
+  uint64_t footer[4];
+  memcpy(footer, &_data[_data.size() - TRACE_FOOTER_SIZE], sizeof(footer));
+  const uint64_t num_keyframes = footer[0];
+  const uint64_t index_size = num_keyframes * sizeof(TraceKeyframe);
+  if (num_keyframes == 0 || index_size / sizeof(TraceKeyframe) != num_keyframes ||
+      index_size > _data.size() - sizeof(header) - TRACE_FOOTER_SIZE)
+    return 0;
+
+  _stream_end = _data.size() - TRACE_FOOTER_SIZE - index_size;
+  _keyframes.resize(num_keyframes);
+  memcpy(_keyframes.data(), &_data[_stream_end], index_size);
+  _num_records = footer[1];
+  _last_cycle = footer[2];
+  _first_gap = footer[3];
+
+  for (const TraceKeyframe& keyframe : _keyframes)
+    if (keyframe.offset < sizeof(header) || keyframe.offset >= _stream_end)
+      return 0;
+  return 1;
+}
+
+uint64_t TraceReplay::num_records() const {
+  return _num_records;
+}
+
+uint64_t TraceReplay::first_cycle() const {
+  return _keyframes.empty() ? 0 : _keyframes[0].cycle;
+}
+
+uint64_t TraceReplay::last_cycle() const {
+  return _last_cycle;
+}
+
+uint64_t TraceReplay::first_gap() const {
+  return _first_gap;
+}
+
+const std::vector<TraceKeyframe>& TraceReplay::keyframes() const {
+  return _keyframes;
+}
+
+int TraceReplay::state_at(uint64_t cycle, ProcessorState& state, uint64_t& state_cycles) const {
+  if (_keyframes.empty() || cycle < first_cycle() || cycle >= _first_gap)
+    return 0;
+
+  // The last keyframe at or before the cycle
+  auto after = std::upper_bound(_keyframes.begin(), _keyframes.end(), cycle,
+                                [](uint64_t c, const TraceKeyframe& keyframe) { return c < keyframe.cycle; });
+  const TraceKeyframe& keyframe = *(after - 1);
+
+  TraceDecoder decoder(_data.data(), _stream_end, keyframe.offset);
+  if (_data[decoder.pos++] != TAG_KEYFRAME || !decoder.keyframe())
+    return 0;
+
+  // Decode until the next record is past the cycle, and take that one back
+  TraceRecord record;
+  for (uint64_t index = keyframe.record; index < _num_records; ++index) {
+    if (!decoder.next(record))
+      return 0;
+    if (record.cycle > cycle) {
+      decoder.model.undo();
+      break;
+    }
+  }
+
+  state = decoder.model.state;
+  state.rehash();
+  state_cycles = decoder.model.cycle;
+  return 1;
+}
+
+int TraceReplay::read_records(uint64_t first, uint64_t count, std::vector<TraceRecord>& records) const {
+  records.clear();
+  if (_keyframes.empty() || first > _num_records || count > _num_records - first)
+    return 0;
+  if (count == 0)
+    return 1;
+
+  const TraceKeyframe& keyframe = _keyframes[first / TRACE_KEYFRAME_INTERVAL];
+  TraceDecoder decoder(_data.data(), _stream_end, keyframe.offset);
+
+  TraceRecord record;
+  for (uint64_t index = keyframe.record; index < first; ++index)
+    if (!decoder.next(record))
+      return 0;
+
+  records.reserve(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    if (!decoder.next(record))
+      return 0;
+    records.push_back(record);
+  }
+  return 1;
+}
+
+// ============= TraceIndex ==============
+void TraceIndex::reset(const ProcessorState& initial, uint64_t initial_cycles, TraceModel& model) {
+  for (int address = 0; address < MEMORY_SIZE; ++address)
+    _writes[address].clear();
+  _checkpoints.clear();
+  _num_records = 0;
+  _initial_cycles = initial_cycles;
+  _first_gap = UINT64_MAX;
+  _exact_records = 0;
+
+  model.state = initial;
+  model.cycle = initial_cycles;
+}
+
+int TraceIndex::add(const TraceRecord& record, TraceModel& model) {
+  if (record.cycle <= model.cycle || record.cycle - _initial_cycles > TRACE_INDEX_MAX_CYCLES)
+    return 0;
+
+  // Until the first gap, every record is what the last state predicts
+  if (_first_gap == UINT64_MAX) {
+    if (_num_records % TRACE_INDEX_CHECKPOINT == 0)
+      _checkpoints.push_back(model.state);
+
+    TraceRecord predicted = model.step();
+    model.undo();
+    if (memcmp(&predicted, &record, sizeof(TraceRecord)) != 0) {
+      _first_gap = record.cycle;
+      _exact_records = _num_records;
+    }
+  }
+
+  model.apply(record);
+  ++_num_records;
+
+  if (record.flags & TRACE_STORE)
+    _writes[record.store_address].push_back((record.cycle - _initial_cycles) << 16 | record.pc << 8 |
+                                            record.store_value);
+  return 1;
+}
+
+void TraceIndex::finish(const TraceModel& model) {
+  if (_first_gap == UINT64_MAX)
+    _exact_records = _num_records;
+
+  // An empty trace still has its initial state
+  if (_checkpoints.empty())
+    _checkpoints.push_back(model.state);
+}
+
+int TraceIndex::build(const std::vector<TraceRecord>& records, const ProcessorState& initial,
+                      uint64_t initial_cycles) {
+  TraceModel model;
+  reset(initial, initial_cycles, model);
+
+  for (const TraceRecord& record : records)
+    if (!add(record, model))
+      return 0;
+
+  finish(model);
+  return 1;
+}
+
+int TraceIndex::build(const TraceReplay& replay) {
+  ProcessorState initial;
+  uint64_t initial_cycles;
+  if (!replay.state_at(replay.first_cycle(), initial, initial_cycles))
+    return 0;
+
+  TraceModel model;
+  reset(initial, initial_cycles, model);
+
+  // One keyframe interval at a time, so that the whole trace is never decoded at once
+  std::vector<TraceRecord> records;
+  for (uint64_t first = 0; first < replay.num_records(); first += TRACE_KEYFRAME_INTERVAL) {
+    uint64_t count = std::min<uint64_t>(TRACE_KEYFRAME_INTERVAL, replay.num_records() - first);
+    if (!replay.read_records(first, count, records))
+      return 0;
+    for (const TraceRecord& record : records)
+      if (!add(record, model))
+        return 0;
+  }
+
+  finish(model);
+  return 1;
+}
+
+uint64_t TraceIndex::num_records() const {
+  return _num_records;
+}
+
+uint64_t TraceIndex::first_gap() const {
+  return _first_gap;
+}
+
+static TraceWrite unpack_write(uint64_t packed, uint64_t initial_cycles) {
+  return {(packed >> 16) + initial_cycles, (byte_t)(packed >> 8), (byte_t)packed};
+}
+
+int TraceIndex::last_writer(addr_t address, uint64_t cycle, TraceWrite& write) const {
+  if (cycle >= _first_gap)
+    return -1;
+  if (cycle <= _initial_cycles)
+    return 0;
+
+  // Everything written at or before the cycle packs to less than this
+  const uint64_t offset = std::min<uint64_t>(cycle - _initial_cycles, TRACE_INDEX_MAX_CYCLES);
+  const uint64_t limit = (offset << 16) | 0xffff;
+
+  const std::vector<uint64_t>& list = _writes[address & ARCH_BITMASK];
+  auto after = std::upper_bound(list.begin(), list.end(), limit);
+  if (after == list.begin())
+    return 0;
+  write = unpack_write(*(after - 1), _initial_cycles);
+  return 1;
+}
+
+int TraceIndex::value_at(addr_t address, uint64_t cycle) const {
+  if (_checkpoints.empty() || cycle < _initial_cycles || cycle >= _first_gap)
+    return -1;
+
+  TraceWrite write;
+  if (last_writer(address, cycle, write) == 1)
+    return write.value;
+  return _checkpoints[0].memory[address & ARCH_BITMASK];
+}
+
+int TraceIndex::state_at(uint64_t cycle, ProcessorState& state, uint64_t& state_cycles) const {
+  if (_checkpoints.empty() || cycle < _initial_cycles || cycle >= _first_gap)
+    return 0;
+
+  // Before the first gap there is one record per cycle
+  const uint64_t count = std::min<uint64_t>(cycle - _initial_cycles, _exact_records);
+  const uint64_t checkpoint = std::min<uint64_t>(count / TRACE_INDEX_CHECKPOINT, _checkpoints.size() - 1);
+
+  TraceModel model;
+  model.state = _checkpoints[checkpoint];
+  model.cycle = _initial_cycles + checkpoint * TRACE_INDEX_CHECKPOINT;
+  while (model.cycle < _initial_cycles + count)
+    model.step();
+
+  state = model.state;
+  state.rehash();
+  state_cycles = model.cycle;
+  return 1;
+}
+
+std::vector<TraceWrite> TraceIndex::writes(addr_t address) const {
+  std::vector<TraceWrite> writes;
+  for (uint64_t packed : _writes[address & ARCH_BITMASK])
+    writes.push_back(unpack_write(packed, _initial_cycles));
+  return writes;
+}
@@ -0,0 +1,317 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: replay.h
+//
+// Compressed traces, and reconstructing the processor state at any cycle
+// from them.
+//
+// A raw trace (see trace.h) spends 16 bytes per cycle, although almost all of
+// it is predictable: the next pc follows from the last instruction, the
+// instruction is whatever the memory holds at the pc, acc follows from the
+// instruction, and only STR writes memory. The compressor keeps a model of
+// the processor, starting from the state the trace was recorded from, and
+// predicts each record by executing one instruction on it. A record is then
+// stored as the fields the prediction got wrong (cycle as a varint delta,
+// the rest as bytes), and consecutive correctly predicted records as a single
+// varint run length. Predictions only go wrong after records were dropped,
+// so straight-line code and loops shrink to almost nothing.
+//
+// Records only carry the stores they made, so the stores of dropped records
+// are lost for good: after a gap the model takes pc, acc and the instruction
+// from the next record, but its memory may be wrong from then on. The cycle
+// of the first record that wasn't predicted is kept in the file as the first
+// gap, and states at or after it are refused rather than rebuilt wrongly.
+// Only traces without dropped records replay exactly to the end. (Changing
+// the emulator from outside while it is recording, e.g. with restore(), is
+// invisible to the trace, and isn't detected until a prediction fails.)
+//
+// Every TRACE_KEYFRAME_INTERVAL records the model's whole state is stored as
+// a keyframe, and an index of the keyframes sits at the end of the file. The
+// state at any cycle is rebuilt from the closest keyframe before it, so it
+// costs at most TRACE_KEYFRAME_INTERVAL records of decoding instead of
+// re-emulating from the start.
+//
+// File format: a CompressedTraceHeader, the encoded stream, the keyframe
+// index (one TraceKeyframe per keyframe), then the number of keyframes, the
+// number of records, the last cycle and the first gap (UINT64_MAX if there
+// is none) as uint64_t, all in host byte order.
+//
+// A TraceIndex answers questions about the whole history of a trace: who
+// last wrote an address before some cycle and what the address held then,
+// by binary search over the writes to that address, and the whole state at
+// any cycle, by re-executing from the closest of its sparse checkpoints.
+// -----------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+#include "common.h"
+#include "trace.h"
+
+// How many records there are between keyframes
+#define TRACE_KEYFRAME_INTERVAL (1 << 16)
+
+// How many records there are between the checkpoints of a TraceIndex
+#define TRACE_INDEX_CHECKPOINT 4096
+
+// The first bytes of every compressed trace file
+#define TRACE_COMPRESSED_MAGIC "EMUTRACZ"
+#define TRACE_COMPRESSED_VERSION 2
+
+/**
+ * The start of a compressed trace file
+ */
+struct CompressedTraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t keyframe_interval;
+};
+
+/**
+ * Where to find a keyframe, in the index at the end of a compressed trace
+ */
+struct TraceKeyframe {
+  /**
+   * How many records come before the keyframe
+   */
+  uint64_t record;
+
+  /**
+   * The cycle count of the state in the keyframe
+   */
+  uint64_t cycle;
+
+  /**
+   * Where the keyframe starts in the file
+   */
+  uint64_t offset;
+};
+
+/**
+ * Compress a raw trace
+ *
+ * @param trace_filename The trace written by a TraceRecorder
+ * @param initial The processor state the recording started from
+ * @param initial_cycles The cycle count the recording started from (Emulator::cycles())
+ * @param output_filename The compressed trace to write
+ * @return 1 for success, 0 if a file couldn't be read or written
+ */
+int compress_trace(const std::string trace_filename, const ProcessorState& initial, uint64_t initial_cycles,
+                   const std::string output_filename);
+
+/**
+ * Decompress a whole compressed trace, giving back the records of the raw trace
+ *
+ * @param filename The compressed trace
+ * @param records Filled in with the records
+ * @return 1 for success, 0 if the file couldn't be read or is corrupt
+ */
+int decompress_trace(const std::string filename, std::vector<TraceRecord>& records);
+
+/**
+ * Random access to the processor states of a compressed trace
+ */
+class TraceReplay {
+  public:
+    /**
+     * Read a compressed trace into memory
+     *
+     * @param filename The compressed trace
+     * @return 1 for success, 0 if the file couldn't be read or isn't a compressed trace
+     */
+    int open(const std::string filename);
+
+    /**
+     * @return How many records the trace has
+     */
+    uint64_t num_records() const;
+
+    /**
+     * @return The cycle count the recording started from
+     */
+    uint64_t first_cycle() const;
+
+    /**
+     * @return The cycle count after the last record
+     */
+    uint64_t last_cycle() const;
+
+    /**
+     * @return The cycle of the first record that wasn't predicted, after dropped records, or UINT64_MAX if
+     *         every record was
+     */
+    uint64_t first_gap() const;
+
+    /**
+     * Rebuild the processor state after the last record whose cycle is at most `cycle`
+     *
+     * @param cycle The cycle count to go to
+     * @param state Filled in with the state
+     * @param state_cycles Filled in with the cycle count of that state
+     * @return 1 for success, 0 if `cycle` is before the start of the trace, at or after first_gap(), or the file
+     *         is corrupt
+     */
+    int state_at(uint64_t cycle, ProcessorState& state, uint64_t& state_cycles) const;
+
+    /**
+     * Decode the records in [first, first + count)
+     *
+     * @param first The index of the first record
+     * @param count How many records
+     * @param records Filled in with the records
+     * @return 1 for success, 0 if the range is out of bounds or the file is corrupt
+     */
+    int read_records(uint64_t first, uint64_t count, std::vector<TraceRecord>& records) const;
+
+    /**
+     * @return The keyframe index
+     */
+    const std::vector<TraceKeyframe>& keyframes() const;
+
+  private:
+    std::vector<byte_t> _data;
+    std::vector<TraceKeyframe> _keyframes;
+    uint64_t _num_records = 0;
+    uint64_t _last_cycle = 0;
+    uint64_t _first_gap = UINT64_MAX;
+    uint64_t _stream_end = 0;
+};
+
+// Defined in replay.cpp: the processor as rebuilt from the records
+struct TraceModel;
+
+// How many cycles after the start of the trace a TraceIndex can hold: the
+// cycle of a write is packed into the top 48 bits of a uint64_t
+#define TRACE_INDEX_MAX_CYCLES ((1ULL << 48) - 1)
+
+/**
+ * One memory write in a trace
+ */
+struct TraceWrite {
+  /**
+   * The cycle count after the STR, like TraceRecord::cycle
+   */
+  uint64_t cycle;
+
+  /**
+   * The pc of the STR
+   */
+  byte_t pc;
+
+  /**
+   * The value written
+   */
+  byte_t value;
+};
+
+/**
+ * An index over a whole trace, for finding out how any byte got its value
+ *
+ * For every address it keeps the writes in cycle order, 8 bytes each, and
+ * every TRACE_INDEX_CHECKPOINT records it keeps a checkpoint with the whole
+ * state. Nothing is kept for records that don't write memory: until the
+ * first gap every record follows from the one before, so state_at() gets
+ * them back by executing at most TRACE_INDEX_CHECKPOINT instructions from
+ * the closest checkpoint.
+ */
+class TraceIndex {
+  public:
+    /**
+     * Index a compressed trace
+     *
+     * @param replay An open compressed trace
+     * @return 1 for success, 0 if the trace is corrupt or longer than TRACE_INDEX_MAX_CYCLES
+     */
+    int build(const TraceReplay& replay);
+
+    /**
+     * Index the records of a raw trace
+     *
+     * @param records The records, in the order they were recorded
+     * @param initial The processor state the recording started from
+     * @param initial_cycles The cycle count the recording started from
+     * @return 1 for success, 0 if the cycles of the records don't increase or go past TRACE_INDEX_MAX_CYCLES
+     */
+    int build(const std::vector<TraceRecord>& records, const ProcessorState& initial, uint64_t initial_cycles);
+
+    /**
+     * @return How many records were indexed
+     */
+    uint64_t num_records() const;
+
+    /**
+     * @return The cycle of the first record that doesn't follow from the state before it, after dropped
+     *         records, or UINT64_MAX if there is none. Nothing at or after it is answered.
+     */
+    uint64_t first_gap() const;
+
+    /**
+     * Find the last write to an address at or before a cycle
+     *
+     * @param address The address
+     * @param cycle The cycle count
+     * @param write Filled in with the write, if there is one
+     * @return 1 if there is a write, 0 if the address still had its initial value, -1 if `cycle` is at or after
+     *         first_gap()
+     */
+    int last_writer(addr_t address, uint64_t cycle, TraceWrite& write) const;
+
+    /**
+     * @param address The address
+     * @param cycle The cycle count
+     * @return The value of the address at that cycle, or -1 if the cycle is before the start of the trace or at
+     *         or after first_gap()
+     */
+    int value_at(addr_t address, uint64_t cycle) const;
+
+    /**
+     * Rebuild the processor state after the last record whose cycle is at most `cycle`
+     *
+     * The result can be loaded into an emulator with Emulator::restore().
+     *
+     * @param cycle The cycle count to go to
+     * @param state Filled in with the state
+     * @param state_cycles Filled in with the cycle count of that state
+     * @return 1 for success, 0 if `cycle` is before the start of the trace or at or after first_gap()
+     */
+    int state_at(uint64_t cycle, ProcessorState& state, uint64_t& state_cycles) const;
+
+    /**
+     * @param address The address
+     * @return All the writes to the address, in cycle order
+     */
+    std::vector<TraceWrite> writes(addr_t address) const;
+
+  private:
+    /**
+     * Start indexing from the initial state
+     */
+    void reset(const ProcessorState& initial, uint64_t initial_cycles, TraceModel& model);
+
+    /**
+     * Add the next record
+     *
+     * @param record The record
+     * @param model The state before the record, moved on to the state after it
+     * @return 1 for success, 0 if its cycle doesn't come after the previous one
+     */
+    int add(const TraceRecord& record, TraceModel& model);
+
+    /**
+     * Finish indexing after the last record
+     */
+    void finish(const TraceModel& model);
+
+    // For every address, the writes as (cycle - initial cycles) << 16 | pc << 8 | value
+    std::vector<uint64_t> _writes[MEMORY_SIZE];
+
+    // The state before record i * TRACE_INDEX_CHECKPOINT, up to the first gap
+    std::vector<ProcessorState> _checkpoints;
+
+    uint64_t _num_records = 0;
+    uint64_t _initial_cycles = 0;
+    uint64_t _first_gap = UINT64_MAX;
+
+    // How many records come before the first gap
+    uint64_t _exact_records = 0;
+};
@@ -0,0 +1,134 @@
+#include <atomic>
+#include <cinttypes>
+#include <cstdio>
+#include "spans.h"
+
+SpanTrace::SpanTrace() : _origin(Clock::now()) {
+}
+
+SpanTrace::Clock::time_point SpanTrace::now() const {
+  return Clock::now();
+}
+
+int SpanTrace::thread_id() {
+  static std::atomic<int> next_id(1);
+  thread_local int id = next_id.fetch_add(1);
+  return id;
+}
+
+void SpanTrace::add(const SpanEvent& event) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _events.push_back(event);
+}
+
+void SpanTrace::span(const char* name, Clock::time_point start, int64_t job, const char* arg_name, int64_t arg,
+                     const char* detail) {
+  Clock::time_point end = Clock::now();
+  SpanEvent event;
+  event.name = name;
+  event.phase = 'X';
+  event.tid = thread_id();
+  event.start = std::chrono::duration_cast<std::chrono::nanoseconds>(start - _origin).count();
+  event.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  event.job = job;
+  event.arg_name = arg_name;
+  event.arg = arg;
+  event.detail = detail;
+  add(event);
+}
+
+void SpanTrace::instant(const char* name, int64_t job, const char* arg_name, int64_t arg, const char* detail) {
+  SpanEvent event;
+  event.name = name;
+  event.phase = 'i';
+  event.tid = thread_id();
+  event.start = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _origin).count();
+  event.duration = 0;
+  event.job = job;
+  event.arg_name = arg_name;
+  event.arg = arg;
+  event.detail = detail;
+  add(event);
+}
+
+void SpanTrace::name_thread(const std::string name) {
+  std::lock_guard<std::mutex> lock(_mutex);
+  _thread_names.push_back({thread_id(), name});
+}
+
+size_t SpanTrace::size() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _events.size();
+}
+
+std::vector<SpanEvent> SpanTrace::events() const {
+  std::lock_guard<std::mutex> lock(_mutex);
+  return _events;
+}
+
+/**
+ * Write a string as a JSON string, escaping what needs escaping
+ */
+static void write_json_string(FILE* fp, const char* text) {
+  fputc('"', fp);
+  for (const char* c = text; *c != '\0'; ++c) {
+    if (*c == '"' || *c == '\\')
+      fprintf(fp, "\\%c", *c);
+    else if ((unsigned char)*c < 0x20)
+      fprintf(fp, "\\u%04x", *c);
+    else
+      fputc(*c, fp);
+  }
+  fputc('"', fp);
+}
+
+int SpanTrace::write(const std::string filename) const {
+  FILE* fp = fopen(filename.c_str(), "w");
+  if (fp == NULL)
+    return 0;
+
+  std::lock_guard<std::mutex> lock(_mutex);
+
+  // Timestamps are in microseconds, with nanoseconds after the point
+  fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+  const char* separator = "";
+  for (const auto& [tid, name] : _thread_names) {
+    fprintf(fp, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":", separator, tid);
+    write_json_string(fp, name.c_str());
+    fprintf(fp, "}}");
+    separator = ",\n";
+  }
+
+  for (const SpanEvent& event : _events) {
+    fprintf(fp, "%s{\"ph\":\"%c\",\"name\":", separator, event.phase);
+    write_json_string(fp, event.name);
+    fprintf(fp, ",\"pid\":1,\"tid\":%d,\"ts\":%" PRIu64 ".%03" PRIu64, event.tid, event.start / 1000,
+            event.start % 1000);
+    if (event.phase == 'X')
+      fprintf(fp, ",\"dur\":%" PRIu64 ".%03" PRIu64, event.duration / 1000, event.duration % 1000);
+    else
+      fprintf(fp, ",\"s\":\"t\"");
+
+    fprintf(fp, ",\"args\":{");
+    const char* arg_separator = "";
+    if (event.job >= 0) {
+      fprintf(fp, "\"job\":%" PRId64, event.job);
+      arg_separator = ",";
+    }
+    if (event.arg_name != nullptr) {
+      fprintf(fp, "%s", arg_separator);
+      write_json_string(fp, event.arg_name);
+      fprintf(fp, ":%" PRId64, event.arg);
+      arg_separator = ",";
+    }
+    if (event.detail != nullptr) {
+      fprintf(fp, "%s\"detail\":", arg_separator);
+      write_json_string(fp, event.detail);
+    }
+    fprintf(fp, "}}");
+    separator = ",\n";
+  }
+  fprintf(fp, "\n]}\n");
+
+  return fclose(fp) == 0;
+}
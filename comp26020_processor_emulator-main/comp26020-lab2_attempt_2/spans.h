@@ -0,0 +1,137 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: spans.h
+//
+// Wall-clock spans for the batch job runner (see jobs.h), exported in the
+// Chrome trace-event JSON format, which chrome://tracing and Perfetto
+// (ui.perfetto.dev, also offline) open directly. Each thread that records
+// gets its own track, so queueing, parsing and emulating can be compared
+// across workers.
+//
+// Spans are recorded around whole phases (a state file load, a run chunk),
+// never per instruction, so a mutex around the event list is cheap enough.
+// -----------------------------------------------------------------------------
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * One event of a SpanTrace
+ *
+ * The name, argument name and detail must be string literals (or otherwise
+ * outlive the trace): only the pointers are kept.
+ */
+struct SpanEvent {
+  const char* name;
+
+  /**
+   * 'X' for a span with a duration, 'i' for an instant
+   */
+  char phase;
+
+  /**
+   * The thread's track, see SpanTrace::thread_id()
+   */
+  int tid;
+
+  /**
+   * Nanoseconds since the trace was created
+   */
+  uint64_t start;
+  uint64_t duration;
+
+  /**
+   * The job the event belongs to, or -1
+   */
+  int64_t job;
+
+  /**
+   * An optional numeric argument, shown if arg_name isn't nullptr
+   */
+  const char* arg_name;
+  int64_t arg;
+
+  /**
+   * An optional string argument, shown as "detail" if it isn't nullptr
+   */
+  const char* detail;
+};
+
+/**
+ * A thread-safe collection of spans, written out as Chrome trace-event JSON
+ */
+class SpanTrace {
+  public:
+    using Clock = std::chrono::steady_clock;
+
+    SpanTrace();
+
+    SpanTrace(const SpanTrace& other) = delete;
+    SpanTrace& operator=(const SpanTrace& other) = delete;
+
+    /**
+     * @return The current time, for the start of a span
+     */
+    Clock::time_point now() const;
+
+    /**
+     * Record a span that started at `start` and ends now
+     *
+     * @param name What happened
+     * @param start When it started (from now())
+     * @param job The job it belongs to, or -1
+     * @param arg_name The name of a numeric argument, or nullptr for none
+     * @param arg The numeric argument
+     * @param detail A string argument, or nullptr for none
+     */
+    void span(const char* name, Clock::time_point start, int64_t job = -1, const char* arg_name = nullptr,
+              int64_t arg = 0, const char* detail = nullptr);
+
+    /**
+     * Record an instant event, e.g. a breakpoint stop
+     *
+     * Same parameters as span(), without the start.
+     */
+    void instant(const char* name, int64_t job = -1, const char* arg_name = nullptr, int64_t arg = 0,
+                 const char* detail = nullptr);
+
+    /**
+     * Name the calling thread's track, e.g. "worker 3"
+     */
+    void name_thread(const std::string name);
+
+    /**
+     * @return How many events were recorded
+     */
+    size_t size() const;
+
+    /**
+     * A copy of the events recorded so far
+     */
+    std::vector<SpanEvent> events() const;
+
+    /**
+     * Write everything recorded so far as Chrome trace-event JSON
+     *
+     * @param filename The file to write
+     * @return 1 for success, 0 otherwise
+     */
+    int write(const std::string filename) const;
+
+    /**
+     * @return A small number identifying the calling thread, the same for all traces
+     */
+    static int thread_id();
+
+  private:
+    void add(const SpanEvent& event);
+
+    const Clock::time_point _origin;
+    mutable std::mutex _mutex;
+    std::vector<SpanEvent> _events;
+    std::vector<std::pair<int, std::string>> _thread_names;
+};
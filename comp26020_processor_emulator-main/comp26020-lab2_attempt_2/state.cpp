@@ -0,0 +1,128 @@
+#include <bit>
+#include "state.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The memory is processed in blocks of this many bytes
+#define STATE_BLOCK 32
+
+static_assert(MEMORY_SIZE % STATE_BLOCK == 0, "the memory must be made of whole blocks");
+
+// One key per 64-bit word of the memory, for hash_state()
+struct HashKeys {
+  uint64_t key[MEMORY_SIZE / 8];
+
+  constexpr HashKeys() : key() {
+    for (int word = 0; word < MEMORY_SIZE / 8; ++word)
+      key[word] = mix64(0x9e3779b97f4a7c15ULL * (word + 1));
+  }
+};
+
+static constexpr HashKeys HASH_KEYS;
+
+// ============= StateDiff ==============
+int StateDiff::num_changed() const {
+  int count = 0;
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i)
+    count += std::popcount(memory[i]);
+  return count;
+}
+
+int StateDiff::empty() const {
+  return !acc && !pc && num_changed() == 0;
+}
+
+// ============= Comparisons ==============
+
+/**
+ * @return a bitmap of the (up to 32) bytes that differ between two blocks
+ */
+static inline uint32_t compare_block(const byte_t* a, const byte_t* b) {
+#if defined(__SSE2__)
+  __m128i low = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)a), _mm_loadu_si128((const __m128i*)b));
+  __m128i high = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + 16)), _mm_loadu_si128((const __m128i*)(b + 16)));
+  uint32_t same = (uint32_t)_mm_movemask_epi8(low) | ((uint32_t)_mm_movemask_epi8(high) << 16);
+  return ~same;
+#else
+  uint32_t changed = 0;
+  for (int i = 0; i < STATE_BLOCK; ++i)
+    changed |= (uint32_t)(a[i] != b[i]) << i;
+  return changed;
+#endif
+}
+
+bool operator==(const ProcessorState& a, const ProcessorState& b) {
+  if (a.acc != b.acc || a.pc != b.pc)
+    return false;
+
+  for (int offset = 0; offset < MEMORY_SIZE; offset += STATE_BLOCK)
+    if (compare_block(&a.memory[offset], &b.memory[offset]) != 0)
+      return false;
+
+  return true;
+}
+
+StateDiff diff(const ProcessorState& a, const ProcessorState& b) {
+  StateDiff result;
+  result.acc = a.acc != b.acc;
+  result.pc = a.pc != b.pc;
+
+  for (int i = 0; i < MEMORY_SIZE / 64; ++i)
+    result.memory[i] = 0;
+
+  // Two blocks per bitmap word
+  for (int offset = 0; offset < MEMORY_SIZE; offset += STATE_BLOCK) {
+    uint64_t changed = compare_block(&a.memory[offset], &b.memory[offset]);
+    result.memory[offset / 64] |= changed << (offset % 64);
+  }
+
+  return result;
+}
+
+// ============= Hashing ==============
+
+// The hash keeps four 64-bit lanes. Each 32-byte block adds one word to each
+// lane: the word is XOR'ed with its key, and the two 32-bit halves of the
+// result are multiplied together and added to the lane, along with the word
+// itself. 32x32->64 bit multiplies exist in SSE2, so two lanes at a time can
+// be updated in parallel, and the lanes are mixed together at the end.
+
+uint64_t hash_state(const ProcessorState& state) {
+  uint64_t lanes[4];
+
+#if defined(__SSE2__)
+  __m128i acc[2] = {_mm_setzero_si128(), _mm_setzero_si128()};
+  for (int offset = 0; offset < MEMORY_SIZE; offset += STATE_BLOCK) {
+    for (int half = 0; half < 2; ++half) {
+      __m128i data = _mm_loadu_si128((const __m128i*)&state.memory[offset + 16 * half]);
+      __m128i key = _mm_loadu_si128((const __m128i*)&HASH_KEYS.key[offset / 8 + 2 * half]);
+      __m128i keyed = _mm_xor_si128(data, key);
+      acc[half] = _mm_add_epi64(acc[half], _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32)));
+      acc[half] = _mm_add_epi64(acc[half], data);
+    }
+  }
+  _mm_storeu_si128((__m128i*)&lanes[0], acc[0]);
+  _mm_storeu_si128((__m128i*)&lanes[2], acc[1]);
+#else
+  for (int lane = 0; lane < 4; ++lane)
+    lanes[lane] = 0;
+  for (int offset = 0; offset < MEMORY_SIZE; offset += STATE_BLOCK) {
+    for (int lane = 0; lane < 4; ++lane) {
+      // Little-endian, like the SIMD loads, whatever the host
+      uint64_t data = 0;
+      for (int byte = 7; byte >= 0; --byte)
+        data = (data << 8) | state.memory[offset + 8 * lane + byte];
+      uint64_t keyed = data ^ HASH_KEYS.key[offset / 8 + lane];
+      lanes[lane] += (keyed & 0xffffffff) * (keyed >> 32);
+      lanes[lane] += data;
+    }
+  }
+#endif
+
+  uint64_t hash = mix64(((uint64_t)(uint32_t)state.acc << 32) | (uint32_t)state.pc);
+  for (int lane = 0; lane < 4; ++lane)
+    hash = mix64(hash + lanes[lane]);
+  return hash;
+}
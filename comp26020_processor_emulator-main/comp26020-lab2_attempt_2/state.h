@@ -0,0 +1,76 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: state.h
+//
+// Comparing and hashing whole processor states: equality, a bitmap of the
+// memory bytes that differ, and a 64-bit hash. They work on the memory in
+// 32-byte blocks, with SSE2 on x86-64 targets and plain C++ everywhere else.
+// Both versions give the same results, so hashes can be compared across
+// builds.
+// -----------------------------------------------------------------------------
+
+#include <cstddef>
+#include <functional>
+#include "common.h"
+
+/**
+ * Which parts of two processor states differ
+ */
+struct StateDiff {
+  /**
+   * One bit per memory byte, set if the byte differs (bit i % 64 of word i / 64)
+   */
+  uint64_t memory[MEMORY_SIZE / 64];
+
+  /**
+   * 1 if the accumulators differ, 0 otherwise
+   */
+  int acc;
+
+  /**
+   * 1 if the pcs differ, 0 otherwise
+   */
+  int pc;
+
+  /**
+   * @return the number of memory bytes that differ
+   */
+  int num_changed() const;
+
+  /**
+   * @return 1 if the states are the same, 0 otherwise
+   */
+  int empty() const;
+};
+
+/**
+ * Two states are equal if acc, pc and every memory byte are equal
+ *
+ * memory_hash is derived from the memory, so it's not compared.
+ */
+bool operator==(const ProcessorState& a, const ProcessorState& b);
+
+/**
+ * Find out which parts of two states differ
+ *
+ * @return the acc/pc flags and the bitmap of memory bytes that differ
+ */
+StateDiff diff(const ProcessorState& a, const ProcessorState& b);
+
+/**
+ * A 64-bit hash of acc, pc and the memory
+ *
+ * Equal states have equal hashes, on every platform and build.
+ */
+uint64_t hash_state(const ProcessorState& state);
+
+/**
+ * Lets processor states key unordered containers
+ */
+template <>
+struct std::hash<ProcessorState> {
+  size_t operator()(const ProcessorState& state) const noexcept {
+    return hash_state(state);
+  }
+};
@@ -0,0 +1,161 @@
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: trace-replay.cpp
+//
+// Command line front end for traces:
+//
+//   trace-replay record STATE CYCLES TRACE
+//       Run the program in the state file for up to CYCLES cycles, recording a raw trace
+//   trace-replay compress STATE TRACE COMPRESSED
+//       Compress a raw trace recorded from the state file
+//   trace-replay state COMPRESSED CYCLE OUTPUT
+//       Write the state at CYCLE, in the load_state() format, without re-emulating
+//   trace-replay writer COMPRESSED ADDRESS CYCLE [ADDRESS CYCLE]...
+//       Print the last write to each ADDRESS at or before its CYCLE
+//   trace-replay info COMPRESSED
+//       Print the size and the cycle range of a compressed trace, and where records were dropped
+// -----------------------------------------------------------------------------
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "emulator.h"
+#include "replay.h"
+#include "trace.h"
+
+static int usage() {
+  fprintf(stderr,
+          "usage: trace-replay record STATE CYCLES TRACE\n"
+          "       trace-replay compress STATE TRACE COMPRESSED\n"
+          "       trace-replay state COMPRESSED CYCLE OUTPUT\n"
+          "       trace-replay writer COMPRESSED ADDRESS CYCLE [ADDRESS CYCLE]...\n"
+          "       trace-replay info COMPRESSED\n");
+  return 2;
+}
+
+static int record(const char* state_filename, uint64_t cycles, const char* trace_filename) {
+  Emulator emulator;
+  if (!emulator.load_state(state_filename)) {
+    fprintf(stderr, "cannot load %s\n", state_filename);
+    return 1;
+  }
+
+  TraceRecorder recorder;
+  if (!recorder.start(trace_filename)) {
+    fprintf(stderr, "cannot create %s\n", trace_filename);
+    return 1;
+  }
+  emulator.set_trace(&recorder);
+  RunResult result = emulator.run_detailed(cycles);
+  if (!recorder.stop()) {
+    fprintf(stderr, "cannot write %s\n", trace_filename);
+    return 1;
+  }
+
+  printf("%" PRIu64 " cycles, %" PRIu64 " records, %" PRIu64 " dropped\n", result.cycles, recorder.recorded(),
+         recorder.dropped());
+  return 0;
+}
+
+static int compress(const char* state_filename, const char* trace_filename, const char* output_filename) {
+  Emulator emulator;
+  if (!emulator.load_state(state_filename)) {
+    fprintf(stderr, "cannot load %s\n", state_filename);
+    return 1;
+  }
+
+  if (!compress_trace(trace_filename, emulator.read_state(), emulator.cycles(), output_filename)) {
+    fprintf(stderr, "cannot compress %s into %s\n", trace_filename, output_filename);
+    return 1;
+  }
+  return 0;
+}
+
+static int state(const char* compressed_filename, uint64_t cycle, const char* output_filename) {
+  TraceReplay replay;
+  if (!replay.open(compressed_filename)) {
+    fprintf(stderr, "cannot read %s\n", compressed_filename);
+    return 1;
+  }
+
+  ProcessorState state;
+  uint64_t state_cycles;
+  if (!replay.state_at(cycle, state, state_cycles)) {
+    if (cycle >= replay.first_gap())
+      fprintf(stderr, "cycle %" PRIu64 " is after records were dropped at %" PRIu64 " in %s\n", cycle,
+              replay.first_gap(), compressed_filename);
+    else
+      fprintf(stderr, "cycle %" PRIu64 " is not in %s\n", cycle, compressed_filename);
+    return 1;
+  }
+
+  Emulator emulator;
+  if (!emulator.restore(state, state_cycles) || !emulator.save_state(output_filename)) {
+    fprintf(stderr, "cannot write %s\n", output_filename);
+    return 1;
+  }
+  return 0;
+}
+
+static int writer(const char* compressed_filename, int num_queries, char** queries) {
+  TraceReplay replay;
+  TraceIndex index;
+  if (!replay.open(compressed_filename) || !index.build(replay)) {
+    fprintf(stderr, "cannot read %s\n", compressed_filename);
+    return 1;
+  }
+
+  // Indexing decodes the whole trace once, then every query is a binary search
+  for (int query = 0; query < num_queries; ++query) {
+    addr_t address = atoi(queries[2 * query]) & ARCH_BITMASK;
+    uint64_t cycle = strtoull(queries[2 * query + 1], NULL, 10);
+
+    TraceWrite write;
+    int found = index.last_writer(address, cycle, write);
+    if (found < 0) {
+      fprintf(stderr, "cycle %" PRIu64 " is after records were dropped at %" PRIu64 "\n", cycle, index.first_gap());
+      return 1;
+    }
+
+    if (!found)
+      printf("%d: initial value %d\n", address, index.value_at(address, replay.first_cycle()));
+    else
+      printf("cycle %" PRIu64 ": STR at %d wrote %d\n", write.cycle, write.pc, write.value);
+  }
+  return 0;
+}
+
+static int info(const char* compressed_filename) {
+  TraceReplay replay;
+  if (!replay.open(compressed_filename)) {
+    fprintf(stderr, "cannot read %s\n", compressed_filename);
+    return 1;
+  }
+
+  printf("records %" PRIu64 "\n", replay.num_records());
+  printf("cycles %" PRIu64 " to %" PRIu64 "\n", replay.first_cycle(), replay.last_cycle());
+  printf("keyframes %zu\n", replay.keyframes().size());
+  if (replay.first_gap() == UINT64_MAX)
+    printf("exact to the end\n");
+  else
+    printf("records dropped at cycle %" PRIu64 ", later states are unknown\n", replay.first_gap());
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 3)
+    return usage();
+
+  if (strcmp(argv[1], "record") == 0 && argc == 5)
+    return record(argv[2], strtoull(argv[3], NULL, 10), argv[4]);
+  if (strcmp(argv[1], "compress") == 0 && argc == 5)
+    return compress(argv[2], argv[3], argv[4]);
+  if (strcmp(argv[1], "state") == 0 && argc == 5)
+    return state(argv[2], strtoull(argv[3], NULL, 10), argv[4]);
+  if (strcmp(argv[1], "writer") == 0 && argc >= 5 && argc % 2 == 1)
+    return writer(argv[2], (argc - 3) / 2, argv + 3);
+  if (strcmp(argv[1], "info") == 0 && argc == 3)
+    return info(argv[2]);
+  return usage();
+}
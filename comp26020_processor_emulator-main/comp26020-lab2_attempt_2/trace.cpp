@@ -0,0 +1,146 @@
+#include <chrono>
+#include <cstring>
+#include "trace.h"
+
+// ============= TraceRing ==============
+TraceRing::TraceRing(size_t capacity) : _head(0), _cached_tail(0), _tail(0), _cached_head(0) {
+  size_t size = 1;
+  while (size < capacity)
+    size *= 2;
+  _records.resize(size);
+  _mask = size - 1;
+}
+
+size_t TraceRing::pop(TraceRecord* out, size_t max) {
+  const uint64_t tail = _tail.load(std::memory_order_relaxed);
+  if (_cached_head == tail)
+    _cached_head = _head.load(std::memory_order_acquire);
+
+  size_t count = _cached_head - tail;
+  if (count > max)
+    count = max;
+  for (size_t i = 0; i < count; ++i)
+    out[i] = _records[(tail + i) & _mask];
+
+  _tail.store(tail + count, std::memory_order_release);
+  return count;
+}
+
+void TraceRing::clear() {
+  _head.store(0);
+  _cached_tail = 0;
+  _tail.store(0);
+  _cached_head = 0;
+}
+
+// ============= TraceRecorder ==============
+TraceRecorder::TraceRecorder(size_t capacity) : _ring(capacity), _stopping(0), _recording(false) {
+}
+
+TraceRecorder::~TraceRecorder() {
+  stop();
+}
+
+int TraceRecorder::start(const std::string filename) {
+  if (_file != nullptr)
+    return 0;
+
+  _file = fopen(filename.c_str(), "wb");
+  if (_file == nullptr)
+    return 0;
+
+  TraceHeader header;
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.record_size = sizeof(TraceRecord);
+  _write_failed = fwrite(&header, sizeof(header), 1, _file) != 1;
+
+  // stop() drained the ring, but start from a known empty one anyway
+  _ring.clear();
+  _recorded = 0;
+  _dropped = 0;
+  _stopping.store(0);
+  _writer = std::thread(&TraceRecorder::drain, this);
+  _recording.store(true);
+  return 1;
+}
+
+int TraceRecorder::stop() {
+  if (_file == nullptr)
+    return 0;
+
+  // Later records are ignored, and everything recorded so far is in the
+  // ring before the writer sees the flag
+  _recording.store(false);
+  _stopping.store(1, std::memory_order_release);
+  _writer.join();
+
+  int success = !_write_failed;
+  if (fclose(_file) != 0)
+    success = 0;
+  _file = nullptr;
+  return success;
+}
+
+int TraceRecorder::is_recording() const {
+  return _file != nullptr;
+}
+
+uint64_t TraceRecorder::recorded() const {
+  return _recorded;
+}
+
+uint64_t TraceRecorder::dropped() const {
+  return _dropped;
+}
+
+void TraceRecorder::drain() {
+  std::vector<TraceRecord> batch(TRACE_WRITE_BATCH);
+
+  while (true) {
+    // Look at the flag before the ring, so that the last pop sees every record
+    int stopping = _stopping.load(std::memory_order_acquire);
+
+    size_t count = _ring.pop(batch.data(), batch.size());
+    if (count > 0) {
+      if (fwrite(batch.data(), sizeof(TraceRecord), count, _file) != count)
+        _write_failed = 1;
+      continue;
+    }
+
+    if (stopping)
+      return;
+
+    // Nothing to write: the emulator is slower than the disk, or not running
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+  }
+}
+
+// ============= Reading ==============
+FILE* open_trace(const std::string filename) {
+  FILE* fp = fopen(filename.c_str(), "rb");
+  if (fp == nullptr)
+    return nullptr;
+
+  TraceHeader header;
+  if (fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord)) {
+    fclose(fp);
+    return nullptr;
+  }
+  return fp;
+}
+
+int read_trace(const std::string filename, std::vector<TraceRecord>& records) {
+  FILE* fp = open_trace(filename);
+  if (fp == nullptr)
+    return 0;
+
+  records.clear();
+  TraceRecord record;
+  while (fread(&record, sizeof(record), 1, fp) == 1)
+    records.push_back(record);
+
+  fclose(fp);
+  return 1;
+}
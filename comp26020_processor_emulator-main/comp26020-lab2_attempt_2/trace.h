@@ -0,0 +1,247 @@
+#pragma once
+// -----------------------------------------------------------------------------
+// Project: 8-bit accumulator-based emulator
+// File: trace.h
+//
+// Execution traces: one fixed-size record per executed instruction, written
+// to a binary file while the emulator runs (see Emulator::set_trace()).
+//
+// The emulator never waits for the file. It pushes records into a
+// single-producer single-consumer ring buffer, and a background thread moves
+// them from the ring to the file. If the ring is full, the record is dropped
+// and counted; the cycle numbers in the records show where the gaps are.
+//
+// File format: a TraceHeader, then TraceRecords until the end of the file,
+// all in host byte order.
+// -----------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common.h"
+
+// How many records the ring buffer holds by default (a power of two). 16 MB:
+// enough that the writer keeps up on a single core, where it only drains the
+// ring when the scheduler preempts the emulator
+#define TRACE_RING_SIZE (1 << 20)
+
+// How many records the writer thread moves to the file at once
+#define TRACE_WRITE_BATCH 4096
+
+// The first bytes of every trace file
+#define TRACE_MAGIC "EMUTRACE"
+#define TRACE_VERSION 1
+
+// TraceRecord::flags
+#define TRACE_STORE 1
+
+/**
+ * The start of a trace file
+ */
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+};
+
+/**
+ * What one executed instruction did
+ */
+struct TraceRecord {
+  /**
+   * The total cycle count after the instruction, i.e. Emulator::cycles()
+   */
+  uint64_t cycle;
+
+  /**
+   * The pc of the instruction, and the instruction
+   */
+  byte_t pc;
+  byte_t opcode;
+  byte_t operand;
+
+  /**
+   * The value of acc after the instruction
+   */
+  byte_t acc;
+
+  /**
+   * TRACE_STORE if the instruction wrote memory
+   */
+  byte_t flags;
+
+  /**
+   * The address written and the value written, or 0 if flags doesn't have TRACE_STORE
+   */
+  byte_t store_address;
+  byte_t store_value;
+
+  byte_t reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 16, "trace records are written to files as they are");
+
+/**
+ * A fixed-size ring buffer with one producer and one consumer thread
+ *
+ * Each side keeps a cached copy of the other side's index, so most pushes
+ * and pops don't touch the other side's cache line.
+ */
+class TraceRing {
+  public:
+    /**
+     * @param capacity How many records fit, rounded up to a power of two
+     */
+    explicit TraceRing(size_t capacity);
+
+    TraceRing(const TraceRing& other) = delete;
+    TraceRing& operator=(const TraceRing& other) = delete;
+
+    /**
+     * Add a record (producer only)
+     *
+     * @return 1 if the record was added, 0 if the ring was full
+     */
+    int push(const TraceRecord& record) {
+      const uint64_t head = _head.load(std::memory_order_relaxed);
+      if (head - _cached_tail == _records.size()) {
+        _cached_tail = _tail.load(std::memory_order_acquire);
+        if (head - _cached_tail == _records.size())
+          return 0;
+      }
+      _records[head & _mask] = record;
+      _head.store(head + 1, std::memory_order_release);
+      return 1;
+    }
+
+    /**
+     * Remove up to `max` records (consumer only)
+     *
+     * @param out Where to copy the records
+     * @param max How many records fit in out
+     * @return How many records were removed
+     */
+    size_t pop(TraceRecord* out, size_t max);
+
+    /**
+     * Empty the ring (neither side may be using it)
+     */
+    void clear();
+
+  private:
+    std::vector<TraceRecord> _records;
+    uint64_t _mask;
+
+    // Written by the producer
+    alignas(64) std::atomic<uint64_t> _head;
+    uint64_t _cached_tail;
+
+    // Written by the consumer
+    alignas(64) std::atomic<uint64_t> _tail;
+    uint64_t _cached_head;
+};
+
+/**
+ * Records executed instructions into a trace file
+ *
+ * One emulator at a time records into a recorder, from one thread, between
+ * start() and stop().
+ */
+class TraceRecorder {
+  public:
+    /**
+     * @param capacity How many records the ring buffer holds
+     */
+    explicit TraceRecorder(size_t capacity = TRACE_RING_SIZE);
+
+    /**
+     * Stops recording, if it's still recording
+     */
+    ~TraceRecorder();
+
+    TraceRecorder(const TraceRecorder& other) = delete;
+    TraceRecorder& operator=(const TraceRecorder& other) = delete;
+
+    /**
+     * Create the trace file and start the writer thread
+     *
+     * @param filename The file to write
+     * @return 1 for success, 0 if the file couldn't be created or it's already recording
+     */
+    int start(const std::string filename);
+
+    /**
+     * Write the remaining records, stop the writer thread and close the file
+     *
+     * @return 1 for success, 0 if it wasn't recording or writing failed
+     */
+    int stop();
+
+    /**
+     * @return 1 between start() and stop(), 0 otherwise
+     */
+    int is_recording() const;
+
+    /**
+     * Record one instruction, or drop it if the ring buffer is full
+     *
+     * Never blocks. Only called by the emulator. Records made while the
+     * recorder isn't recording (before start() or after stop()) are ignored,
+     * and not counted as dropped.
+     */
+    void record(const TraceRecord& record) {
+      if (!_recording.load(std::memory_order_relaxed))
+        return;
+      if (_ring.push(record))
+        ++_recorded;
+      else
+        ++_dropped;
+    }
+
+    /**
+     * @return How many records went into the ring buffer since start()
+     */
+    uint64_t recorded() const;
+
+    /**
+     * @return How many records were dropped because the ring buffer was full since start()
+     */
+    uint64_t dropped() const;
+
+  private:
+    /**
+     * The writer thread: moves records from the ring to the file until stop()
+     */
+    void drain();
+
+    TraceRing _ring;
+    FILE* _file = nullptr;
+    std::thread _writer;
+    std::atomic<int> _stopping;
+    std::atomic<bool> _recording;
+    int _write_failed = 0;
+
+    // Only touched by the recording thread
+    uint64_t _recorded = 0;
+    uint64_t _dropped = 0;
+};
+
+/**
+ * Open a trace file written by a TraceRecorder and check its header
+ *
+ * @param filename The file to open
+ * @return The file, positioned at the first record, or nullptr if it couldn't be read or isn't a trace
+ */
+FILE* open_trace(const std::string filename);
+
+/**
+ * Read a whole trace file written by a TraceRecorder
+ *
+ * @param filename The file to read
+ * @param records Filled in with the records, in the order they were recorded
+ * @return 1 for success, 0 if the file couldn't be read or isn't a trace
+ */
+int read_trace(const std::string filename, std::vector<TraceRecord>& records);